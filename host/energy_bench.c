@@ -0,0 +1,215 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Compare the cost and long-run accuracy of integrating channel energy in
+ * 64-bit integer centiamp-milliseconds, as pdu_integrate() in modbus.c does,
+ * against the double precision ampere-seconds of the original firmware.
+ *
+ * Polls of 16 channels are fed to each path with a jittered interval, for
+ * years of simulated polling, and every path is checked against the exact
+ * sum in centiamp-microseconds. On the ESP32, doubles are emulated in
+ * software, so the host understates what the double path costs there.
+ */
+#include <getopt.h>
+#include <time.h>
+
+#include "mgos.h"
+#include "modbus.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ENERGY_TICKS() __rdtsc()
+#define ENERGY_TICK_UNIT "cycles"
+#else
+#define ENERGY_TICKS() energy_clock_ns()
+#define ENERGY_TICK_UNIT "ns"
+#endif
+
+#define ENERGY_RING 1024  // Polls of input, replayed over and over
+
+struct energy_opts {
+  double years;
+  int interval_ms;
+  int jitter_us;  // Polls are interval_ms +/- jitter_us apart
+  double max_ppm;  // Of the integer path, or 0 to not check
+};
+
+static uint16_t s_raw[ENERGY_RING][PDU_NUM_CHANNELS];
+static int64_t s_delta_us[ENERGY_RING];
+
+static double s_amp_secs[PDU_NUM_CHANNELS];      // Double, as the original
+static uint64_t s_cams_trunc[PDU_NUM_CHANNELS];  // Integer, truncating
+static uint64_t s_cams[PDU_NUM_CHANNELS];        // Integer, as modbus.c
+static int64_t s_sample_us = 0, s_last_sample_us = 0;
+static unsigned __int128 s_exact[PDU_NUM_CHANNELS];  // centiamp-microseconds
+
+static inline uint64_t energy_clock_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Fill the input ring with currents of 0 to 16A and jittered intervals.
+static void energy_fill(const struct energy_opts *opts) {
+  uint32_t x = 1;
+
+  for (int p = 0; p < ENERGY_RING; p++) {
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+      x = x * 1664525 + 1013904223;
+      s_raw[p][i] = (x >> 16) % 1601;
+    }
+    x = x * 1664525 + 1013904223;
+    s_delta_us[p] = (int64_t) opts->interval_ms * 1000 +
+                    (int64_t) ((x >> 8) % (2 * opts->jitter_us + 1)) -
+                    opts->jitter_us;
+  }
+}
+
+// The original firmware: ampere-seconds in a double, per poll.
+static void energy_poll_double(const uint16_t *raw, int64_t delta_us) {
+  double delta = delta_us / 1e6;
+
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    s_amp_secs[i] += raw[i] * 0.01 * delta;
+}
+
+// Integer centiamp-milliseconds, dropping the sub-millisecond remainder.
+static void energy_poll_trunc(const uint16_t *raw, int64_t delta_us) {
+  uint32_t delta_ms = (uint32_t) (delta_us / 1000);
+
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    s_cams_trunc[i] += (uint64_t) raw[i] * delta_ms;
+}
+
+// Integer centiamp-milliseconds, carrying the remainder as modbus.c does.
+static void energy_poll_int(const uint16_t *raw, int64_t delta_us) {
+  int64_t delta_ms;
+
+  s_sample_us += delta_us;
+  delta_ms = (s_sample_us - s_last_sample_us) / 1000;
+  s_last_sample_us += delta_ms * 1000;
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    s_cams[i] += (uint64_t) raw[i] * (uint32_t) delta_ms;
+}
+
+static void energy_poll_exact(const uint16_t *raw, int64_t delta_us) {
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    s_exact[i] += (unsigned __int128) raw[i] * delta_us;
+}
+
+// Run a path over the input ring and return the ticks per poll.
+static double energy_time(void (*poll)(const uint16_t *, int64_t),
+                          int rounds) {
+  uint64_t start = ENERGY_TICKS();
+
+  for (int r = 0; r < rounds; r++)
+    for (int p = 0; p < ENERGY_RING; p++) poll(s_raw[p], s_delta_us[p]);
+  return (double) (ENERGY_TICKS() - start) / ((double) rounds * ENERGY_RING);
+}
+
+static void energy_report(const char *name, double ticks, double total_cams,
+                          double exact_cams) {
+  double kwh_per_cams = PDU_VOLTAGE / 360000000000.;
+
+  printf("%-18s %10.1f %16.6f %12.4f %12.3f\n", name, ticks,
+         total_cams * kwh_per_cams,
+         1e6 * (total_cams - exact_cams) / exact_cams,
+         1000 * (total_cams - exact_cams) * kwh_per_cams);
+}
+
+static double energy_sum(const uint64_t *cams) {
+  double sum = 0;
+
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) sum += cams[i];
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  struct energy_opts opts = {10, 5000, 2000, 0};
+  double ticks_double, ticks_trunc, ticks_int, amp_secs = 0, exact = 0;
+  uint64_t polls;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "y:i:j:m:h")) != -1) {
+    switch (opt) {
+      case 'y':
+        opts.years = atof(optarg);
+        break;
+      case 'i':
+        opts.interval_ms = atoi(optarg);
+        break;
+      case 'j':
+        opts.jitter_us = atoi(optarg);
+        break;
+      case 'm':
+        opts.max_ppm = atof(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-y YEARS] [-i INTERVAL_MS] [-j JITTER_US] "
+                "[-m MAX_PPM]\n",
+                argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (opts.years <= 0 || opts.interval_ms <= 0 || opts.jitter_us < 0 ||
+      opts.jitter_us >= opts.interval_ms * 1000) {
+    fprintf(stderr, "Invalid options\n");
+    return 2;
+  }
+  energy_fill(&opts);
+
+  // Time the paths over the ring, from a warm cache, before the long run.
+  ticks_double = energy_time(energy_poll_double, 1000);
+  ticks_trunc = energy_time(energy_poll_trunc, 1000);
+  ticks_int = energy_time(energy_poll_int, 1000);
+  memset(s_amp_secs, 0, sizeof(s_amp_secs));
+  memset(s_cams_trunc, 0, sizeof(s_cams_trunc));
+  memset(s_cams, 0, sizeof(s_cams));
+  s_sample_us = s_last_sample_us = 0;
+
+  polls = (uint64_t) (opts.years * 365.25 * 86400 * 1000 / opts.interval_ms);
+  for (uint64_t n = 0; n < polls; n++) {
+    const uint16_t *raw = s_raw[n % ENERGY_RING];
+    int64_t delta_us = s_delta_us[n % ENERGY_RING];
+    energy_poll_double(raw, delta_us);
+    energy_poll_trunc(raw, delta_us);
+    energy_poll_int(raw, delta_us);
+    energy_poll_exact(raw, delta_us);
+  }
+
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+    amp_secs += s_amp_secs[i];
+    exact += s_exact[i] / 1000.;
+  }
+  printf("%llu polls of %d channels, %dms +/- %dus apart (%.1f years)\n",
+         (unsigned long long) polls, PDU_NUM_CHANNELS, opts.interval_ms,
+         opts.jitter_us, opts.years);
+  printf("%-18s %10s %16s %12s %12s\n", "path",
+         ENERGY_TICK_UNIT "/poll", "total kWh", "drift ppm", "drift Wh");
+  energy_report("double amp-secs", ticks_double, amp_secs * 100000, exact);
+  energy_report("int, truncating", ticks_trunc, energy_sum(s_cams_trunc),
+                exact);
+  energy_report("int, modbus.c", ticks_int, energy_sum(s_cams), exact);
+
+  if (opts.max_ppm > 0 &&
+      fabs(1e6 * (energy_sum(s_cams) - exact) / exact) > opts.max_ppm) {
+    fprintf(stderr, "Integer path drifted more than %.3f ppm\n",
+            opts.max_ppm);
+    return 1;
+  }
+  return 0;
+}
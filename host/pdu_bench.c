@@ -0,0 +1,317 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Run the firmware against simulated sensors for a stretch of simulated time,
+ * and report how many polls it handled, how long its response handler took,
+ * and how far each channel's energy counter is off the exact integral of the
+ * simulated current.
+ */
+#include <getopt.h>
+
+#include "budget.h"
+#include "freertos/FreeRTOS.h"
+#include "host.h"
+#include "modbus.h"
+#include "sim.h"
+#include "trace.h"
+
+struct bench_opts {
+  double seconds;
+  int sensors;
+  enum sim_profile profile;
+  struct sim_config sim;
+  double max_error;  // Percent, or 0 to not check
+  int min_stack;     // Bytes of stack every task must keep free, or 0
+  char *output;      // File to write the ampere-seconds per channel to
+  bool soft_reset;   // Restart the Modbus code at the end, keeping RTC memory
+};
+
+static const char *s_profile_names[] = {"constant", "sine", "square", "noise"};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -t SECONDS   Simulated time to run (default 3600)\n"
+          "  -n SENSORS   Number of sensors, 1..%d (default 1)\n"
+          "  -p PROFILE   constant, sine, square or noise (default sine)\n"
+          "  -b BAUD      Baud rate of the bus (default 9600)\n"
+          "  -e RATE      Fraction of requests that time out (default 0)\n"
+          "  -r RATE      Fraction of responses with a bad CRC (default 0)\n"
+          "  -a FRACTION  When in the round trip sensors sample (default 0.5)\n"
+          "  -c KEY=VAL   Set a config value, as pdu.modbus_task=true\n"
+          "  -m PERCENT   Fail if any channel is off by more than this\n"
+          "  -s BYTES     Fail if any task had less stack free than this\n"
+          "  -o FILE      Write the ampere-seconds per channel to FILE\n"
+          "  -k           Soft reset at the end, fail if a counter is lost\n"
+          "  -v           Log at info level\n",
+          prog, PDU_MAX_DEVICES);
+}
+
+// Give channel i of every sensor a current of 0.5A to 8A, varying by half.
+static void bench_setup_sensors(const struct bench_opts *opts) {
+  for (int d = 0; d < opts->sensors; d++) {
+    sim_add_sensor(d + 1);
+    for (int i = 0; i < SIM_NUM_CHANNELS; i++) {
+      struct sim_channel ch = {
+          .profile = opts->profile,
+          .amps = 0.5 * (i + 1),
+          .amplitude = 0.25 * (i + 1),
+          .period = opts->profile == SIM_PROFILE_NOISE ? 1 + d : 60 + 7 * i,
+      };
+      sim_set_channel(d + 1, i, &ch);
+    }
+  }
+}
+
+// Print the energy counted on every channel against the exact figure.
+// Returns the largest error, in percent.
+static double bench_report_energy(const struct bench_opts *opts) {
+  static struct pdu pdu;
+  double max_error = 0;
+
+  printf("%-4s %-4s %10s %14s %14s %9s\n", "addr", "chan", "mean A",
+         "counted kWh", "exact kWh", "error %");
+  for (int d = 0; d < opts->sensors; d++) {
+    if (!modbus_snapshot(d, &pdu)) continue;
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+      uint64_t counted = pdu.pdu_channel[i].centiamp_msecs_total;
+      double exact = sim_exact_centiamp_msecs(d + 1, i);
+      double error = exact > 0 ? 100 * (counted - exact) / exact : 0;
+      printf("%-4d %-4d %10.2f %14.6f %14.6f %9.4f\n", d + 1, i,
+             0.5 * (i + 1), modbus_centiamp_msecs_to_kwh(counted),
+             modbus_centiamp_msecs_to_kwh((uint64_t) (exact + 0.5)), error);
+      if (fabs(error) > max_error) max_error = fabs(error);
+    }
+  }
+  return max_error;
+}
+
+// Print what Sys.Budget reports. Returns the least stack any task had free.
+static uint32_t bench_report_budget(void) {
+  struct budget_heap_sample heap;
+  uint32_t least = UINT32_MAX;
+
+  printf("%-12s %8s %8s %10s\n", "section", "count", "max us", "mean us");
+  for (int s = 0; s < BUDGET_NUM_SECTIONS; s++) {
+    struct budget_timing t;
+    budget_get_timing(s, &t);
+    printf("%-12s %8u %8u %10.1f\n", budget_section_name(s), t.count,
+           t.max_us, t.count ? (double) t.total_us / t.count : 0);
+  }
+  printf("%-12s %8s %10s\n", "flash", "writes", "bytes");
+  for (int f = 0; f < BUDGET_NUM_FLASH; f++) {
+    struct budget_flash_stats st;
+    budget_get_flash(f, &st);
+    printf("%-12s %8u %10llu\n", budget_flash_name(f), st.writes,
+           (unsigned long long) st.bytes);
+  }
+  for (int i = 0; i < budget_num_tasks(); i++) {
+    const char *name;
+    uint32_t min_free;
+    if (!budget_task_stack(i, &name, &min_free)) continue;
+    // Host stacks are HOST_STACK_SCALE times what the task asked for.
+    printf("Task %s: %u of its stack bytes never used (host, %dx stacks)\n",
+           name, min_free, HOST_STACK_SCALE);
+    if (min_free < least) least = min_free;
+  }
+  budget_heap_now(&heap);
+  printf("Heap: %u bytes free, %u at the least, of %u\n", heap.free,
+         heap.min_free, (unsigned) mgos_get_heap_size());
+  return least;
+}
+
+// Write the ampere-seconds counted per channel, one "idx value" per line, as
+// pdu_replay reads its reference.
+static bool bench_write_totals(const char *filename) {
+  static struct pdu pdu;
+  FILE *fp = fopen(filename, "w");
+
+  if (!fp) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return false;
+  }
+  for (int d = 0; d < modbus_num_devices(); d++) {
+    if (!modbus_snapshot(d, &pdu)) continue;
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+      fprintf(fp, "%d %.5f\n", d * PDU_NUM_CHANNELS + i,
+              pdu.pdu_channel[i].centiamp_msecs_total / 100000.);
+  }
+  return fclose(fp) == 0;
+}
+
+// Restart the Modbus code as a watchdog or soft reset would, where RTC memory
+// survives but nothing was written to flash first, and check that every
+// counter comes back as it was.
+static bool bench_soft_reset(void) {
+  static struct pdu before[PDU_MAX_DEVICES], after;
+  int lost = 0, n = modbus_num_devices();
+
+  for (int d = 0; d < n; d++) modbus_snapshot(d, &before[d]);
+  modbus_init(mgos_sys_config_get_pdu_modbus_interval(),
+              mgos_sys_config_get_pdu_state_interval(), STATE_FILENAME);
+  for (int d = 0; d < n; d++) {
+    modbus_snapshot(d, &after);
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+      if (after.pdu_channel[i].centiamp_msecs_total !=
+          before[d].pdu_channel[i].centiamp_msecs_total)
+        lost++;
+  }
+  printf("Soft reset: %d of %d counters restored\n",
+         n * PDU_NUM_CHANNELS - lost, n * PDU_NUM_CHANNELS);
+  return lost == 0;
+}
+
+static int bench_main(void *arg) {
+  const struct bench_opts *opts = (const struct bench_opts *) arg;
+  struct modbus_stats mb;
+  struct sim_stats sim;
+  int64_t wall_us;
+  double uptime, max_error;
+  uint32_t min_stack;
+
+  sim_init(&opts->sim);
+  bench_setup_sensors(opts);
+  if (mgos_app_init() != MGOS_APP_INIT_SUCCESS) return 1;
+  host_mqtt_set_connected(true);
+
+  wall_us = host_wall_micros();
+  uptime = mgos_uptime();
+  host_run(opts->seconds);
+  wall_us = host_wall_micros() - wall_us;
+  uptime = mgos_uptime() - uptime;
+  // Write out what is still buffered of a capture, as a reboot would.
+  trace_flush();
+
+  modbus_get_stats(&mb);
+  sim_get_stats(&sim);
+  printf("Simulated %.0fs in %.3fs of wall time (%.0fx)\n", uptime,
+         wall_us / 1e6, uptime * 1e6 / (wall_us > 0 ? wall_us : 1));
+  printf("Polls: %llu, %.2f/s simulated, %.0f/s on this host\n",
+         (unsigned long long) mb.reads, mb.reads / uptime,
+         mb.reads * 1e6 / (wall_us > 0 ? wall_us : 1));
+  printf("Responses: %u valid, %u timeouts, %u CRC errors, %u refused, "
+         "%u stale\n",
+         sim.responses, sim.timeouts, sim.crc_errors, sim.busy,
+         mb.stale_skips);
+  printf("Response handler: p50 %.1fus, p99 %.1fus, max %.1fus\n",
+         sim_handler_ns(0.5) / 1e3, sim_handler_ns(0.99) / 1e3,
+         sim.handler_ns_max / 1e3);
+
+  max_error = bench_report_energy(opts);
+  printf("Largest integration error: %.4f%%\n", max_error);
+  min_stack = bench_report_budget();
+  if (opts->output && !bench_write_totals(opts->output)) return 1;
+  if (opts->soft_reset && !bench_soft_reset()) {
+    fprintf(stderr, "Counters were lost in a soft reset\n");
+    return 1;
+  }
+  if (opts->max_error > 0 && max_error > opts->max_error) {
+    fprintf(stderr, "Integration error %.4f%% exceeds %.4f%%\n", max_error,
+            opts->max_error);
+    return 1;
+  }
+  if (min_stack < (uint32_t) opts->min_stack) {
+    fprintf(stderr, "A task had only %u bytes of stack free\n", min_stack);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct bench_opts opts = {
+      .seconds = 3600,
+      .sensors = 1,
+      .profile = SIM_PROFILE_SINE,
+      .sim = {.baud = 9600, .turnaround_ms = 5, .sample_at = 0.5},
+  };
+  char addresses[4 * PDU_MAX_DEVICES] = "";
+  int opt, ret;
+
+  cs_log_set_level(LL_WARN);
+  while ((opt = getopt(argc, argv, "t:n:p:b:e:r:a:c:m:s:o:kvh")) != -1) {
+    char *value;
+    switch (opt) {
+      case 't':
+        opts.seconds = atof(optarg);
+        break;
+      case 'n':
+        opts.sensors = atoi(optarg);
+        break;
+      case 'p':
+        for (opts.profile = 0; opts.profile < 4; opts.profile++)
+          if (strcmp(optarg, s_profile_names[opts.profile]) == 0) break;
+        break;
+      case 'b':
+        opts.sim.baud = atoi(optarg);
+        break;
+      case 'e':
+        opts.sim.timeout_rate = atof(optarg);
+        break;
+      case 'r':
+        opts.sim.crc_error_rate = atof(optarg);
+        break;
+      case 'a':
+        opts.sim.sample_at = atof(optarg);
+        break;
+      case 'c':
+        value = strchr(optarg, '=');
+        if (!value) {
+          usage(argv[0]);
+          return 2;
+        }
+        *value++ = 0;
+        if (!host_config_set(optarg, value)) {
+          fprintf(stderr, "Invalid config %s=%s\n", optarg, value);
+          return 2;
+        }
+        break;
+      case 'm':
+        opts.max_error = atof(optarg);
+        break;
+      case 's':
+        opts.min_stack = atoi(optarg);
+        break;
+      case 'o':
+        free(opts.output);
+        opts.output = host_path(optarg);
+        break;
+      case 'k':
+        opts.soft_reset = true;
+        break;
+      case 'v':
+        cs_log_set_level(LL_INFO);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (opts.seconds <= 0 || opts.sensors < 1 ||
+      opts.sensors > PDU_MAX_DEVICES || opts.profile > SIM_PROFILE_NOISE) {
+    usage(argv[0]);
+    return 2;
+  }
+  for (int d = 0; d < opts.sensors; d++) {
+    size_t len = strlen(addresses);
+    snprintf(addresses + len, sizeof(addresses) - len, "%s%d", d ? "," : "",
+             d + 1);
+  }
+  mgos_sys_config_set_pdu_modbus_addresses(addresses);
+  opts.sim.timeout_ms = 1000;
+  opts.sim.seed = 1;
+  ret = host_main(bench_main, &opts);
+  free(opts.output);
+  return ret;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Replay captured Modbus traffic (see trace.h) through the firmware's parsing
+ * and integration, and report the ampere-seconds it counts per channel. Given
+ * a reference, as written by pdu_bench -o or an earlier pdu_replay -o, it
+ * fails if any channel differs by more than the tolerance, which checks
+ * changes to integration or scheduling against traffic from the field.
+ */
+#include <getopt.h>
+
+#include "host.h"
+#include "modbus.h"
+
+struct replay_opts {
+  char **files;
+  int num_files;
+  char *reference;   // File of "idx ampere-seconds" lines, or NULL
+  char *output;      // File to write the ampere-seconds per channel to
+  double tolerance;  // Ampere-seconds a channel may differ by
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] TRACE...\n"
+          "  -a ADDRS     Sensor addresses, as pdu.modbus_addresses "
+          "(default 1)\n"
+          "  -c KEY=VAL   Set a config value, as pdu.modbus_interval=5\n"
+          "  -r FILE      Compare against the ampere-seconds in FILE\n"
+          "  -m AS        Fail if a channel differs by more than this "
+          "(default 0.001)\n"
+          "  -o FILE      Write the ampere-seconds per channel to FILE\n"
+          "  -v           Log at info level\n",
+          prog);
+}
+
+// Read the reference ampere-seconds per channel. Returns the number read, or
+// -1 if the file could not be read.
+static int replay_read_reference(const char *filename, double *reference) {
+  FILE *fp = fopen(filename, "r");
+  char line[80];
+  double value;
+  int idx, ret = 0;
+
+  if (!fp) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%d %lf", &idx, &value) != 2) continue;
+    if (idx < 0 || idx >= PDU_MAX_CHANNELS) continue;
+    reference[idx] = value;
+    if (idx >= ret) ret = idx + 1;
+  }
+  fclose(fp);
+  return ret;
+}
+
+static int replay_main(void *arg) {
+  const struct replay_opts *opts = (const struct replay_opts *) arg;
+  static struct modbus_replay replay;
+  static double reference[PDU_MAX_CHANNELS];
+  uint32_t frames = 0, skipped = 0, invalid = 0, stale = 0;
+  double total[PDU_MAX_CHANNELS] = {0}, max_diff = 0;
+  int num_reference = 0;
+  int64_t wall_us;
+  FILE *fp = NULL;
+
+  if (!modbus_init(mgos_sys_config_get_pdu_modbus_interval(),
+                   mgos_sys_config_get_pdu_state_interval(), "state.json"))
+    return 1;
+  if (opts->reference &&
+      (num_reference = replay_read_reference(opts->reference, reference)) < 0)
+    return 1;
+
+  // Consecutive traces, as pulled off a device over time, add up. Each one
+  // starts from fresh state, so the interval before its first sample is not
+  // counted.
+  wall_us = host_wall_micros();
+  for (int f = 0; f < opts->num_files; f++) {
+    if (!modbus_replay(opts->files[f], &replay)) return 1;
+    frames += replay.frames;
+    skipped += replay.skipped;
+    invalid += replay.invalid;
+    stale += replay.stale_skips;
+    for (int i = 0; i < modbus_num_channels(); i++)
+      total[i] += replay.centiamp_msecs_total[i] / 100000.;
+  }
+  wall_us = host_wall_micros() - wall_us;
+
+  printf("Replayed %u responses in %.3fs (%.0f/s): %u skipped, %u invalid, "
+         "%u stale\n",
+         frames, wall_us / 1e6, frames * 1e6 / (wall_us > 0 ? wall_us : 1),
+         skipped, invalid, stale);
+  if (opts->output && !(fp = fopen(opts->output, "w"))) {
+    fprintf(stderr, "%s: %s\n", opts->output, strerror(errno));
+    return 1;
+  }
+  printf("%-4s %14s %14s %10s\n", "idx", "ampere-secs", "reference", "diff");
+  for (int i = 0; i < modbus_num_channels(); i++) {
+    if (fp) fprintf(fp, "%d %.5f\n", i, total[i]);
+    if (i >= num_reference) {
+      printf("%-4d %14.3f\n", i, total[i]);
+      continue;
+    }
+    printf("%-4d %14.3f %14.3f %10.3f\n", i, total[i], reference[i],
+           total[i] - reference[i]);
+    if (fabs(total[i] - reference[i]) > fabs(max_diff))
+      max_diff = total[i] - reference[i];
+  }
+  if (fp && fclose(fp) != 0) return 1;
+  if (num_reference > 0) {
+    printf("Largest difference: %.5f ampere-seconds\n", max_diff);
+    if (fabs(max_diff) > opts->tolerance) {
+      fprintf(stderr, "Difference %.5f exceeds %.5f ampere-seconds\n",
+              max_diff, opts->tolerance);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct replay_opts opts = {.tolerance = 0.001};
+  int opt, ret = 2;
+
+  cs_log_set_level(LL_WARN);
+  mgos_sys_config_set_pdu_modbus_addresses("1");
+  while ((opt = getopt(argc, argv, "a:c:r:m:o:vh")) != -1) {
+    char *value;
+    switch (opt) {
+      case 'a':
+        mgos_sys_config_set_pdu_modbus_addresses(optarg);
+        break;
+      case 'c':
+        value = strchr(optarg, '=');
+        if (!value) {
+          usage(argv[0]);
+          goto exit;
+        }
+        *value++ = 0;
+        if (!host_config_set(optarg, value)) {
+          fprintf(stderr, "Invalid config %s=%s\n", optarg, value);
+          goto exit;
+        }
+        break;
+      case 'r':
+        free(opts.reference);
+        opts.reference = host_path(optarg);
+        break;
+      case 'm':
+        opts.tolerance = atof(optarg);
+        break;
+      case 'o':
+        free(opts.output);
+        opts.output = host_path(optarg);
+        break;
+      case 'v':
+        cs_log_set_level(LL_INFO);
+        break;
+      default:
+        usage(argv[0]);
+        if (opt == 'h') ret = 0;
+        goto exit;
+    }
+  }
+  opts.num_files = argc - optind;
+  if (opts.num_files < 1) {
+    usage(argv[0]);
+    goto exit;
+  }
+  if (!(opts.files = calloc(opts.num_files, sizeof(char *)))) goto exit;
+  for (int f = 0; f < opts.num_files; f++)
+    opts.files[f] = host_path(argv[optind + f]);
+  ret = host_main(replay_main, &opts);
+
+exit:
+  for (int f = 0; opts.files && f < opts.num_files; f++) free(opts.files[f]);
+  free(opts.files);
+  free(opts.reference);
+  free(opts.output);
+  return ret;
+}
@@ -0,0 +1,374 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Drive the RPC handlers of rpc.c with concurrent callers while the firmware
+ * polls simulated sensors in real time, and report the calls handled per
+ * second, the latency from sending a call to receiving its reply (p50, p99 and
+ * max) and the bytes per reply, per method and overall, as a collector would
+ * see them.
+ */
+#include <getopt.h>
+#include <pthread.h>
+
+#include "host.h"
+#include "modbus.h"
+#include "sim.h"
+
+#define RPC_BENCH_MAX_CLIENTS 64
+
+struct rpc_bench_method {
+  const char *name;    // As given in the mix
+  const char *method;  // RPC method called
+  bool with_idx;       // Takes a random channel as {idx: %d}
+};
+
+static const struct rpc_bench_method s_methods[] = {
+    {"current", "Channel.GetCurrent", true},
+    {"kwh", "Channel.GetkWh", true},
+    {"clear", "Channel.Clear", true},
+    {"write", "State.Write", false},
+};
+
+#define RPC_BENCH_METHODS (sizeof(s_methods) / sizeof(s_methods[0]))
+
+struct rpc_bench_opts {
+  double seconds;
+  int sensors;
+  int clients;
+  int think_ms;                   // Pause between calls of one client
+  int weight[RPC_BENCH_METHODS];  // Share of the calls per method
+  int total_weight;
+  int num_channels;
+};
+
+// A sample per call: which method, how long until its reply and how large.
+struct rpc_bench_sample {
+  uint8_t method;
+  bool error;
+  uint32_t latency_us;
+  uint32_t bytes;
+};
+
+struct rpc_bench_client {
+  pthread_t thread;
+  const struct rpc_bench_opts *opts;
+  uint32_t rand;
+  struct rpc_bench_sample *samples;
+  size_t num_samples, max_samples;
+
+  // The call in flight, handed to the event loop and back.
+  pthread_mutex_t lock;
+  pthread_cond_t done_cond;
+  const char *method;
+  char args[32];
+  struct host_rpc_reply reply;
+  bool done;
+};
+
+static volatile bool s_stop = false;
+static int s_running = 0;
+static pthread_mutex_t s_running_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -t SECONDS   Time to run, in real time (default 10)\n"
+          "  -n SENSORS   Number of sensors, 1..%d (default 4)\n"
+          "  -j CLIENTS   Concurrent callers, 1..%d (default 4)\n"
+          "  -w MS        Pause between the calls of a caller (default 0)\n"
+          "  -x MIX       Calls per method, as "
+          "current=70,kwh=25,clear=4,write=1\n"
+          "  -c KEY=VAL   Set a config value, as pdu.modbus_interval=1\n"
+          "  -v           Log at info level\n",
+          prog, PDU_MAX_DEVICES, RPC_BENCH_MAX_CLIENTS);
+}
+
+// Parse a mix as "name=weight,...". Methods not named are not called.
+static bool rpc_bench_parse_mix(const char *mix, struct rpc_bench_opts *opts) {
+  char name[16];
+  int weight, n;
+
+  memset(opts->weight, 0, sizeof(opts->weight));
+  opts->total_weight = 0;
+  while (sscanf(mix, "%15[^=]=%d%n", name, &weight, &n) == 2) {
+    size_t m;
+    for (m = 0; m < RPC_BENCH_METHODS; m++)
+      if (strcmp(name, s_methods[m].name) == 0) break;
+    if (m == RPC_BENCH_METHODS || weight < 0) return false;
+    opts->weight[m] = weight;
+    opts->total_weight += weight;
+    mix += n;
+    if (*mix != ',') break;
+    mix++;
+  }
+  return *mix == 0 && opts->total_weight > 0;
+}
+
+// xorshift32, per client.
+static uint32_t rpc_bench_rand(struct rpc_bench_client *c) {
+  c->rand ^= c->rand << 13;
+  c->rand ^= c->rand >> 17;
+  c->rand ^= c->rand << 5;
+  return c->rand;
+}
+
+// Runs on the event loop, as a call arriving over the network would.
+static void rpc_bench_call_cb(void *arg) {
+  struct rpc_bench_client *c = (struct rpc_bench_client *) arg;
+  struct host_rpc_reply reply;
+
+  host_rpc_call(c->method, c->args, &reply);
+  pthread_mutex_lock(&c->lock);
+  c->reply = reply;
+  c->done = true;
+  pthread_cond_signal(&c->done_cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static bool rpc_bench_record(struct rpc_bench_client *c, int method,
+                             int64_t latency_us) {
+  struct rpc_bench_sample *s;
+
+  if (c->num_samples == c->max_samples) {
+    size_t max = c->max_samples ? 2 * c->max_samples : 4096;
+    if (!(s = realloc(c->samples, max * sizeof(*s)))) return false;
+    c->samples = s;
+    c->max_samples = max;
+  }
+  s = &c->samples[c->num_samples++];
+  s->method = method;
+  s->error = !c->reply.done || c->reply.code != 0;
+  s->latency_us = (uint32_t) latency_us;
+  s->bytes = (uint32_t) c->reply.len;
+  return true;
+}
+
+static void *rpc_bench_client_thread(void *arg) {
+  struct rpc_bench_client *c = (struct rpc_bench_client *) arg;
+  const struct rpc_bench_opts *opts = c->opts;
+  int64_t start_us;
+  int m, w;
+
+  while (!s_stop) {
+    w = rpc_bench_rand(c) % opts->total_weight;
+    for (m = 0; w >= opts->weight[m]; m++) w -= opts->weight[m];
+    c->method = s_methods[m].method;
+    if (s_methods[m].with_idx)
+      snprintf(c->args, sizeof(c->args), "{\"idx\": %d}",
+               (int) (rpc_bench_rand(c) % opts->num_channels));
+    else
+      snprintf(c->args, sizeof(c->args), "{}");
+
+    c->done = false;
+    start_us = host_wall_micros();
+    if (!mgos_invoke_cb(rpc_bench_call_cb, c, false)) break;
+    pthread_mutex_lock(&c->lock);
+    while (!c->done) pthread_cond_wait(&c->done_cond, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+    if (!rpc_bench_record(c, m, host_wall_micros() - start_us)) break;
+    host_rpc_reply_free(&c->reply);
+    if (opts->think_ms > 0) usleep(1000 * opts->think_ms);
+  }
+  pthread_mutex_lock(&s_running_lock);
+  s_running--;
+  pthread_mutex_unlock(&s_running_lock);
+  return NULL;
+}
+
+static int rpc_bench_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Print a line for the samples of method m, or of all if m is -1. Returns the
+// number of error replies.
+static uint32_t rpc_bench_report(struct rpc_bench_client *clients, int n,
+                                 int m, double seconds) {
+  const char *name = m < 0 ? "all" : s_methods[m].method;
+  uint32_t *latency, errors = 0;
+  uint64_t bytes = 0;
+  size_t count = 0, total = 0;
+
+  for (int i = 0; i < n; i++) total += clients[i].num_samples;
+  if (!(latency = malloc((total ? total : 1) * sizeof(*latency)))) return 1;
+  for (int i = 0; i < n; i++) {
+    for (size_t s = 0; s < clients[i].num_samples; s++) {
+      const struct rpc_bench_sample *sample = &clients[i].samples[s];
+      if (m >= 0 && sample->method != m) continue;
+      latency[count++] = sample->latency_us;
+      bytes += sample->bytes;
+      if (sample->error) errors++;
+    }
+  }
+  if (count > 0) {
+    qsort(latency, count, sizeof(*latency), rpc_bench_cmp);
+    printf("%-20s %8zu %8.0f %6u %8u %8u %8u %8.1f\n", name, count,
+           count / seconds, errors, latency[count / 2],
+           latency[(size_t) (count * 0.99)], latency[count - 1],
+           (double) bytes / count);
+  }
+  free(latency);
+  return errors;
+}
+
+static int bench_main(void *arg) {
+  struct rpc_bench_opts *opts = (struct rpc_bench_opts *) arg;
+  struct rpc_bench_client *clients;
+  struct modbus_stats mb;
+  struct sim_stats sim;
+  uint32_t errors, calls = 0;
+  int64_t wall_us;
+  int ret = 1;
+
+  sim_init(NULL);
+  for (int d = 0; d < opts->sensors; d++) {
+    sim_add_sensor(d + 1);
+    for (int i = 0; i < SIM_NUM_CHANNELS; i++) {
+      struct sim_channel ch = {SIM_PROFILE_NOISE, 0.5 * (i + 1),
+                               0.25 * (i + 1), 1 + d};
+      sim_set_channel(d + 1, i, &ch);
+    }
+  }
+  if (mgos_app_init() != MGOS_APP_INIT_SUCCESS) return 1;
+  host_mqtt_set_connected(true);
+  opts->num_channels = modbus_num_channels();
+  // Callers are not idle time, so let the clock run in real time.
+  host_set_speed(1);
+
+  if (!(clients = calloc(opts->clients, sizeof(*clients)))) return 1;
+  wall_us = host_wall_micros();
+  s_running = opts->clients;
+  for (int i = 0; i < opts->clients; i++) {
+    clients[i].opts = opts;
+    clients[i].rand = 2654435761u * (i + 1);
+    pthread_mutex_init(&clients[i].lock, NULL);
+    pthread_cond_init(&clients[i].done_cond, NULL);
+    if (pthread_create(&clients[i].thread, NULL, rpc_bench_client_thread,
+                       &clients[i]) != 0) {
+      fprintf(stderr, "Could not start caller %d\n", i);
+      s_running -= opts->clients - i;
+      opts->clients = i;
+      break;
+    }
+  }
+  host_run(opts->seconds);
+  // Keep handling calls until every caller has seen the reply to its last.
+  s_stop = true;
+  for (;;) {
+    pthread_mutex_lock(&s_running_lock);
+    if (s_running == 0) break;
+    pthread_mutex_unlock(&s_running_lock);
+    host_run(0.01);
+  }
+  pthread_mutex_unlock(&s_running_lock);
+  wall_us = host_wall_micros() - wall_us;
+  for (int i = 0; i < opts->clients; i++) {
+    pthread_join(clients[i].thread, NULL);
+    calls += clients[i].num_samples;
+  }
+
+  modbus_get_stats(&mb);
+  sim_get_stats(&sim);
+  printf("%d callers made %u calls in %.3fs, while polling %d sensors\n",
+         opts->clients, calls, wall_us / 1e6, opts->sensors);
+  printf("%-20s %8s %8s %6s %8s %8s %8s %8s\n", "method", "calls", "calls/s",
+         "errors", "p50 us", "p99 us", "max us", "bytes");
+  for (size_t m = 0; m < RPC_BENCH_METHODS; m++)
+    if (opts->weight[m] > 0)
+      rpc_bench_report(clients, opts->clients, m, wall_us / 1e6);
+  errors = rpc_bench_report(clients, opts->clients, -1, wall_us / 1e6);
+  printf("Polls: %llu, %u missed deadlines; response handler p50 %.1fus, "
+         "p99 %.1fus\n",
+         (unsigned long long) mb.reads, (unsigned) mb.missed_deadlines,
+         sim_handler_ns(0.5) / 1e3, sim_handler_ns(0.99) / 1e3);
+
+  if (calls == 0 || errors > 0) {
+    fprintf(stderr, "%u of %u calls failed\n", errors, calls);
+    goto exit;
+  }
+  ret = 0;
+
+exit:
+  for (int i = 0; i < opts->clients; i++) {
+    free(clients[i].samples);
+    pthread_mutex_destroy(&clients[i].lock);
+    pthread_cond_destroy(&clients[i].done_cond);
+  }
+  free(clients);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  struct rpc_bench_opts opts = {.seconds = 10, .sensors = 4, .clients = 4};
+  char addresses[4 * PDU_MAX_DEVICES] = "";
+  int opt;
+
+  cs_log_set_level(LL_WARN);
+  rpc_bench_parse_mix("current=70,kwh=25,clear=4,write=1", &opts);
+  while ((opt = getopt(argc, argv, "t:n:j:w:x:c:vh")) != -1) {
+    char *value;
+    switch (opt) {
+      case 't':
+        opts.seconds = atof(optarg);
+        break;
+      case 'n':
+        opts.sensors = atoi(optarg);
+        break;
+      case 'j':
+        opts.clients = atoi(optarg);
+        break;
+      case 'w':
+        opts.think_ms = atoi(optarg);
+        break;
+      case 'x':
+        if (!rpc_bench_parse_mix(optarg, &opts)) {
+          fprintf(stderr, "Invalid mix %s\n", optarg);
+          return 2;
+        }
+        break;
+      case 'c':
+        value = strchr(optarg, '=');
+        if (!value) {
+          usage(argv[0]);
+          return 2;
+        }
+        *value++ = 0;
+        if (!host_config_set(optarg, value)) {
+          fprintf(stderr, "Invalid config %s=%s\n", optarg, value);
+          return 2;
+        }
+        break;
+      case 'v':
+        cs_log_set_level(LL_INFO);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (opts.seconds <= 0 || opts.sensors < 1 ||
+      opts.sensors > PDU_MAX_DEVICES || opts.clients < 1 ||
+      opts.clients > RPC_BENCH_MAX_CLIENTS || opts.think_ms < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  for (int d = 0; d < opts.sensors; d++) {
+    size_t len = strlen(addresses);
+    snprintf(addresses + len, sizeof(addresses) - len, "%s%d", d ? "," : "",
+             d + 1);
+  }
+  mgos_sys_config_set_pdu_modbus_addresses(addresses);
+  return host_main(bench_main, &opts);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Growable byte buffer, as in mongoose. */
+#pragma once
+
+#include <stddef.h>
+
+#define MBUF_SIZE_MULTIPLIER 1.5
+
+struct mbuf {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+void mbuf_init(struct mbuf *mb, size_t initial_size);
+void mbuf_free(struct mbuf *mb);
+void mbuf_resize(struct mbuf *mb, size_t new_size);
+void mbuf_trim(struct mbuf *mb);
+size_t mbuf_insert(struct mbuf *mb, size_t off, const void *data, size_t len);
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t len);
+void mbuf_remove(struct mbuf *mb, size_t len);
+void mbuf_clear(struct mbuf *mb);
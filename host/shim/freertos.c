@@ -0,0 +1,239 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "host.h"
+
+#define HOST_STACK_PAINT 0xa5
+
+struct host_task {
+  const char *name;
+  TaskFunction_t code;
+  void *arg;
+  pthread_t thread;
+  uint8_t *stack;
+  size_t stack_size;
+  bool accounted;  // Counts as busy for the event loop unless blocked
+};
+
+struct host_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  uint8_t *items;
+  size_t item_size;
+  UBaseType_t length;
+  UBaseType_t head;
+  UBaseType_t count;
+  bool task_receiver;  // Items are taken by a task, and count as busy
+};
+
+static __thread struct host_task *s_current = NULL;
+
+static void *host_task_main(void *arg) {
+  struct host_task *task = (struct host_task *) arg;
+
+  s_current = task;
+  task->code(task->arg);
+  return NULL;
+}
+
+// Start a task on a painted stack of stack_size times HOST_STACK_SCALE bytes.
+static struct host_task *host_task_start(const char *name, uint32_t stack_size,
+                                         TaskFunction_t code, void *arg,
+                                         bool accounted) {
+  struct host_task *task = calloc(1, sizeof(*task));
+  pthread_attr_t attr;
+
+  if (!task) return NULL;
+  task->name = name;
+  task->code = code;
+  task->arg = arg;
+  task->accounted = accounted;
+  task->stack_size = (size_t) stack_size * HOST_STACK_SCALE;
+  if (task->stack_size < PTHREAD_STACK_MIN)
+    task->stack_size = PTHREAD_STACK_MIN;
+  task->stack = mmap(NULL, task->stack_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (task->stack == MAP_FAILED) {
+    free(task);
+    return NULL;
+  }
+  memset(task->stack, HOST_STACK_PAINT, task->stack_size);
+  if (accounted) host_loop_task_busy(1);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, task->stack, task->stack_size);
+  if (pthread_create(&task->thread, &attr, host_task_main, task) != 0) {
+    pthread_attr_destroy(&attr);
+    if (accounted) host_loop_task_busy(-1);
+    munmap(task->stack, task->stack_size);
+    free(task);
+    return NULL;
+  }
+  pthread_attr_destroy(&attr);
+  return task;
+}
+
+bool host_task_run(const char *name, uint32_t stack_size, void (*fn)(void *),
+                   void *arg) {
+  struct host_task *task = host_task_start(name, stack_size, fn, arg, false);
+
+  if (!task) return false;
+  pthread_join(task->thread, NULL);
+  munmap(task->stack, task->stack_size);
+  free(task);
+  return true;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name,
+                                   uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *task,
+                                   BaseType_t core) {
+  struct host_task *t = host_task_start(name, stack_depth, code, arg, true);
+
+  if (!t) return pdFAIL;
+  pthread_detach(t->thread);
+  if (task) *task = t;
+  return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  return s_current;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  size_t n = 0;
+
+  if (!task) task = s_current;
+  if (!task) return 0;
+  // Stacks grow down, so the untouched paint is at the bottom.
+  while (n < task->stack_size && task->stack[n] == HOST_STACK_PAINT) n++;
+  return n;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  usleep((useconds_t) ticks * portTICK_PERIOD_MS * 1000);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  struct host_queue *q = calloc(1, sizeof(*q));
+
+  if (!q) return NULL;
+  q->items = calloc(length, item_size);
+  if (!q->items) {
+    free(q);
+    return NULL;
+  }
+  q->length = length;
+  q->item_size = item_size;
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+  pthread_mutex_destroy(&q->mutex);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  free(q->items);
+  free(q);
+}
+
+// Wait on cond for ticks_to_wait. Returns false on timeout.
+static bool host_queue_wait(struct host_queue *q, pthread_cond_t *cond,
+                            const struct timespec *deadline) {
+  if (!deadline) return pthread_cond_wait(cond, &q->mutex) == 0;
+  return pthread_cond_timedwait(cond, &q->mutex, deadline) == 0;
+}
+
+static const struct timespec *host_deadline(TickType_t ticks,
+                                            struct timespec *ts) {
+  if (ticks == portMAX_DELAY) return NULL;
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_nsec += (long) (ticks % 1000) * portTICK_PERIOD_MS * 1000000;
+  ts->tv_sec += ticks / 1000 + ts->tv_nsec / 1000000000;
+  ts->tv_nsec %= 1000000000;
+  return ts;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks) {
+  struct timespec ts;
+  const struct timespec *deadline = host_deadline(ticks, &ts);
+
+  pthread_mutex_lock(&q->mutex);
+  while (q->count == q->length) {
+    if (ticks == 0 || !host_queue_wait(q, &q->not_full, deadline)) {
+      pthread_mutex_unlock(&q->mutex);
+      return pdFALSE;
+    }
+  }
+  memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item,
+         q->item_size);
+  q->count++;
+  if (q->task_receiver) host_loop_task_busy(1);
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->mutex);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *buf, TickType_t ticks) {
+  struct host_task *task = s_current;
+  bool accounted = task && task->accounted;
+  struct timespec ts;
+  const struct timespec *deadline = host_deadline(ticks, &ts);
+  BaseType_t ret = pdFALSE;
+
+  pthread_mutex_lock(&q->mutex);
+  if (accounted) {
+    // Items waiting on a queue that a task works off count as busy, as does
+    // the task until it asks for the next item.
+    if (!q->task_receiver) {
+      q->task_receiver = true;
+      if (q->count) host_loop_task_busy(q->count);
+    }
+    host_loop_task_busy(-1);
+  }
+  while (q->count == 0) {
+    if (ticks == 0 || !host_queue_wait(q, &q->not_empty, deadline)) break;
+  }
+  if (q->count > 0) {
+    memcpy(buf, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    ret = pdTRUE;
+    pthread_cond_signal(&q->not_full);
+  }
+  // An item taken was counted as busy when it was sent.
+  if (accounted && ret != pdTRUE) host_loop_task_busy(1);
+  pthread_mutex_unlock(&q->mutex);
+  return ret;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  UBaseType_t count;
+
+  pthread_mutex_lock(&q->mutex);
+  count = q->count;
+  pthread_mutex_unlock(&q->mutex);
+  return count;
+}
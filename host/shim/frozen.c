@@ -0,0 +1,562 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "frozen.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/mbuf.h"
+
+#define JSON_MAX_PATH_LEN 128
+
+int json_printer_buf(struct json_out *out, const char *buf, size_t len) {
+  size_t avail = out->u.buf.size - out->u.buf.len;
+  size_t n = len < avail ? len : avail;
+
+  memcpy(out->u.buf.buf + out->u.buf.len, buf, n);
+  out->u.buf.len += n;
+  if (out->u.buf.size > 0) {
+    size_t idx = out->u.buf.len;
+    if (idx >= out->u.buf.size) idx = out->u.buf.size - 1;
+    out->u.buf.buf[idx] = '\0';
+  }
+  return len;
+}
+
+int json_printer_file(struct json_out *out, const char *buf, size_t len) {
+  return fwrite(buf, 1, len, out->u.fp);
+}
+
+int json_printer_mbuf(struct json_out *out, const char *buf, size_t len) {
+  mbuf_append((struct mbuf *) out->u.data, buf, len);
+  return len;
+}
+
+static int json_encode_string(struct json_out *out, const char *p, size_t n) {
+  static const char *hex = "0123456789abcdef";
+  int len = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    unsigned char ch = (unsigned char) p[i];
+    char esc[7] = {'\\', 0};
+    switch (ch) {
+      case '"':
+      case '\\':
+        esc[1] = ch;
+        break;
+      case '\b':
+        esc[1] = 'b';
+        break;
+      case '\f':
+        esc[1] = 'f';
+        break;
+      case '\n':
+        esc[1] = 'n';
+        break;
+      case '\r':
+        esc[1] = 'r';
+        break;
+      case '\t':
+        esc[1] = 't';
+        break;
+      default:
+        if (ch >= 0x20) {
+          len += out->printer(out, (const char *) &p[i], 1);
+          continue;
+        }
+        memcpy(esc + 1, "u00", 3);
+        esc[4] = hex[ch >> 4];
+        esc[5] = hex[ch & 0xf];
+        len += out->printer(out, esc, 6);
+        continue;
+    }
+    len += out->printer(out, esc, 2);
+  }
+  return len;
+}
+
+static int json_encode_base64(struct json_out *out, const unsigned char *p,
+                              int n) {
+  static const char *b64 =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int len = 0;
+
+  len += out->printer(out, "\"", 1);
+  for (int i = 0; i < n; i += 3) {
+    uint32_t v = p[i] << 16;
+    char quad[4];
+    if (i + 1 < n) v |= p[i + 1] << 8;
+    if (i + 2 < n) v |= p[i + 2];
+    quad[0] = b64[(v >> 18) & 0x3f];
+    quad[1] = b64[(v >> 12) & 0x3f];
+    quad[2] = i + 1 < n ? b64[(v >> 6) & 0x3f] : '=';
+    quad[3] = i + 2 < n ? b64[v & 0x3f] : '=';
+    len += out->printer(out, quad, 4);
+  }
+  len += out->printer(out, "\"", 1);
+  return len;
+}
+
+/* Print a standard conversion through the C library, and advance ap past its
+ * arguments. Returns the length of the conversion in fmt.
+ */
+static size_t json_printf_delegate(struct json_out *out, const char *fmt,
+                                   va_list *ap, int *len) {
+  char fmt2[24], buf[64], *pbuf = buf;
+  const char *p = fmt + 1;
+  int stars = 0, need;
+  char lmod = 0, conv;
+  va_list ap_copy;
+
+  while (*p && strchr("-+ #0'", *p)) p++;
+  if (*p == '*') stars++, p++;
+  while (isdigit((unsigned char) *p)) p++;
+  if (*p == '.') {
+    p++;
+    if (*p == '*') stars++, p++;
+    while (isdigit((unsigned char) *p)) p++;
+  }
+  if (*p == 'h' || *p == 'l') {
+    lmod = *p++;
+    if (*p == lmod) lmod = lmod == 'l' ? 'q' : 'H', p++;
+  } else if (*p && strchr("Lzjt", *p)) {
+    lmod = *p++;
+  }
+  conv = *p++;
+  if ((size_t) (p - fmt) >= sizeof(fmt2)) return p - fmt;
+  memcpy(fmt2, fmt, p - fmt);
+  fmt2[p - fmt] = 0;
+
+  va_copy(ap_copy, *ap);
+  need = vsnprintf(pbuf, sizeof(buf), fmt2, ap_copy);
+  va_end(ap_copy);
+  if (need >= (int) sizeof(buf) && (pbuf = malloc(need + 1)) != NULL) {
+    va_copy(ap_copy, *ap);
+    vsnprintf(pbuf, need + 1, fmt2, ap_copy);
+    va_end(ap_copy);
+  }
+  if (need > 0 && pbuf) *len += out->printer(out, pbuf, need);
+  if (pbuf != buf) free(pbuf);
+
+  while (stars-- > 0) (void) va_arg(*ap, int);
+  switch (conv) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      if (lmod == 'l')
+        (void) va_arg(*ap, long);
+      else if (lmod == 'q')
+        (void) va_arg(*ap, long long);
+      else if (lmod == 'z' || lmod == 't')
+        (void) va_arg(*ap, size_t);
+      else if (lmod == 'j')
+        (void) va_arg(*ap, intmax_t);
+      else
+        (void) va_arg(*ap, int);
+      break;
+    case 'c':
+      (void) va_arg(*ap, int);
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if (lmod == 'L')
+        (void) va_arg(*ap, long double);
+      else
+        (void) va_arg(*ap, double);
+      break;
+    default:
+      (void) va_arg(*ap, void *);
+      break;
+  }
+  return p - fmt;
+}
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  int len = 0;
+  va_list ap;
+
+  va_copy(ap, xap);
+  while (*fmt != '\0') {
+    if (strchr(":, \r\n\t[]{}\"", *fmt) != NULL) {
+      len += out->printer(out, fmt, 1);
+      fmt++;
+    } else if (fmt[0] == '%') {
+      if (fmt[1] == 'M') {
+        json_printf_callback_t f = va_arg(ap, json_printf_callback_t);
+        len += f(out, &ap);
+        fmt += 2;
+      } else if (fmt[1] == 'B') {
+        const char *str = va_arg(ap, int) ? "true" : "false";
+        len += out->printer(out, str, strlen(str));
+        fmt += 2;
+      } else if (fmt[1] == 'V') {
+        const unsigned char *p = va_arg(ap, const unsigned char *);
+        int n = va_arg(ap, int);
+        len += json_encode_base64(out, p, n);
+        fmt += 2;
+      } else if (fmt[1] == 'Q' ||
+                 (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 'Q')) {
+        size_t n = 0;
+        const char *p;
+        if (fmt[1] == '.') n = (size_t) va_arg(ap, int);
+        p = va_arg(ap, const char *);
+        if (!p) {
+          len += out->printer(out, "null", 4);
+        } else {
+          if (fmt[1] == 'Q') n = strlen(p);
+          len += out->printer(out, "\"", 1);
+          len += json_encode_string(out, p, n);
+          len += out->printer(out, "\"", 1);
+        }
+        fmt += fmt[1] == 'Q' ? 2 : 4;
+      } else if (fmt[1] == '%') {
+        len += out->printer(out, "%", 1);
+        fmt += 2;
+      } else {
+        fmt += json_printf_delegate(out, fmt, &ap, &len);
+      }
+    } else if (*fmt == '_' || isalpha((unsigned char) *fmt)) {
+      // Bare words are keys, and get quoted.
+      len += out->printer(out, "\"", 1);
+      while (*fmt == '_' || isalnum((unsigned char) *fmt)) {
+        len += out->printer(out, fmt, 1);
+        fmt++;
+      }
+      len += out->printer(out, "\"", 1);
+    } else {
+      len += out->printer(out, fmt, 1);
+      fmt++;
+    }
+  }
+  va_end(ap);
+  return len;
+}
+
+int json_printf(struct json_out *out, const char *fmt, ...) {
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = json_vprintf(out, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+char *json_vasprintf(const char *fmt, va_list ap) {
+  struct mbuf mb;
+  struct json_out out = JSON_OUT_MBUF(&mb);
+
+  mbuf_init(&mb, 0);
+  json_vprintf(&out, fmt, ap);
+  mbuf_append(&mb, "", 1);
+  return mb.buf;
+}
+
+char *json_asprintf(const char *fmt, ...) {
+  va_list ap;
+  char *ret;
+
+  va_start(ap, fmt);
+  ret = json_vasprintf(fmt, ap);
+  va_end(ap);
+  return ret;
+}
+
+static const char *json_skip_ws(const char *p, const char *end) {
+  while (p < end && isspace((unsigned char) *p)) p++;
+  return p;
+}
+
+/* Parse the value at p into tok. Strings exclude their quotes, objects and
+ * arrays include their brackets. Returns the end of the value, or NULL if it
+ * is malformed.
+ */
+static const char *json_parse_value(const char *p, const char *end,
+                                    struct json_token *tok) {
+  const char *start;
+
+  p = json_skip_ws(p, end);
+  if (p >= end) return NULL;
+  start = p;
+  if (*p == '"') {
+    for (p++; p < end && *p != '"'; p++)
+      if (*p == '\\') p++;
+    if (p >= end) return NULL;
+    tok->ptr = start + 1;
+    tok->len = p - start - 1;
+    tok->type = JSON_TYPE_STRING;
+    return p + 1;
+  }
+  if (*p == '{' || *p == '[') {
+    char close = *p == '{' ? '}' : ']';
+    struct json_token sub;
+    p = json_skip_ws(p + 1, end);
+    while (p < end && *p != close) {
+      if (close == '}') {
+        p = json_parse_value(p, end, &sub);
+        if (!p || sub.type != JSON_TYPE_STRING) return NULL;
+        p = json_skip_ws(p, end);
+        if (p >= end || *p != ':') return NULL;
+        p++;
+      }
+      p = json_parse_value(p, end, &sub);
+      if (!p) return NULL;
+      p = json_skip_ws(p, end);
+      if (p < end && *p == ',') p = json_skip_ws(p + 1, end);
+    }
+    if (p >= end) return NULL;
+    tok->ptr = start;
+    tok->len = p + 1 - start;
+    tok->type = close == '}' ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END;
+    return p + 1;
+  }
+  while (p < end && (isalnum((unsigned char) *p) || strchr("+-.", *p))) p++;
+  if (p == start) return NULL;
+  tok->ptr = start;
+  tok->len = p - start;
+  if (tok->len == 4 && strncmp(start, "true", 4) == 0)
+    tok->type = JSON_TYPE_TRUE;
+  else if (tok->len == 5 && strncmp(start, "false", 5) == 0)
+    tok->type = JSON_TYPE_FALSE;
+  else if (tok->len == 4 && strncmp(start, "null", 4) == 0)
+    tok->type = JSON_TYPE_NULL;
+  else
+    tok->type = JSON_TYPE_NUMBER;
+  return p;
+}
+
+// Find the member key of the object tok.
+static bool json_find_member(const struct json_token *obj, const char *key,
+                             size_t key_len, struct json_token *tok) {
+  const char *p = obj->ptr + 1, *end = obj->ptr + obj->len - 1;
+  struct json_token name;
+
+  for (;;) {
+    p = json_skip_ws(p, end);
+    if (p >= end) return false;
+    p = json_parse_value(p, end, &name);
+    if (!p) return false;
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != ':') return false;
+    p = json_parse_value(p + 1, end, tok);
+    if (!p) return false;
+    if ((size_t) name.len == key_len && strncmp(name.ptr, key, key_len) == 0)
+      return true;
+    p = json_skip_ws(p, end);
+    if (p < end && *p == ',') p++;
+  }
+}
+
+// Find the value at path, as ".a.b", in the JSON document s.
+static bool json_find_path(const char *s, int len, const char *path,
+                           struct json_token *tok) {
+  if (!json_parse_value(s, s + len, tok)) return false;
+  while (*path == '.') {
+    const char *key = path + 1;
+    path = key + strcspn(key, ".");
+    if (tok->type != JSON_TYPE_OBJECT_END) return false;
+    if (!json_find_member(tok, key, path - key, tok)) return false;
+  }
+  return *path == '\0';
+}
+
+int json_scanf_array_elem(const char *s, int len, const char *path, int index,
+                          struct json_token *token) {
+  struct json_token arr;
+  const char *p, *end;
+
+  if (!json_find_path(s, len, path, &arr) || arr.type != JSON_TYPE_ARRAY_END)
+    return -1;
+  p = arr.ptr + 1;
+  end = arr.ptr + arr.len - 1;
+  for (int i = 0;; i++) {
+    p = json_skip_ws(p, end);
+    if (p >= end) return -1;
+    p = json_parse_value(p, end, token);
+    if (!p) return -1;
+    if (i == index) return token->len;
+    p = json_skip_ws(p, end);
+    if (p < end && *p == ',') p++;
+  }
+}
+
+// Copy the string token unescaped into a new buffer.
+static char *json_unescape(const struct json_token *tok) {
+  char *ret = malloc(tok->len + 1), *q = ret;
+
+  if (!ret) return NULL;
+  for (int i = 0; i < tok->len; i++) {
+    char ch = tok->ptr[i];
+    if (ch == '\\' && i + 1 < tok->len) {
+      ch = tok->ptr[++i];
+      switch (ch) {
+        case 'b':
+          ch = '\b';
+          break;
+        case 'f':
+          ch = '\f';
+          break;
+        case 'n':
+          ch = '\n';
+          break;
+        case 'r':
+          ch = '\r';
+          break;
+        case 't':
+          ch = '\t';
+          break;
+        case 'u':
+          // Only the ASCII range is used by the firmware.
+          if (i + 4 < tok->len) {
+            ch = (char) strtol((char[]){tok->ptr[i + 3], tok->ptr[i + 4], 0},
+                               NULL, 16);
+            i += 4;
+          }
+          break;
+      }
+    }
+    *q++ = ch;
+  }
+  *q = 0;
+  return ret;
+}
+
+// Store tok into the target of the conversion spec. Returns true if it did.
+static bool json_scanf_store(const char *spec, size_t spec_len,
+                             const struct json_token *tok, va_list *ap) {
+  char fmt[16], buf[64];
+
+  if (spec[1] == 'M') {
+    json_scanner_t cb = va_arg(*ap, json_scanner_t);
+    void *user_data = va_arg(*ap, void *);
+    if (!tok) return false;
+    cb(tok->ptr, tok->len, user_data);
+    return true;
+  }
+  if (spec[1] == 'B') {
+    bool *target = va_arg(*ap, bool *);
+    if (!tok || (tok->type != JSON_TYPE_TRUE && tok->type != JSON_TYPE_FALSE))
+      return false;
+    *target = tok->type == JSON_TYPE_TRUE;
+    return true;
+  }
+  if (spec[1] == 'Q') {
+    char **target = va_arg(*ap, char **);
+    if (!tok || tok->type != JSON_TYPE_STRING) return false;
+    *target = json_unescape(tok);
+    return *target != NULL;
+  }
+  if (spec[1] == 'T') {
+    struct json_token *target = va_arg(*ap, struct json_token *);
+    if (!tok) return false;
+    *target = *tok;
+    return true;
+  }
+  {
+    void *target = va_arg(*ap, void *);
+    if (!tok || tok->len >= (int) sizeof(buf) || spec_len >= sizeof(fmt))
+      return false;
+    memcpy(buf, tok->ptr, tok->len);
+    buf[tok->len] = 0;
+    memcpy(fmt, spec, spec_len);
+    fmt[spec_len] = 0;
+    return sscanf(buf, fmt, target) == 1;
+  }
+}
+
+int json_vscanf(const char *str, int str_len, const char *fmt, va_list xap) {
+  char path[JSON_MAX_PATH_LEN] = "";
+  size_t depth_len[JSON_MAX_PATH_LEN / 2];
+  int depth = 0, count = 0;
+  const char *key = NULL;
+  size_t key_len = 0;
+  struct json_token tok;
+  va_list ap;
+
+  va_copy(ap, xap);
+  while (*fmt) {
+    if (*fmt == '{') {
+      // Descend into the member named by the last key, if any.
+      depth_len[depth++] = strlen(path);
+      if (key && strlen(path) + key_len + 2 < sizeof(path)) {
+        strcat(path, ".");
+        strncat(path, key, key_len);
+      }
+      key = NULL;
+      fmt++;
+    } else if (*fmt == '}') {
+      if (depth > 0) path[depth_len[--depth]] = 0;
+      fmt++;
+    } else if (*fmt == '[') {
+      // Arrays are read with json_scanf_array_elem(), not here.
+      int nest = 0;
+      do {
+        if (*fmt == '[') nest++;
+        if (*fmt == ']') nest--;
+        fmt++;
+      } while (*fmt && nest > 0);
+    } else if (*fmt == '%') {
+      size_t n = 1 + strspn(fmt + 1, "0123456789.hlLqjzt");
+      char full[JSON_MAX_PATH_LEN];
+      size_t path_len = strlen(path);
+      bool found = false;
+      if (fmt[n]) n++;
+      if (key && path_len + key_len + 2 < sizeof(full)) {
+        memcpy(full, path, path_len);
+        full[path_len] = '.';
+        memcpy(full + path_len + 1, key, key_len);
+        full[path_len + 1 + key_len] = 0;
+        found = json_find_path(str, str_len, full, &tok);
+      }
+      if (json_scanf_store(fmt, n, found ? &tok : NULL, &ap)) count++;
+      fmt += n;
+    } else if (*fmt == '_' || isalpha((unsigned char) *fmt)) {
+      key = fmt;
+      while (*fmt == '_' || isalnum((unsigned char) *fmt)) fmt++;
+      key_len = fmt - key;
+    } else if (*fmt == '"') {
+      key = ++fmt;
+      while (*fmt && *fmt != '"') fmt++;
+      key_len = fmt - key;
+      if (*fmt) fmt++;
+    } else {
+      fmt++;
+    }
+  }
+  va_end(ap);
+  return count;
+}
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...) {
+  va_list ap;
+  int count;
+
+  va_start(ap, fmt);
+  count = json_vscanf(str, str_len, fmt, ap);
+  va_end(ap);
+  return count;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The subset of the frozen JSON library used by the firmware. Like frozen,
+ * json_printf() quotes bare words in the format as keys, and delegates
+ * numeric conversions to the C library.
+ */
+#pragma once
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct json_out {
+  int (*printer)(struct json_out *, const char *str, size_t len);
+  union {
+    struct {
+      char *buf;
+      size_t size;
+      size_t len;
+    } buf;
+    void *data;
+    FILE *fp;
+  } u;
+};
+
+int json_printer_buf(struct json_out *, const char *, size_t);
+int json_printer_file(struct json_out *, const char *, size_t);
+int json_printer_mbuf(struct json_out *, const char *, size_t);
+
+#define JSON_OUT_BUF(buf, len) {json_printer_buf, {{buf, len, 0}}}
+#define JSON_OUT_FILE(fp) {json_printer_file, {{(char *) fp, 0, 0}}}
+#define JSON_OUT_MBUF(mb) {json_printer_mbuf, {{(char *) mb, 0, 0}}}
+
+typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
+
+int json_printf(struct json_out *, const char *fmt, ...);
+int json_vprintf(struct json_out *, const char *fmt, va_list ap);
+char *json_asprintf(const char *fmt, ...);
+char *json_vasprintf(const char *fmt, va_list ap);
+
+enum json_token_type {
+  JSON_TYPE_INVALID = 0,
+  JSON_TYPE_STRING,
+  JSON_TYPE_NUMBER,
+  JSON_TYPE_TRUE,
+  JSON_TYPE_FALSE,
+  JSON_TYPE_NULL,
+  JSON_TYPE_OBJECT_START,
+  JSON_TYPE_OBJECT_END,
+  JSON_TYPE_ARRAY_START,
+  JSON_TYPE_ARRAY_END,
+  JSON_TYPES_CNT,
+};
+
+struct json_token {
+  const char *ptr;
+  int len;
+  enum json_token_type type;
+};
+
+typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...);
+int json_vscanf(const char *str, int str_len, const char *fmt, va_list ap);
+int json_scanf_array_elem(const char *s, int len, const char *path, int index,
+                          struct json_token *token);
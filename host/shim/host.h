@@ -0,0 +1,119 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Control of the host build: the event loop and its clock, and the other ends
+ * of the RPC, MQTT, HTTP and GPIO APIs.
+ *
+ * The clock is the monotonic wall clock, plus all the idle time that was
+ * skipped: when nothing is runnable, and no task is busy, the event loop jumps
+ * straight to the next timer. Everything that runs is thus timed as it really
+ * runs, while polls that are seconds apart follow each other right away.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define HOST_MGOS_STACK_SIZE 8192  // Stack of the Mongoose OS task, in bytes
+
+/* host_main(): Run main_fn(arg) as the Mongoose OS task, on a painted stack of
+ * HOST_MGOS_STACK_SIZE (times HOST_STACK_SCALE) bytes, from a fresh temporary
+ * working directory that stands in for the filesystem and is removed
+ * afterwards.
+ *
+ * Returns: what main_fn returned, or -1 if it could not be started.
+ */
+int host_main(int (*main_fn)(void *arg), void *arg);
+
+/* host_set_speed(): Let the clock run at speed times real time while idle,
+ * or skip idle time altogether if speed is 0, which is the default.
+ */
+void host_set_speed(double speed);
+
+/* host_path(): Make path absolute against the current working directory, so
+ * that it names the same file from within host_main().
+ *
+ * Returns: the absolute path, which the caller must free, or NULL.
+ */
+char *host_path(const char *path);
+
+/* host_run(): Run the event loop until mgos_uptime() has advanced by the
+ * given number of seconds, and the tasks have finished with what they were
+ * handed by then. Must be called from the Mongoose OS task.
+ */
+void host_run(double seconds);
+
+/* host_wall_micros(): Return the monotonic wall clock, which unlike
+ * mgos_uptime_micros() does not include skipped idle time.
+ */
+int64_t host_wall_micros(void);
+
+/* host_heap_used(): Return the bytes currently allocated by the process
+ * beyond what was allocated when host_main() started.
+ */
+size_t host_heap_used(void);
+
+struct host_rpc_reply {
+  int code;      // 0 for a result, the error code otherwise
+  char *result;  // JSON result, or the error message; owned by the reply
+  size_t len;
+  bool done;     // The handler replied
+};
+
+/* host_rpc_call(): Call the handler of method with the JSON args, as a frame
+ * arriving on a transport would, and collect its reply. Must be called from
+ * the Mongoose OS task.
+ *
+ * Returns: true if the method exists and replied, false otherwise.
+ */
+bool host_rpc_call(const char *method, const char *args,
+                   struct host_rpc_reply *reply);
+
+void host_rpc_reply_free(struct host_rpc_reply *reply);
+
+typedef void (*host_mqtt_pub_cb)(const char *topic, const void *msg,
+                                 size_t len, void *arg);
+
+struct host_mqtt_stats {
+  uint32_t published;
+  uint64_t bytes;
+};
+
+/* host_mqtt_set_connected(): Connect or disconnect the MQTT client. On
+ * connect, the global handlers see MG_EV_MQTT_CONNACK.
+ */
+void host_mqtt_set_connected(bool connected);
+void host_mqtt_set_pub_handler(host_mqtt_pub_cb cb, void *arg);
+void host_mqtt_get_stats(struct host_mqtt_stats *stats);
+
+/* host_http_get(): Call the handler registered for uri, collecting what it
+ * sends into body, which the caller frees.
+ *
+ * Returns: the HTTP status, or 404 if there is no such endpoint.
+ */
+int host_http_get(const char *uri, struct mbuf *body);
+
+/* host_gpio_press(): Press the button on pin.
+ *
+ * Returns: true if a handler was called, false otherwise.
+ */
+bool host_gpio_press(int pin);
+
+// Shared with the FreeRTOS shim: the event loop waits for tasks to go idle
+// before skipping time, and host_main() runs on a task of its own.
+void host_loop_task_busy(int delta);
+void host_loop_wake(void);
+bool host_task_run(const char *name, uint32_t stack_size, void (*fn)(void *),
+                   void *arg);
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "common/cs_crc32.h"
+#include "common/mbuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void mbuf_init(struct mbuf *mb, size_t initial_size) {
+  mb->len = mb->size = 0;
+  mb->buf = NULL;
+  mbuf_resize(mb, initial_size);
+}
+
+void mbuf_free(struct mbuf *mb) {
+  free(mb->buf);
+  mbuf_init(mb, 0);
+}
+
+void mbuf_resize(struct mbuf *mb, size_t new_size) {
+  char *buf;
+
+  if (new_size > mb->size || (new_size < mb->size && new_size >= mb->len)) {
+    buf = realloc(mb->buf, new_size);
+    // On failure the buffer is left as it was; a zero size frees it.
+    if (!buf && new_size != 0) return;
+    mb->buf = buf;
+    mb->size = new_size;
+  }
+}
+
+void mbuf_trim(struct mbuf *mb) {
+  mbuf_resize(mb, mb->len);
+}
+
+size_t mbuf_insert(struct mbuf *mb, size_t off, const void *data, size_t len) {
+  if (off > mb->len) return 0;
+  if (mb->len + len > mb->size) {
+    size_t new_size = (size_t) ((mb->len + len) * MBUF_SIZE_MULTIPLIER);
+    mbuf_resize(mb, new_size);
+    if (mb->len + len > mb->size) return 0;
+  }
+  memmove(mb->buf + off + len, mb->buf + off, mb->len - off);
+  if (data) memcpy(mb->buf + off, data, len);
+  mb->len += len;
+  return len;
+}
+
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t len) {
+  return mbuf_insert(mb, mb->len, data, len);
+}
+
+void mbuf_remove(struct mbuf *mb, size_t len) {
+  if (len == 0 || len > mb->len) return;
+  memmove(mb->buf, mb->buf + len, mb->len - len);
+  mb->len -= len;
+}
+
+void mbuf_clear(struct mbuf *mb) {
+  mb->len = 0;
+}
+
+uint32_t cs_crc32(uint32_t crc32, const void *data, uint32_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+
+  crc32 = ~crc32;
+  while (len--) {
+    crc32 ^= *p++;
+    for (int i = 0; i < 8; i++)
+      crc32 = (crc32 >> 1) ^ (0xedb88320 & -(crc32 & 1));
+  }
+  return ~crc32;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A small stand-in for the Mongoose OS API on Linux, so that the firmware
+ * builds and runs on the host. It provides the subset of mgos, mongoose and
+ * frozen that the firmware uses, with an event loop on a clock that can skip
+ * idle time, see host.h.
+ */
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/mbuf.h"
+#include "frozen.h"
+#include "mgos_sys_config.h"
+
+#define CS_P_UNIX 1
+#define CS_P_ESP32 15
+#define CS_PLATFORM CS_P_UNIX
+
+#define MGOS_APP "pdu"
+
+enum cs_log_level {
+  LL_NONE = -1,
+  LL_ERROR = 0,
+  LL_WARN = 1,
+  LL_INFO = 2,
+  LL_DEBUG = 3,
+  LL_VERBOSE_DEBUG = 4,
+};
+
+void cs_log_set_level(enum cs_log_level level);
+bool cs_log_print_prefix(enum cs_log_level level, const char *file, int ln);
+void cs_log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define LOG(l, x)                                     \
+  do {                                                \
+    if (cs_log_print_prefix(l, __FILE__, __LINE__)) { \
+      cs_log_printf x;                                \
+    }                                                 \
+  } while (0)
+
+struct mg_str {
+  const char *p;
+  size_t len;
+};
+
+struct mg_str mg_mk_str(const char *s);
+struct mg_str mg_mk_str_n(const char *s, size_t len);
+int mg_vcmp(const struct mg_str *str1, const char *str2);
+
+#define MG_F_SEND_AND_CLOSE (1 << 10)
+
+// A connection only collects what is sent on it.
+struct mg_connection {
+  unsigned long flags;
+  int status;
+  struct mbuf send_mbuf;
+};
+
+typedef void (*mg_event_handler_t)(struct mg_connection *nc, int ev,
+                                   void *ev_data, void *user_data);
+
+double mg_time(void);
+double mgos_uptime(void);
+int64_t mgos_uptime_micros(void);
+
+enum mgos_app_init_result {
+  MGOS_APP_INIT_SUCCESS = 0,
+  MGOS_APP_INIT_ERROR = -2,
+};
+
+enum mgos_app_init_result mgos_app_init(void);
+
+#define MGOS_TIMER_REPEAT 1
+#define MGOS_TIMER_RUN_NOW 2
+#define MGOS_INVALID_TIMER_ID 0
+
+typedef uintptr_t mgos_timer_id;
+typedef void (*timer_callback)(void *param);
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg);
+void mgos_clear_timer(mgos_timer_id id);
+
+typedef void (*mgos_cb_t)(void *arg);
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr);
+
+#define MGOS_EVENT_SYS 0x4d4f53  // "MOS"
+#define MGOS_EVENT_REBOOT (MGOS_EVENT_SYS + 2)
+#define MGOS_EVENT_REBOOT_AFTER (MGOS_EVENT_SYS + 3)
+
+typedef void (*mgos_event_handler_t)(int ev, void *ev_data, void *userdata);
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata);
+int mgos_event_trigger(int ev, void *ev_data);
+
+struct mgos_rlock_type;
+
+struct mgos_rlock_type *mgos_rlock_create(void);
+void mgos_rlock(struct mgos_rlock_type *l);
+void mgos_runlock(struct mgos_rlock_type *l);
+void mgos_rlock_destroy(struct mgos_rlock_type *l);
+
+size_t mgos_get_heap_size(void);
+size_t mgos_get_free_heap_size(void);
+size_t mgos_get_min_free_heap_size(void);
+
+#define MGOS_GPIO_PULL_UP 1
+#define MGOS_GPIO_INT_EDGE_NEG 2
+
+typedef void (*mgos_gpio_int_handler_f)(int pin, void *arg);
+
+bool mgos_gpio_set_button_handler(int pin, int pull_type, int int_type,
+                                  int debounce_ms, mgos_gpio_int_handler_f cb,
+                                  void *arg);
+
+#define MGOS_NET_IF_TYPE_WIFI 0
+#define MGOS_NET_IF_WIFI_STA 0
+#define MGOS_NET_IF_WIFI_AP 1
+
+struct mgos_net_ip_info {
+  struct {
+    uint32_t addr;
+  } ip, netmask, gw;
+};
+
+bool mgos_net_get_ip_info(int if_type, int if_instance,
+                          struct mgos_net_ip_info *ip_info);
+char *mgos_net_ip_to_str(const void *sin, char *out);
+
+const char *mgos_sys_ro_vars_get_arch(void);
+const char *mgos_sys_ro_vars_get_mac_address(void);
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mgos_sys_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HOST_CONFIG_VAR_INT(name, def) static int s_##name = def;
+#define HOST_CONFIG_VAR_DOUBLE(name, def) static double s_##name = def;
+#define HOST_CONFIG_VAR_BOOL(name, def) static bool s_##name = def;
+#define HOST_CONFIG_VAR_STR(name, def) static char *s_##name = NULL;
+
+HOST_CONFIG(HOST_CONFIG_VAR_INT, HOST_CONFIG_VAR_DOUBLE, HOST_CONFIG_VAR_BOOL,
+            HOST_CONFIG_VAR_STR)
+
+#define HOST_CONFIG_FN(type, name)        \
+  type mgos_sys_config_get_##name(void) { \
+    return s_##name;                      \
+  }                                       \
+  void mgos_sys_config_set_##name(type value) { s_##name = value; }
+#define HOST_CONFIG_FN_INT(name, def) HOST_CONFIG_FN(int, name)
+#define HOST_CONFIG_FN_DOUBLE(name, def) HOST_CONFIG_FN(double, name)
+#define HOST_CONFIG_FN_BOOL(name, def) HOST_CONFIG_FN(bool, name)
+#define HOST_CONFIG_FN_STR(name, def)                  \
+  const char *mgos_sys_config_get_##name(void) {       \
+    return s_##name ? s_##name : def;                  \
+  }                                                    \
+  void mgos_sys_config_set_##name(const char *value) { \
+    free(s_##name);                                    \
+    s_##name = value ? strdup(value) : NULL;           \
+  }
+
+HOST_CONFIG(HOST_CONFIG_FN_INT, HOST_CONFIG_FN_DOUBLE, HOST_CONFIG_FN_BOOL,
+            HOST_CONFIG_FN_STR)
+
+// Match key, as "pdu.modbus_interval", against name, as "pdu_modbus_interval".
+static bool host_config_match(const char *key, const char *name) {
+  for (; *key && *name; key++, name++) {
+    if (*key == *name || (*key == '.' && *name == '_')) continue;
+    return false;
+  }
+  return *key == *name;
+}
+
+#define HOST_CONFIG_SET_INT(name, def)       \
+  if (host_config_match(key, #name)) {       \
+    s_##name = (int) strtol(value, &end, 0); \
+    return end != value && *end == 0;        \
+  }
+#define HOST_CONFIG_SET_DOUBLE(name, def) \
+  if (host_config_match(key, #name)) {    \
+    s_##name = strtod(value, &end);       \
+    return end != value && *end == 0;     \
+  }
+#define HOST_CONFIG_SET_BOOL(name, def)                               \
+  if (host_config_match(key, #name)) {                                \
+    s_##name = strcmp(value, "true") == 0 || strcmp(value, "1") == 0; \
+    return true;                                                      \
+  }
+#define HOST_CONFIG_SET_STR(name, def) \
+  if (host_config_match(key, #name)) { \
+    mgos_sys_config_set_##name(value); \
+    return true;                       \
+  }
+
+bool host_config_set(const char *key, const char *value) {
+  char *end;
+
+  if (!key || !value) return false;
+  HOST_CONFIG(HOST_CONFIG_SET_INT, HOST_CONFIG_SET_DOUBLE, HOST_CONFIG_SET_BOOL,
+              HOST_CONFIG_SET_STR)
+  return false;
+}
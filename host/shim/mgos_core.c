@@ -0,0 +1,494 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "host.h"
+
+#include <ftw.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "freertos/task.h"
+
+#define HOST_HEAP_SIZE (320 * 1024)  // Heap of an ESP32 with WiFi running
+#define HOST_MAX_EVENT_HANDLERS 32
+#define HOST_MAX_BUTTONS 8
+
+// Guards the timers, the callback queue and the busy count, and wakes the
+// event loop when either of the latter changes.
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_wake = PTHREAD_COND_INITIALIZER;
+
+static pthread_mutex_t s_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum cs_log_level s_log_level = LL_INFO;
+
+static int64_t s_wall_start_us = 0;
+static int64_t s_skipped_us = 0;
+static double s_epoch = 0;
+static double s_speed = 0;
+static int s_busy = 0;
+
+struct host_timer {
+  mgos_timer_id id;
+  int64_t due_us;
+  int interval_ms;
+  bool repeat;
+  timer_callback cb;
+  void *arg;
+  struct host_timer *next;
+};
+
+static struct host_timer *s_timers = NULL;  // Sorted by due_us
+static mgos_timer_id s_next_timer_id = 1;
+
+struct host_invoke {
+  mgos_cb_t cb;
+  void *arg;
+  struct host_invoke *next;
+};
+
+static struct host_invoke *s_invoke_head = NULL;
+static struct host_invoke *s_invoke_tail = NULL;
+
+struct host_event_handler {
+  int ev;
+  mgos_event_handler_t cb;
+  void *userdata;
+};
+
+static struct host_event_handler s_event_handlers[HOST_MAX_EVENT_HANDLERS];
+static int s_num_event_handlers = 0;
+
+struct host_button {
+  int pin;
+  mgos_gpio_int_handler_f cb;
+  void *arg;
+};
+
+static struct host_button s_buttons[HOST_MAX_BUTTONS];
+static int s_num_buttons = 0;
+
+static size_t s_heap_baseline = 0;
+static size_t s_heap_min_free = HOST_HEAP_SIZE;
+
+void cs_log_set_level(enum cs_log_level level) {
+  s_log_level = level;
+}
+
+bool cs_log_print_prefix(enum cs_log_level level, const char *file, int ln) {
+  const char *base = strrchr(file, '/');
+
+  if (level > s_log_level) return false;
+  pthread_mutex_lock(&s_log_lock);
+  fprintf(stderr, "[%10.3f] %s:%d ", mgos_uptime(), base ? base + 1 : file,
+          ln);
+  return true;
+}
+
+void cs_log_printf(const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  pthread_mutex_unlock(&s_log_lock);
+}
+
+struct mg_str mg_mk_str(const char *s) {
+  struct mg_str ret = {s, s ? strlen(s) : 0};
+  return ret;
+}
+
+struct mg_str mg_mk_str_n(const char *s, size_t len) {
+  struct mg_str ret = {s, len};
+  return ret;
+}
+
+int mg_vcmp(const struct mg_str *str1, const char *str2) {
+  size_t n2 = strlen(str2), n1 = str1->len;
+  int r = strncmp(str1->p, str2, (n1 < n2) ? n1 : n2);
+  if (r == 0) return n1 - n2;
+  return r;
+}
+
+int64_t host_wall_micros(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - s_wall_start_us;
+}
+
+int64_t mgos_uptime_micros(void) {
+  return host_wall_micros() + __atomic_load_n(&s_skipped_us, __ATOMIC_ACQUIRE);
+}
+
+double mgos_uptime(void) {
+  return mgos_uptime_micros() / 1e6;
+}
+
+double mg_time(void) {
+  return s_epoch + mgos_uptime();
+}
+
+void host_set_speed(double speed) {
+  s_speed = speed < 1 ? 0 : speed;
+}
+
+static void host_skip(int64_t us) {
+  if (us > 0) __atomic_add_fetch(&s_skipped_us, us, __ATOMIC_RELEASE);
+}
+
+// Insert t into s_timers after the timers due at the same time. Called with
+// s_lock held.
+static void host_timer_insert(struct host_timer *t) {
+  struct host_timer **p = &s_timers;
+
+  while (*p && (*p)->due_us <= t->due_us) p = &(*p)->next;
+  t->next = *p;
+  *p = t;
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg) {
+  struct host_timer *t = calloc(1, sizeof(*t));
+
+  if (!t) return MGOS_INVALID_TIMER_ID;
+  t->interval_ms = msecs;
+  t->repeat = (flags & MGOS_TIMER_REPEAT) != 0;
+  t->cb = cb;
+  t->arg = cb_arg;
+  t->due_us = mgos_uptime_micros();
+  if (!(flags & MGOS_TIMER_RUN_NOW)) t->due_us += (int64_t) msecs * 1000;
+  pthread_mutex_lock(&s_lock);
+  t->id = s_next_timer_id++;
+  host_timer_insert(t);
+  pthread_mutex_unlock(&s_lock);
+  return t->id;
+}
+
+void mgos_clear_timer(mgos_timer_id id) {
+  struct host_timer **p, *t = NULL;
+
+  pthread_mutex_lock(&s_lock);
+  for (p = &s_timers; *p; p = &(*p)->next) {
+    if ((*p)->id != id) continue;
+    t = *p;
+    *p = t->next;
+    break;
+  }
+  pthread_mutex_unlock(&s_lock);
+  free(t);
+}
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr) {
+  struct host_invoke *inv = calloc(1, sizeof(*inv));
+
+  if (!inv) return false;
+  inv->cb = cb;
+  inv->arg = arg;
+  pthread_mutex_lock(&s_lock);
+  if (s_invoke_tail)
+    s_invoke_tail->next = inv;
+  else
+    s_invoke_head = inv;
+  s_invoke_tail = inv;
+  pthread_cond_broadcast(&s_wake);
+  pthread_mutex_unlock(&s_lock);
+  return true;
+}
+
+void host_loop_task_busy(int delta) {
+  pthread_mutex_lock(&s_lock);
+  s_busy += delta;
+  pthread_cond_broadcast(&s_wake);
+  pthread_mutex_unlock(&s_lock);
+}
+
+void host_loop_wake(void) {
+  pthread_mutex_lock(&s_lock);
+  pthread_cond_broadcast(&s_wake);
+  pthread_mutex_unlock(&s_lock);
+}
+
+// Run the callbacks queued so far. Returns true if any ran.
+static bool host_run_invokes(void) {
+  struct host_invoke *inv;
+  bool ran = false;
+
+  for (;;) {
+    pthread_mutex_lock(&s_lock);
+    inv = s_invoke_head;
+    if (inv) {
+      s_invoke_head = inv->next;
+      if (!s_invoke_head) s_invoke_tail = NULL;
+    }
+    pthread_mutex_unlock(&s_lock);
+    if (!inv) return ran;
+    inv->cb(inv->arg);
+    free(inv);
+    ran = true;
+  }
+}
+
+// Run the first timer if it is due. Returns true if it ran.
+static bool host_run_timer(void) {
+  struct host_timer *t;
+  int64_t now_us = mgos_uptime_micros();
+
+  pthread_mutex_lock(&s_lock);
+  t = s_timers;
+  if (!t || t->due_us > now_us) {
+    pthread_mutex_unlock(&s_lock);
+    return false;
+  }
+  s_timers = t->next;
+  pthread_mutex_unlock(&s_lock);
+
+  t->cb(t->arg);
+  if (!t->repeat) {
+    free(t);
+    return true;
+  }
+  t->due_us = mgos_uptime_micros() + (int64_t) t->interval_ms * 1000;
+  pthread_mutex_lock(&s_lock);
+  host_timer_insert(t);
+  pthread_mutex_unlock(&s_lock);
+  return true;
+}
+
+// Wait until target_us, or until a callback is queued. Without a speed, the
+// clock skips to target_us once no task is busy.
+static void host_idle(int64_t target_us) {
+  int64_t now_us, wall_us;
+  struct timespec ts;
+
+  pthread_mutex_lock(&s_lock);
+  while (!s_invoke_head) {
+    now_us = mgos_uptime_micros();
+    if (now_us >= target_us) break;
+    if (s_speed == 0) {
+      if (s_busy > 0) {
+        pthread_cond_wait(&s_wake, &s_lock);
+        continue;
+      }
+      host_skip(target_us - now_us);
+      break;
+    }
+    wall_us = host_wall_micros();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long) ((target_us - now_us) / s_speed) * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&s_wake, &s_lock, &ts);
+    host_skip((int64_t) ((host_wall_micros() - wall_us) * (s_speed - 1)));
+  }
+  pthread_mutex_unlock(&s_lock);
+}
+
+// Wait for the busy tasks to go idle. Returns false if none were busy and no
+// callback is queued, so there is nothing left to run.
+static bool host_settle(void) {
+  bool ret;
+
+  pthread_mutex_lock(&s_lock);
+  ret = s_busy > 0 || s_invoke_head;
+  while (s_busy > 0 && !s_invoke_head) pthread_cond_wait(&s_wake, &s_lock);
+  pthread_mutex_unlock(&s_lock);
+  return ret;
+}
+
+void host_run(double seconds) {
+  int64_t end_us = mgos_uptime_micros() + (int64_t) (seconds * 1e6);
+  int64_t target_us;
+
+  for (;;) {
+    if (host_run_invokes()) continue;
+    if (host_run_timer()) continue;
+    if (mgos_uptime_micros() >= end_us) {
+      if (!host_settle()) break;
+      continue;
+    }
+    pthread_mutex_lock(&s_lock);
+    target_us = s_timers && s_timers->due_us < end_us ? s_timers->due_us
+                                                       : end_us;
+    pthread_mutex_unlock(&s_lock);
+    host_idle(target_us);
+  }
+}
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata) {
+  if (s_num_event_handlers == HOST_MAX_EVENT_HANDLERS) return false;
+  s_event_handlers[s_num_event_handlers].ev = ev;
+  s_event_handlers[s_num_event_handlers].cb = cb;
+  s_event_handlers[s_num_event_handlers].userdata = userdata;
+  s_num_event_handlers++;
+  return true;
+}
+
+int mgos_event_trigger(int ev, void *ev_data) {
+  int n = 0;
+
+  for (int i = 0; i < s_num_event_handlers; i++) {
+    if (s_event_handlers[i].ev != ev) continue;
+    s_event_handlers[i].cb(ev, ev_data, s_event_handlers[i].userdata);
+    n++;
+  }
+  return n;
+}
+
+struct mgos_rlock_type {
+  pthread_mutex_t mutex;
+};
+
+struct mgos_rlock_type *mgos_rlock_create(void) {
+  struct mgos_rlock_type *l = calloc(1, sizeof(*l));
+  pthread_mutexattr_t attr;
+
+  if (!l) return NULL;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&l->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return l;
+}
+
+void mgos_rlock(struct mgos_rlock_type *l) {
+  pthread_mutex_lock(&l->mutex);
+}
+
+void mgos_runlock(struct mgos_rlock_type *l) {
+  pthread_mutex_unlock(&l->mutex);
+}
+
+void mgos_rlock_destroy(struct mgos_rlock_type *l) {
+  if (!l) return;
+  pthread_mutex_destroy(&l->mutex);
+  free(l);
+}
+
+static size_t host_heap_allocated(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+size_t host_heap_used(void) {
+  size_t allocated = host_heap_allocated();
+  return allocated > s_heap_baseline ? allocated - s_heap_baseline : 0;
+}
+
+size_t mgos_get_heap_size(void) {
+  return HOST_HEAP_SIZE;
+}
+
+size_t mgos_get_free_heap_size(void) {
+  size_t used = host_heap_used();
+  size_t avail = used < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - used : 0;
+
+  if (avail < s_heap_min_free) s_heap_min_free = avail;
+  return avail;
+}
+
+size_t mgos_get_min_free_heap_size(void) {
+  mgos_get_free_heap_size();
+  return s_heap_min_free;
+}
+
+bool mgos_gpio_set_button_handler(int pin, int pull_type, int int_type,
+                                  int debounce_ms, mgos_gpio_int_handler_f cb,
+                                  void *arg) {
+  if (s_num_buttons == HOST_MAX_BUTTONS) return false;
+  s_buttons[s_num_buttons].pin = pin;
+  s_buttons[s_num_buttons].cb = cb;
+  s_buttons[s_num_buttons].arg = arg;
+  s_num_buttons++;
+  return true;
+}
+
+bool host_gpio_press(int pin) {
+  for (int i = 0; i < s_num_buttons; i++) {
+    if (s_buttons[i].pin != pin) continue;
+    s_buttons[i].cb(pin, s_buttons[i].arg);
+    return true;
+  }
+  return false;
+}
+
+bool mgos_net_get_ip_info(int if_type, int if_instance,
+                          struct mgos_net_ip_info *ip_info) {
+  return false;
+}
+
+char *mgos_net_ip_to_str(const void *sin, char *out) {
+  strcpy(out, "0.0.0.0");
+  return out;
+}
+
+const char *mgos_sys_ro_vars_get_arch(void) {
+  return "host";
+}
+
+const char *mgos_sys_ro_vars_get_mac_address(void) {
+  return "000000000000";
+}
+
+struct host_main_ctx {
+  int (*main_fn)(void *arg);
+  void *arg;
+  int ret;
+};
+
+static void host_main_task(void *arg) {
+  struct host_main_ctx *ctx = (struct host_main_ctx *) arg;
+  ctx->ret = ctx->main_fn(ctx->arg);
+}
+
+static int host_rmtree_entry(const char *path, const struct stat *sb,
+                             int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int host_main(int (*main_fn)(void *arg), void *arg) {
+  struct host_main_ctx ctx = {main_fn, arg, -1};
+  char dir[] = "/tmp/pdu-host.XXXXXX";
+  char cwd[256];
+
+  s_wall_start_us = 0;
+  s_wall_start_us = host_wall_micros();
+  s_epoch = (double) time(NULL);
+  s_heap_baseline = host_heap_allocated();
+
+  if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir) != 0) {
+    perror("host_main");
+    return -1;
+  }
+  if (!host_task_run("mgos", HOST_MGOS_STACK_SIZE, host_main_task, &ctx))
+    fprintf(stderr, "host_main: could not start the mgos task\n");
+  if (chdir(cwd) != 0) perror("host_main");
+  nftw(dir, host_rmtree_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return ctx.ret;
+}
+
+char *host_path(const char *path) {
+  char cwd[256], *ret;
+  size_t len;
+
+  if (path[0] == '/') return strdup(path);
+  if (!getcwd(cwd, sizeof(cwd))) return NULL;
+  len = strlen(cwd) + 1 + strlen(path) + 1;
+  if (!(ret = malloc(len))) return NULL;
+  snprintf(ret, len, "%s/%s", cwd, path);
+  return ret;
+}
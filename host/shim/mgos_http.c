@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mgos_http_server.h"
+
+#include "host.h"
+
+#define HOST_HTTP_MAX_ENDPOINTS 8
+
+struct host_http_endpoint {
+  const char *uri;
+  mg_event_handler_t handler;
+  void *user_data;
+};
+
+static struct host_http_endpoint s_endpoints[HOST_HTTP_MAX_ENDPOINTS];
+static int s_num_endpoints = 0;
+
+void mgos_register_http_endpoint(const char *uri_path,
+                                 mg_event_handler_t handler, void *user_data) {
+  if (s_num_endpoints >= HOST_HTTP_MAX_ENDPOINTS) return;
+  s_endpoints[s_num_endpoints].uri = uri_path;
+  s_endpoints[s_num_endpoints].handler = handler;
+  s_endpoints[s_num_endpoints].user_data = user_data;
+  s_num_endpoints++;
+}
+
+void mg_send_head(struct mg_connection *n, int status_code,
+                  int64_t content_length, const char *extra_headers) {
+  n->status = status_code;
+  (void) content_length;
+  (void) extra_headers;
+}
+
+void mg_send(struct mg_connection *nc, const void *buf, int len) {
+  mbuf_append(&nc->send_mbuf, buf, len);
+}
+
+int host_http_get(const char *uri, struct mbuf *body) {
+  struct mg_connection nc;
+
+  mbuf_init(body, 0);
+  for (int i = 0; i < s_num_endpoints; i++) {
+    if (strcmp(s_endpoints[i].uri, uri) != 0) continue;
+    memset(&nc, 0, sizeof(nc));
+    mbuf_init(&nc.send_mbuf, 0);
+    s_endpoints[i].handler(&nc, MG_EV_HTTP_REQUEST, NULL,
+                           s_endpoints[i].user_data);
+    *body = nc.send_mbuf;
+    return nc.status;
+  }
+  return 404;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The mgos http-server library API, with endpoints called by
+ * host_http_get().
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define MG_EV_HTTP_REQUEST 100
+
+void mgos_register_http_endpoint(const char *uri_path,
+                                 mg_event_handler_t handler, void *user_data);
+void mg_send_head(struct mg_connection *n, int status_code,
+                  int64_t content_length, const char *extra_headers);
+void mg_send(struct mg_connection *nc, const void *buf, int len);
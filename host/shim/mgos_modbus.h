@@ -0,0 +1,46 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The mgos modbus library API, answered by the simulated sensors in sim.h. */
+#pragma once
+
+#include "mgos.h"
+
+#define FUNC_READ_HOLDING_REGISTERS 0x03
+
+#define RESP_SUCCESS 0x00
+#define RESP_INVALID_SLAVE_ID 0xE0
+#define RESP_INVALID_FUNCTION 0xE1
+#define RESP_TIMED_OUT 0xE2
+#define RESP_INVALID_CRC 0xE3
+
+struct mb_request_info {
+  uint8_t slave_id;
+  uint16_t read_address;
+  uint16_t read_qty;
+  uint16_t write_address;
+  uint16_t write_qty;
+  uint8_t func_code;
+};
+
+typedef void (*mb_response_callback)(uint8_t status,
+                                     struct mb_request_info mb_ri,
+                                     struct mbuf response, void *param);
+
+bool mgos_modbus_connect(void);
+bool mb_read_holding_registers(uint8_t slave_id, uint16_t read_address,
+                               uint16_t read_qty, mb_response_callback cb,
+                               void *cb_arg);
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mgos_mqtt.h"
+
+#include "host.h"
+
+#define HOST_MQTT_MAX_HANDLERS 8
+
+struct host_mqtt_handler {
+  mg_event_handler_t handler;
+  void *ud;
+};
+
+static struct host_mqtt_handler s_handlers[HOST_MQTT_MAX_HANDLERS];
+static int s_num_handlers = 0;
+static bool s_connected = false;
+static host_mqtt_pub_cb s_pub_cb = NULL;
+static void *s_pub_cb_arg = NULL;
+static struct host_mqtt_stats s_stats;
+
+uint16_t mgos_mqtt_pub(const char *topic, const void *message, size_t len,
+                       int qos, bool retain) {
+  if (!s_connected) return 0;
+  s_stats.published++;
+  s_stats.bytes += len;
+  if (s_pub_cb) s_pub_cb(topic, message, len, s_pub_cb_arg);
+  (void) qos;
+  (void) retain;
+  return 1;
+}
+
+void mgos_mqtt_sub(const char *topic, sub_handler_t handler, void *ud) {
+  // Nothing is ever received on the host.
+  (void) topic;
+  (void) handler;
+  (void) ud;
+}
+
+void mgos_mqtt_add_global_handler(mg_event_handler_t handler, void *ud) {
+  if (s_num_handlers >= HOST_MQTT_MAX_HANDLERS) return;
+  s_handlers[s_num_handlers].handler = handler;
+  s_handlers[s_num_handlers].ud = ud;
+  s_num_handlers++;
+}
+
+bool mgos_mqtt_global_is_connected(void) {
+  return s_connected;
+}
+
+void host_mqtt_set_connected(bool connected) {
+  struct mg_connection nc;
+
+  s_connected = connected;
+  if (!connected) return;
+  memset(&nc, 0, sizeof(nc));
+  for (int i = 0; i < s_num_handlers; i++)
+    s_handlers[i].handler(&nc, MG_EV_MQTT_CONNACK, NULL, s_handlers[i].ud);
+}
+
+void host_mqtt_set_pub_handler(host_mqtt_pub_cb cb, void *arg) {
+  s_pub_cb = cb;
+  s_pub_cb_arg = arg;
+}
+
+void host_mqtt_get_stats(struct host_mqtt_stats *stats) {
+  *stats = s_stats;
+}
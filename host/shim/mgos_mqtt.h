@@ -0,0 +1,34 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The mgos mqtt library API. Publishes are counted, and the connection state
+ * is set with host_mqtt_set_connected().
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define MG_EV_MQTT_CONNACK 202
+
+typedef void (*sub_handler_t)(struct mg_connection *nc, const char *topic,
+                              int topic_len, const char *msg, int msg_len,
+                              void *ud);
+
+uint16_t mgos_mqtt_pub(const char *topic, const void *message, size_t len,
+                       int qos, bool retain);
+void mgos_mqtt_sub(const char *topic, sub_handler_t, void *ud);
+void mgos_mqtt_add_global_handler(mg_event_handler_t handler, void *ud);
+bool mgos_mqtt_global_is_connected(void);
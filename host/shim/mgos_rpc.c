@@ -0,0 +1,113 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mgos_rpc.h"
+
+#include "host.h"
+
+#define HOST_RPC_MAX_HANDLERS 64
+
+struct host_rpc_handler {
+  const char *method;
+  const char *args_fmt;
+  mg_handler_cb_t cb;
+  void *cb_arg;
+};
+
+static struct host_rpc_handler s_handlers[HOST_RPC_MAX_HANDLERS];
+static int s_num_handlers = 0;
+static int64_t s_next_id = 1;
+
+struct mg_rpc *mgos_rpc_get_global(void) {
+  static int s_rpc;
+  return (struct mg_rpc *) &s_rpc;
+}
+
+bool mg_rpc_add_handler(struct mg_rpc *c, const char *method,
+                        const char *args_fmt, mg_handler_cb_t cb,
+                        void *cb_arg) {
+  struct host_rpc_handler *h;
+
+  if (s_num_handlers >= HOST_RPC_MAX_HANDLERS) return false;
+  h = &s_handlers[s_num_handlers++];
+  h->method = method;
+  h->args_fmt = args_fmt;
+  h->cb = cb;
+  h->cb_arg = cb_arg;
+  (void) c;
+  return true;
+}
+
+static bool host_rpc_reply(struct mg_rpc_request_info *ri, int code,
+                           char *result) {
+  struct host_rpc_reply *reply = ri->reply;
+
+  reply->code = code;
+  reply->result = result;
+  reply->len = result ? strlen(result) : 0;
+  reply->done = true;
+  free(ri);
+  return result != NULL;
+}
+
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
+                           const char *result_json_fmt, ...) {
+  va_list ap;
+  char *result;
+
+  va_start(ap, result_json_fmt);
+  result = json_vasprintf(result_json_fmt ? result_json_fmt : "null", ap);
+  va_end(ap);
+  return host_rpc_reply(ri, 0, result);
+}
+
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
+                        const char *error_msg_fmt, ...) {
+  va_list ap;
+  char buf[256];
+
+  va_start(ap, error_msg_fmt);
+  vsnprintf(buf, sizeof(buf), error_msg_fmt ? error_msg_fmt : "", ap);
+  va_end(ap);
+  return host_rpc_reply(ri, error_code, strdup(buf));
+}
+
+bool host_rpc_call(const char *method, const char *args,
+                   struct host_rpc_reply *reply) {
+  struct mg_rpc_request_info *ri;
+  struct host_rpc_handler *h = NULL;
+
+  memset(reply, 0, sizeof(*reply));
+  for (int i = 0; i < s_num_handlers; i++) {
+    if (strcmp(s_handlers[i].method, method) == 0) h = &s_handlers[i];
+  }
+  if (!h || !(ri = calloc(1, sizeof(*ri)))) return false;
+  ri->rpc = mgos_rpc_get_global();
+  ri->id = s_next_id++;
+  ri->src = mg_mk_str("host");
+  ri->dst = mg_mk_str(mgos_sys_config_get_device_id());
+  ri->tag = mg_mk_str("host");
+  ri->method = mg_mk_str(h->method);
+  ri->args_fmt = h->args_fmt;
+  ri->reply = reply;
+  if (!args) args = "{}";
+  h->cb(ri, h->cb_arg, NULL, mg_mk_str(args));
+  return reply->done;
+}
+
+void host_rpc_reply_free(struct host_rpc_reply *reply) {
+  free(reply->result);
+  memset(reply, 0, sizeof(*reply));
+}
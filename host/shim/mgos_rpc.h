@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The mg_rpc API, with handlers called by host_rpc_call(). */
+#pragma once
+
+#include "mgos.h"
+
+struct mg_rpc;
+struct mg_rpc_frame_info;
+struct host_rpc_reply;
+
+struct mg_rpc_request_info {
+  struct mg_rpc *rpc;
+  int64_t id;
+  struct mg_str src;
+  struct mg_str dst;
+  struct mg_str tag;
+  struct mg_str method;
+  const char *args_fmt;
+  struct host_rpc_reply *reply;
+};
+
+typedef void (*mg_handler_cb_t)(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args);
+
+struct mg_rpc *mgos_rpc_get_global(void);
+bool mg_rpc_add_handler(struct mg_rpc *c, const char *method,
+                        const char *args_fmt, mg_handler_cb_t cb,
+                        void *cb_arg);
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
+                           const char *result_json_fmt, ...);
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
+                        const char *error_msg_fmt, ...);
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The configuration of the firmware, with the defaults of mos.yml. Every
+ * entry gets a getter and a setter named as Mongoose OS generates them, and
+ * can be set by name with host_config_set().
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#define HOST_CONFIG(INT, DOUBLE, BOOL, STR)  \
+  STR(device_id, "pdu_host")                 \
+  STR(pdu_hostname, "pdu-test")              \
+  STR(pdu_location, "Zurich, Switzerland")   \
+  STR(pdu_contact, "admin@example.com")      \
+  INT(pdu_state_interval, 24)                \
+  INT(pdu_state_journal_interval, 60)        \
+  INT(pdu_state_journal_records, 60)         \
+  STR(pdu_modbus_addresses, "1")             \
+  INT(pdu_modbus_interval, 5)                \
+  INT(pdu_modbus_interval_min_ms, 1000)      \
+  DOUBLE(pdu_modbus_adaptive_threshold, 0.5) \
+  BOOL(pdu_modbus_phase_align, true)         \
+  BOOL(pdu_modbus_task, false)               \
+  INT(pdu_modbus_task_core, 1)               \
+  INT(pdu_modbus_frequency_interval, 60)     \
+  INT(pdu_modbus_ratio_interval, 3600)       \
+  INT(pdu_modbus_identity_interval, 3600)    \
+  INT(pdu_rollup_minutes, 60)                \
+  INT(pdu_rollup_hours, 24)                  \
+  INT(pdu_stats_window, 3600)                \
+  INT(pdu_raw_frames, 16)                    \
+  STR(pdu_trace_file, "")                    \
+  INT(pdu_trace_max_size, 262144)            \
+  INT(pdu_tsdb_budget, 131072)               \
+  INT(pdu_tsdb_segment_size, 8192)           \
+  INT(pdu_tsdb_flush_interval, 60)           \
+  DOUBLE(pdu_alert_current, 0.0)             \
+  STR(pdu_alert_currents, "")                \
+  DOUBLE(pdu_alert_total_current, 0.0)       \
+  DOUBLE(pdu_alert_hysteresis, 0.5)          \
+  INT(pdu_alert_hold_ms, 1000)               \
+  INT(pdu_mqtt_interval, 60)                 \
+  INT(pdu_outbox_entries, 16)                \
+  INT(pdu_outbox_ram_size, 8192)             \
+  INT(pdu_outbox_file_size, 32768)           \
+  INT(pdu_outbox_batch, 4)                   \
+  INT(pdu_outbox_drain_ms, 250)              \
+  INT(pdu_outbox_jitter_ms, 5000)            \
+  STR(pdu_report_format, "json")             \
+  INT(pdu_report_full_every, 10)             \
+  DOUBLE(pdu_report_current_delta, 0.05)     \
+  DOUBLE(pdu_report_energy_delta, 0.01)
+
+#define HOST_CONFIG_INT(name, def)      \
+  int mgos_sys_config_get_##name(void); \
+  void mgos_sys_config_set_##name(int value);
+#define HOST_CONFIG_DOUBLE(name, def)      \
+  double mgos_sys_config_get_##name(void); \
+  void mgos_sys_config_set_##name(double value);
+#define HOST_CONFIG_BOOL(name, def)      \
+  bool mgos_sys_config_get_##name(void); \
+  void mgos_sys_config_set_##name(bool value);
+#define HOST_CONFIG_STR(name, def)              \
+  const char *mgos_sys_config_get_##name(void); \
+  void mgos_sys_config_set_##name(const char *value);
+
+HOST_CONFIG(HOST_CONFIG_INT, HOST_CONFIG_DOUBLE, HOST_CONFIG_BOOL,
+            HOST_CONFIG_STR)
+
+/* host_config_set(): Set the entry named key, as "pdu.modbus_interval", from
+ * its string value.
+ *
+ * Returns: true if successful, false if there is no such entry or the value
+ * does not parse.
+ */
+bool host_config_set(const char *key, const char *value);
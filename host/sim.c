@@ -0,0 +1,359 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sim.h"
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mgos_modbus.h"
+
+#define SIM_REQUEST_BYTES 8   // Read holding registers request frame
+#define SIM_RESPONSE_BYTES 5  // Response frame, without the register data
+#define SIM_NUM_REGS 56
+
+struct sim_channel_state {
+  struct sim_channel profile;
+  double mark;   // mgos_uptime() up to which acc is integrated
+  double acc;    // Integral since the first sample, in Ampere seconds
+  double exact;  // acc up to the last sample
+};
+
+struct sim_sensor {
+  uint8_t address;
+  bool sampled;  // A valid response was delivered
+  struct sim_channel_state channels[SIM_NUM_CHANNELS];
+};
+
+// The request on the bus, there being only one at a time.
+struct sim_request {
+  bool active;
+  int sensor;  // Index into s_sensors, or -1 if nobody answers
+  uint8_t status;
+  double sample_t;
+  struct mb_request_info mb_ri;
+  mb_response_callback cb;
+  void *cb_arg;
+};
+
+static const struct sim_config s_default_config = {
+    .baud = 9600,
+    .turnaround_ms = 5,
+    .timeout_ms = 1000,
+    .sample_at = 0.5,
+};
+
+static struct sim_config s_config;
+static struct sim_sensor s_sensors[SIM_MAX_SENSORS];
+static int s_num_sensors = 0;
+static struct sim_request s_request;
+static struct sim_stats s_stats;
+static uint32_t s_rand = 1;
+
+static int64_t *s_handler_ns = NULL;
+static size_t s_handler_ns_cap = 0;
+
+void sim_init(const struct sim_config *cfg) {
+  s_config = cfg ? *cfg : s_default_config;
+  if (s_config.baud <= 0) s_config.baud = s_default_config.baud;
+  if (s_config.timeout_ms <= 0)
+    s_config.timeout_ms = s_default_config.timeout_ms;
+  s_rand = s_config.seed ? s_config.seed : 1;
+  memset(s_sensors, 0, sizeof(s_sensors));
+  memset(&s_request, 0, sizeof(s_request));
+  memset(&s_stats, 0, sizeof(s_stats));
+  s_num_sensors = 0;
+}
+
+// xorshift32, uniform in [0, 1).
+static double sim_rand(void) {
+  s_rand ^= s_rand << 13;
+  s_rand ^= s_rand >> 17;
+  s_rand ^= s_rand << 5;
+  return s_rand / 4294967296.;
+}
+
+// The noise of a channel in step k, uniform in [-1, 1).
+static double sim_noise(uint8_t address, int chan, int64_t k) {
+  uint64_t z = s_config.seed + ((uint64_t) address << 40) +
+               ((uint64_t) chan << 32) + (uint64_t) k * 0x9e3779b97f4a7c15ull;
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  return (z >> 11) / 4503599627370496. - 1;
+}
+
+static struct sim_sensor *sim_sensor(uint8_t address) {
+  for (int i = 0; i < s_num_sensors; i++)
+    if (s_sensors[i].address == address) return &s_sensors[i];
+  return NULL;
+}
+
+static double sim_channel_current(const struct sim_sensor *s, int chan,
+                                  double t) {
+  const struct sim_channel *p = &s->channels[chan].profile;
+
+  if (p->period <= 0) return p->amps;
+  switch (p->profile) {
+    case SIM_PROFILE_SINE:
+      return p->amps + p->amplitude * sin(2 * M_PI * t / p->period);
+    case SIM_PROFILE_SQUARE:
+      return p->amps +
+             (fmod(t, p->period) < p->period / 2 ? p->amplitude
+                                                 : -p->amplitude);
+    case SIM_PROFILE_NOISE:
+      return p->amps + p->amplitude * sim_noise(s->address, chan,
+                                                (int64_t) (t / p->period));
+    default:
+      return p->amps;
+  }
+}
+
+// Position of t within a square wave period, integrated over its sign.
+static double sim_square_phase(double t, double period) {
+  double phase = fmod(t, period);
+  return phase < period / 2 ? phase : period - phase;
+}
+
+// Integrate the current of a channel from a to b, in Ampere seconds.
+static double sim_channel_integral(const struct sim_sensor *s, int chan,
+                                   double a, double b) {
+  const struct sim_channel *p = &s->channels[chan].profile;
+  double ret = p->amps * (b - a);
+
+  if (p->period <= 0 || b <= a) return ret;
+  switch (p->profile) {
+    case SIM_PROFILE_SINE:
+      ret += p->amplitude * p->period / (2 * M_PI) *
+             (cos(2 * M_PI * a / p->period) - cos(2 * M_PI * b / p->period));
+      break;
+    case SIM_PROFILE_SQUARE:
+      ret += p->amplitude * (sim_square_phase(b, p->period) -
+                             sim_square_phase(a, p->period));
+      break;
+    case SIM_PROFILE_NOISE:
+      for (int64_t k = (int64_t) (a / p->period); k * p->period < b; k++) {
+        double from = k * p->period > a ? k * p->period : a;
+        double to = (k + 1) * p->period < b ? (k + 1) * p->period : b;
+        ret += p->amplitude * sim_noise(s->address, chan, k) * (to - from);
+      }
+      break;
+    default:
+      break;
+  }
+  return ret;
+}
+
+bool sim_add_sensor(uint8_t address) {
+  struct sim_sensor *s;
+
+  if (s_num_sensors == SIM_MAX_SENSORS || sim_sensor(address)) return false;
+  s = &s_sensors[s_num_sensors++];
+  memset(s, 0, sizeof(*s));
+  s->address = address;
+  return true;
+}
+
+bool sim_set_channel(uint8_t address, int chan, const struct sim_channel *ch) {
+  struct sim_sensor *s = sim_sensor(address);
+  struct sim_channel_state *c;
+  double now = mgos_uptime();
+
+  if (!s || chan < 0 || chan >= SIM_NUM_CHANNELS) return false;
+  c = &s->channels[chan];
+  if (s->sampled) {
+    c->acc += sim_channel_integral(s, chan, c->mark, now);
+    c->mark = now;
+  }
+  c->profile = *ch;
+  if (c->profile.amplitude > c->profile.amps)
+    c->profile.amplitude = c->profile.amps;
+  return true;
+}
+
+double sim_current(uint8_t address, int chan, double t) {
+  struct sim_sensor *s = sim_sensor(address);
+
+  if (!s || chan < 0 || chan >= SIM_NUM_CHANNELS) return -1;
+  return sim_channel_current(s, chan, t);
+}
+
+double sim_exact_centiamp_msecs(uint8_t address, int chan) {
+  struct sim_sensor *s = sim_sensor(address);
+
+  if (!s || chan < 0 || chan >= SIM_NUM_CHANNELS) return 0;
+  return s->channels[chan].exact * 100000;
+}
+
+// Account for a valid sample of all channels of s, taken at t.
+static void sim_sensor_sample(struct sim_sensor *s, double t) {
+  for (int i = 0; i < SIM_NUM_CHANNELS; i++) {
+    struct sim_channel_state *c = &s->channels[i];
+    if (s->sampled) c->acc += sim_channel_integral(s, i, c->mark, t);
+    c->mark = t;
+    c->exact = c->acc;
+  }
+  s->sampled = true;
+}
+
+// Register reg of sensor s at time t.
+static uint16_t sim_register(const struct sim_sensor *s, int reg, double t) {
+  double amps;
+
+  if (reg < 8) {
+    static const uint16_t identity[8] = {3, 0, 50, 0, (6 << 8) | 21, 0, 0, 0};
+    return identity[reg];
+  }
+  if (reg >= SIM_NUM_REGS) return 0;
+  amps = sim_channel_current(s, (reg - 8) % SIM_NUM_CHANNELS, t);
+  if (reg < 24) {
+    long centiamps = lround(amps * 100);
+    return centiamps < 0 ? 0 : centiamps > UINT16_MAX ? UINT16_MAX : centiamps;
+  }
+  if (reg < 40) return amps > 0 ? 500 : 0;
+  return 1000;
+}
+
+// The Modbus RTU CRC, sent low byte first.
+static uint16_t sim_crc16(const uint8_t *buf, size_t len) {
+  uint16_t crc = 0xffff;
+
+  for (size_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    for (int b = 0; b < 8; b++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+  }
+  return crc;
+}
+
+// The timings are mapped rather than allocated, to keep them out of the heap
+// figures of the firmware.
+static void sim_record_handler(int64_t ns) {
+  if (s_stats.handler_calls == s_handler_ns_cap) {
+    size_t cap = s_handler_ns_cap ? 2 * s_handler_ns_cap : 4096;
+    int64_t *p = mmap(NULL, cap * sizeof(*p), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return;
+    if (s_handler_ns) {
+      memcpy(p, s_handler_ns, s_handler_ns_cap * sizeof(*p));
+      munmap(s_handler_ns, s_handler_ns_cap * sizeof(*p));
+    }
+    s_handler_ns = p;
+    s_handler_ns_cap = cap;
+  }
+  s_handler_ns[s_stats.handler_calls++] = ns;
+  if (ns > s_stats.handler_ns_max) s_stats.handler_ns_max = ns;
+}
+
+static int64_t sim_clock_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sim_deliver(void *arg) {
+  struct sim_request req = s_request;
+  struct mbuf response;
+  int64_t start_ns;
+
+  mbuf_init(&response, 0);
+  s_request.active = false;
+  if (req.status == RESP_SUCCESS) {
+    struct sim_sensor *s = &s_sensors[req.sensor];
+    uint8_t hdr[3] = {s->address, FUNC_READ_HOLDING_REGISTERS,
+                      (uint8_t) (req.mb_ri.read_qty * 2)};
+    uint16_t crc;
+    mbuf_append(&response, hdr, sizeof(hdr));
+    for (int i = 0; i < req.mb_ri.read_qty; i++) {
+      uint16_t v = sim_register(s, req.mb_ri.read_address + i, req.sample_t);
+      uint8_t reg[2] = {v >> 8, v & 0xff};
+      mbuf_append(&response, reg, sizeof(reg));
+    }
+    crc = sim_crc16((const uint8_t *) response.buf, response.len);
+    mbuf_append(&response, (uint8_t[]){crc & 0xff, crc >> 8}, 2);
+    sim_sensor_sample(s, req.sample_t);
+    s_stats.responses++;
+  }
+  start_ns = sim_clock_ns();
+  req.cb(req.status, req.mb_ri, response, req.cb_arg);
+  sim_record_handler(sim_clock_ns() - start_ns);
+  mbuf_free(&response);
+  (void) arg;
+}
+
+bool mgos_modbus_connect(void) {
+  return true;
+}
+
+bool mb_read_holding_registers(uint8_t slave_id, uint16_t read_address,
+                               uint16_t read_qty, mb_response_callback cb,
+                               void *cb_arg) {
+  struct sim_sensor *s = sim_sensor(slave_id);
+  int bytes = SIM_REQUEST_BYTES + SIM_RESPONSE_BYTES + 2 * read_qty;
+  int64_t latency_us =
+      (int64_t) bytes * 10 * 1000000 / s_config.baud +
+      s_config.turnaround_ms * 1000;
+
+  s_stats.requests++;
+  if (s_request.active) {
+    s_stats.busy++;
+    return false;
+  }
+  memset(&s_request, 0, sizeof(s_request));
+  s_request.active = true;
+  s_request.sensor = s ? s - s_sensors : -1;
+  s_request.mb_ri.slave_id = slave_id;
+  s_request.mb_ri.read_address = read_address;
+  s_request.mb_ri.read_qty = read_qty;
+  s_request.mb_ri.func_code = FUNC_READ_HOLDING_REGISTERS;
+  s_request.cb = cb;
+  s_request.cb_arg = cb_arg;
+  s_request.sample_t = mgos_uptime() + s_config.sample_at * latency_us / 1e6;
+  s_request.status = RESP_SUCCESS;
+  if (!s || sim_rand() < s_config.timeout_rate) {
+    s_request.status = RESP_TIMED_OUT;
+    latency_us = (int64_t) s_config.timeout_ms * 1000;
+    s_stats.timeouts++;
+  } else if (sim_rand() < s_config.crc_error_rate) {
+    s_request.status = RESP_INVALID_CRC;
+    s_stats.crc_errors++;
+  }
+  mgos_set_timer((int) ((latency_us + 999) / 1000), 0, sim_deliver, NULL);
+  return true;
+}
+
+static int sim_cmp_ns(const void *a, const void *b) {
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+int64_t sim_handler_ns(double q) {
+  size_t n = s_stats.handler_calls, idx;
+  int64_t *sorted, ret;
+
+  if (n == 0 || !(sorted = malloc(n * sizeof(*sorted)))) return 0;
+  memcpy(sorted, s_handler_ns, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), sim_cmp_ns);
+  idx = q <= 0 ? 0 : q >= 1 ? n - 1 : (size_t) (q * (n - 1) + 0.5);
+  ret = sorted[idx];
+  free(sorted);
+  return ret;
+}
+
+void sim_get_stats(struct sim_stats *stats) {
+  *stats = s_stats;
+}
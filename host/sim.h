@@ -0,0 +1,102 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Simulated current sensors on the Modbus segment, answering the requests of
+ * the mgos modbus library that the firmware sends. Each sensor has 16
+ * channels whose current follows a profile over mgos_uptime(), and the exact
+ * integral of every channel is known, to check the energy counters against.
+ *
+ * Responses take as long as the frames take on the bus at the configured baud
+ * rate, plus the sensor's turnaround time, and can be made to time out or
+ * fail their CRC at a given rate.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define SIM_MAX_SENSORS 8
+#define SIM_NUM_CHANNELS 16
+
+enum sim_profile {
+  SIM_PROFILE_CONSTANT,
+  SIM_PROFILE_SINE,    // amps + amplitude * sin(2 pi t / period)
+  SIM_PROFILE_SQUARE,  // amps + amplitude, then amps - amplitude
+  SIM_PROFILE_NOISE,   // amps +/- amplitude, a new value every period
+};
+
+struct sim_channel {
+  enum sim_profile profile;
+  double amps;       // Mean current, in Ampere
+  double amplitude;  // Of the variation, in Ampere; at most amps
+  double period;     // Of the variation, in seconds
+};
+
+struct sim_config {
+  int baud;                // Of the bus, at 10 bits per byte
+  int turnaround_ms;       // Time the sensor takes to answer
+  int timeout_ms;          // Of the mgos modbus library
+  double sample_at;        // Fraction of the round trip at which it samples
+  double timeout_rate;     // Fraction of requests that time out
+  double crc_error_rate;   // Fraction of responses with a bad CRC
+  uint32_t seed;           // Of the error and noise generator
+};
+
+struct sim_stats {
+  uint32_t requests;
+  uint32_t busy;         // Requests refused while one was on the bus
+  uint32_t timeouts;
+  uint32_t crc_errors;
+  uint32_t responses;    // Valid responses delivered
+  uint32_t handler_calls;
+  int64_t handler_ns_max;
+};
+
+/* sim_init(): Reset all sensors and statistics, and use the given config, or
+ * the defaults (9600 baud, no errors) if NULL.
+ */
+void sim_init(const struct sim_config *cfg);
+
+/* sim_add_sensor(): Add a sensor at the given Modbus address, with all
+ * channels drawing nothing.
+ *
+ * Returns: true if successful, false if there is no room or it exists.
+ */
+bool sim_add_sensor(uint8_t address);
+
+/* sim_set_channel(): Set the profile of channel chan of the sensor at the
+ * given address, from now on.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool sim_set_channel(uint8_t address, int chan, const struct sim_channel *ch);
+
+/* sim_current(): Return the current of a channel at mgos_uptime() t, in
+ * Ampere, or -1 if there is no such channel.
+ */
+double sim_current(uint8_t address, int chan, double t);
+
+/* sim_exact_centiamp_msecs(): Return the exact integral of the current of a
+ * channel from the first to the last sample of a valid response, in the unit
+ * of pdu_channel.centiamp_msecs_total, which is what the firmware should
+ * have counted since it took its first sample.
+ */
+double sim_exact_centiamp_msecs(uint8_t address, int chan);
+
+/* sim_handler_ns(): Return quantile q (0..1) of the wall time the response
+ * handler of the firmware took, in nanoseconds.
+ */
+int64_t sim_handler_ns(double q);
+
+void sim_get_stats(struct sim_stats *stats);
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Run the firmware with the Modbus task, which is a pthread on the host, or
+ * inline on the event loop, while another thread keeps reading snapshots of
+ * every sensor. All channels follow the same square wave, scaled by their
+ * number, so a snapshot that mixes two polls is caught. Reports the event
+ * loop time spent per response, and how the energy counters compare to the
+ * exact integral.
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "budget.h"
+#include "host.h"
+#include "modbus.h"
+#include "sim.h"
+
+struct task_reader {
+  pthread_t thread;
+  bool stop;
+  uint64_t snapshots;
+  uint64_t torn;
+};
+
+static struct pdu s_reader_pdu;
+
+static bool task_snapshot_consistent(const struct pdu *pdu) {
+  for (int i = 1; i < PDU_NUM_CHANNELS; i++)
+    if (pdu->pdu_channel[i].raw_current !=
+        pdu->pdu_channel[0].raw_current * (i + 1))
+      return false;
+  return true;
+}
+
+static void *task_reader_thread(void *arg) {
+  struct task_reader *r = (struct task_reader *) arg;
+
+  while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+    for (int d = 0; d < modbus_num_devices(); d++) {
+      if (!modbus_snapshot(d, &s_reader_pdu)) continue;
+      r->snapshots++;
+      if (!task_snapshot_consistent(&s_reader_pdu)) r->torn++;
+    }
+    sched_yield();
+  }
+  return NULL;
+}
+
+static int task_main(void *arg) {
+  double seconds = *(double *) arg;
+  struct task_reader reader = {0};
+  struct budget_timing poll;
+  struct modbus_stats mb;
+  static struct pdu pdu;
+  double max_error = 0;
+
+  sim_init(NULL);
+  for (int d = 0; d < PDU_MAX_DEVICES; d++) {
+    sim_add_sensor(d + 1);
+    for (int i = 0; i < SIM_NUM_CHANNELS; i++) {
+      struct sim_channel ch = {SIM_PROFILE_SQUARE, 0.5 * (i + 1),
+                               0.25 * (i + 1), 2.0};
+      sim_set_channel(d + 1, i, &ch);
+    }
+  }
+  if (mgos_app_init() != MGOS_APP_INIT_SUCCESS) return 1;
+  if (pthread_create(&reader.thread, NULL, task_reader_thread, &reader) != 0)
+    return 1;
+  host_run(seconds);
+  __atomic_store_n(&reader.stop, true, __ATOMIC_RELAXED);
+  pthread_join(reader.thread, NULL);
+
+  for (int d = 0; d < PDU_MAX_DEVICES; d++) {
+    modbus_snapshot(d, &pdu);
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+      double exact = sim_exact_centiamp_msecs(d + 1, i);
+      double error =
+          100 * fabs(pdu.pdu_channel[i].centiamp_msecs_total - exact) / exact;
+      if (error > max_error) max_error = error;
+    }
+  }
+  modbus_get_stats(&mb);
+  budget_get_timing(BUDGET_SECTION_POLL, &poll);
+  printf("Modbus %s, %llu responses in %.0fs\n",
+         mgos_sys_config_get_pdu_modbus_task() ? "task" : "inline",
+         (unsigned long long) mb.responses, seconds);
+  printf("Event loop per response: mean %.1fus, max %uus\n",
+         mb.responses ? (double) poll.total_us / mb.responses : 0,
+         poll.max_us);
+  printf("Snapshots read concurrently: %llu, torn: %llu\n",
+         (unsigned long long) reader.snapshots,
+         (unsigned long long) reader.torn);
+  printf("Largest integration error: %.4f%%\n", max_error);
+  return reader.torn > 0 || max_error > 0.5 ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  double seconds = 3600;
+  bool task = true;
+  int opt;
+
+  cs_log_set_level(LL_ERROR);
+  while ((opt = getopt(argc, argv, "it:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        task = false;
+        break;
+      case 't':
+        seconds = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-i] [-t SECONDS]\n", argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  mgos_sys_config_set_pdu_modbus_addresses("1,2,3,4");
+  mgos_sys_config_set_pdu_modbus_interval(1);
+  mgos_sys_config_set_pdu_modbus_task(task);
+  return host_main(task_main, &seconds);
+}
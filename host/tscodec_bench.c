@@ -0,0 +1,135 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* Encode a day of 16-channel samples per current profile with the tscodec
+ * codec, as tsdb.c stores them, check that they decode to what went in, and
+ * report the bytes per sample and the encode and decode throughput.
+ */
+#include <getopt.h>
+#include <time.h>
+
+#include "sim.h"
+#include "tscodec.h"
+
+// Uncompressed sample: a 64-bit millisecond timestamp and 16 values.
+#define TSCODEC_RAW_BYTES (8 + 2 * TSCODEC_VALUES)
+
+static const char *s_profile_names[] = {"constant", "sine", "square", "noise"};
+
+static double tscodec_clock(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill t_ms and values with n samples of the sensor at address, polled every
+// interval_ms with up to 50ms of jitter.
+static void tscodec_samples(uint8_t address, int n, int interval_ms,
+                            int64_t *t_ms, uint16_t *values) {
+  uint32_t x = 1;
+  int64_t t = 1600000000000;
+
+  for (int s = 0; s < n; s++) {
+    x = x * 1664525 + 1013904223;
+    t_ms[s] = t + (x >> 16) % 50;
+    t += interval_ms;
+    for (int i = 0; i < TSCODEC_VALUES; i++) {
+      double amps = sim_current(address, i, (t_ms[s] - t_ms[0]) / 1000.);
+      values[s * TSCODEC_VALUES + i] = (uint16_t) lround(amps * 100);
+    }
+  }
+}
+
+static bool tscodec_run(enum sim_profile profile, int n, int interval_ms) {
+  int64_t *t_ms = calloc(n, sizeof(*t_ms)), t;
+  uint16_t *values = calloc((size_t) n * TSCODEC_VALUES, sizeof(*values));
+  uint8_t *buf = malloc((size_t) n * TSCODEC_RECORD_MAX);
+  uint16_t decoded[TSCODEC_VALUES];
+  struct tscodec_state state;
+  size_t len = 0, off = 0, used;
+  double start, encode_s, decode_s;
+  bool ok = t_ms && values && buf;
+  uint8_t address = profile + 1;
+
+  if (!ok) goto exit;
+  sim_add_sensor(address);
+  for (int i = 0; i < TSCODEC_VALUES; i++) {
+    struct sim_channel ch = {profile, 0.5 * (i + 1), 0.25 * (i + 1),
+                             profile == SIM_PROFILE_NOISE ? 1 : 60 + 7 * i};
+    sim_set_channel(address, i, &ch);
+  }
+  tscodec_samples(address, n, interval_ms, t_ms, values);
+
+  start = tscodec_clock();
+  tscodec_reset(&state, t_ms[0]);
+  for (int s = 0; s < n; s++)
+    len += tscodec_encode(&state, t_ms[s], &values[s * TSCODEC_VALUES],
+                          buf + len);
+  encode_s = tscodec_clock() - start;
+
+  start = tscodec_clock();
+  tscodec_reset(&state, t_ms[0]);
+  for (int s = 0; s < n; s++) {
+    used = tscodec_decode(&state, buf + off, len - off, &t, decoded);
+    if (used == 0 || t != t_ms[s] ||
+        memcmp(decoded, &values[s * TSCODEC_VALUES], sizeof(decoded)) != 0) {
+      fprintf(stderr, "%s: sample %d does not decode to what was encoded\n",
+              s_profile_names[profile], s);
+      ok = false;
+      goto exit;
+    }
+    off += used;
+  }
+  decode_s = tscodec_clock() - start;
+  ok = off == len;
+
+  printf("%-10s %8d %10.2f %8.1fx %12.0f %12.0f\n", s_profile_names[profile],
+         n, (double) len / n, (double) TSCODEC_RAW_BYTES * n / len,
+         n / encode_s, n / decode_s);
+
+exit:
+  free(t_ms);
+  free(values);
+  free(buf);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  int n = 86400, interval_ms = 1000, opt;
+  bool ok = true;
+
+  while ((opt = getopt(argc, argv, "n:i:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = atoi(optarg);
+        break;
+      case 'i':
+        interval_ms = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n SAMPLES] [-i INTERVAL_MS]\n", argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (n <= 0 || interval_ms <= 0) return 2;
+
+  sim_init(NULL);
+  printf("%-10s %8s %10s %9s %12s %12s\n", "profile", "samples",
+         "bytes/smpl", "ratio", "enc smpl/s", "dec smpl/s");
+  for (int p = SIM_PROFILE_CONSTANT; p <= SIM_PROFILE_NOISE; p++)
+    if (!tscodec_run(p, n, interval_ms)) ok = false;
+  return ok ? 0 : 1;
+}
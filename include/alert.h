@@ -0,0 +1,70 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+#include "modbus.h"
+
+#define ALERT_STAT "alert"
+
+/* Alerts fire when the current of a channel, or the total current of a
+ * sensor, stays above its threshold for pdu.alert_hold_ms, and clear when it
+ * stays below the threshold minus pdu.alert_hysteresis for as long. The
+ * hysteresis is limited to half the threshold, so that every alert can clear.
+ * Every transition is published right away to stat ALERT_STAT.
+ */
+
+struct alert_stats {
+  uint32_t raised;
+  uint32_t cleared;
+  uint32_t active;
+  uint32_t latency_count;          // Alerts published
+  uint32_t latency_last_us;        // Sample to publish, of the last alert
+  uint32_t latency_max_us;
+  uint64_t latency_total_us;
+  uint32_t latency_over_interval;  // Alerts slower than pdu.modbus_interval
+};
+
+/* alert_init(): Load the thresholds for num_devices sensors from pdu.alert_*:
+ * pdu.alert_current applies to every channel, unless overridden for a channel
+ * in pdu.alert_currents ("idx:amperes,..."), and pdu.alert_total_current to
+ * the sum of the channels of each sensor. A threshold of 0 disables the alert.
+ * The thresholds are reloaded by alert_update() when this config changes.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool alert_init(int num_devices);
+
+/* alert_update(): Evaluate the alerts of the given sensor against its newest
+ * state, sampled at monotonic time sample_us, and publish any transitions.
+ */
+void alert_update(uint8_t device, const struct pdu *pdu, int64_t sample_us);
+
+/* alert_channel_active(): Return true if the alert of channel chan is raised.
+ */
+bool alert_channel_active(uint8_t chan);
+
+/* alert_total_active(): Return true if the total current alert of the given
+ * sensor is raised.
+ */
+bool alert_total_active(uint8_t device);
+
+/* alert_get_stats(): Copy the alert counters and the detection to publish
+ * latency into *stats.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool alert_get_stats(struct alert_stats *stats);
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define BUDGET_HEAP_SAMPLES 30   // Heap samples kept
+#define BUDGET_HEAP_INTERVAL 60  // Seconds between heap samples
+#define BUDGET_MAX_TASKS 4       // Tasks whose stack is watched
+
+/* Sections of work that are timed, each from entry to return. */
+enum budget_section {
+  BUDGET_SECTION_POLL = 0,     // Handling a Modbus response
+  BUDGET_SECTION_RPC,          // Running an RPC handler
+  BUDGET_SECTION_PUBLISH,      // Building and sending a periodic report
+  BUDGET_SECTION_STATE_WRITE,  // Checkpointing a sensor's state to flash
+  BUDGET_NUM_SECTIONS,
+};
+
+/* Writers of flash, whose writes are counted. */
+enum budget_flash {
+  BUDGET_FLASH_STATE = 0,  // State checkpoints
+  BUDGET_FLASH_JOURNAL,    // Counter journal records
+  BUDGET_FLASH_TSDB,       // Current history segments
+  BUDGET_FLASH_TRACE,      // Modbus trace capture
+  BUDGET_FLASH_OUTBOX,     // MQTT messages queued while disconnected
+  BUDGET_NUM_FLASH,
+};
+
+struct budget_timing {
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+};
+
+struct budget_flash_stats {
+  uint32_t writes;
+  uint64_t bytes;
+};
+
+struct budget_heap_sample {
+  uint32_t uptime;        // Seconds since boot
+  uint32_t free;          // Bytes of heap free
+  uint32_t min_free;      // Lowest free heap since boot
+  uint32_t largest_free;  // Largest allocatable block, 0 if unknown
+};
+
+/* budget_init(): Start watching the stack of the calling task, which is the
+ * Mongoose OS task, and start sampling the heap every BUDGET_HEAP_INTERVAL
+ * seconds.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool budget_init(void);
+
+/* budget_register_task(): Watch the stack of the given FreeRTOS task. The
+ * name is not copied. On platforms without FreeRTOS this does nothing.
+ */
+void budget_register_task(const char *name, void *task);
+
+/* budget_time(): Account a run of the given section that started at
+ * mgos_uptime_micros() start_us and ends now. Must be called from the event
+ * loop.
+ */
+void budget_time(enum budget_section section, int64_t start_us);
+
+/* budget_flash_write(): Account one write of len bytes to flash. Must be
+ * called from the event loop.
+ */
+void budget_flash_write(enum budget_flash writer, size_t len);
+
+/* budget_section_name(), budget_flash_name(): Return a short lowercase name
+ * for use in RPC replies.
+ */
+const char *budget_section_name(enum budget_section section);
+const char *budget_flash_name(enum budget_flash writer);
+
+/* budget_get_timing(): Copy the timing of the given section into *timing.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool budget_get_timing(enum budget_section section,
+                       struct budget_timing *timing);
+
+/* budget_get_flash(): Copy the write counters of the given writer into
+ * *stats.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool budget_get_flash(enum budget_flash writer,
+                      struct budget_flash_stats *stats);
+
+/* budget_heap_now(): Take a heap sample right now. */
+void budget_heap_now(struct budget_heap_sample *sample);
+
+/* budget_heap_history(): Copy up to max of the kept heap samples into
+ * samples, oldest first.
+ *
+ * Returns: the number of samples copied.
+ */
+int budget_heap_history(struct budget_heap_sample *samples, int max);
+
+/* budget_num_tasks(): Return the number of watched tasks. */
+int budget_num_tasks(void);
+
+/* budget_task_stack(): Return the name of watched task i and the smallest
+ * amount of its stack that has been free since it started, in bytes.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool budget_task_stack(int i, const char **name, uint32_t *min_free);
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+#include "modbus.h"
+
+/* Every per-channel value that the PDU exports is described once, in a table
+ * of struct channel_field. RPC, MQTT and Prometheus output are all generated
+ * from that table, so a new field only needs a new entry.
+ */
+enum channel_field_id {
+  CHANNEL_FIELD_CURRENT = 0,
+  CHANNEL_FIELD_FREQUENCY,
+  CHANNEL_FIELD_RATIO,
+  CHANNEL_FIELD_KWH,
+  CHANNEL_FIELD_LAST_CLEAR,
+  CHANNEL_FIELD_LAST_READ,
+  NUM_CHANNEL_FIELDS
+};
+
+#define CHANNEL_FIELD_MASK(f) (1u << (f))
+#define CHANNEL_FIELD_MASK_ALL ((1u << NUM_CHANNEL_FIELDS) - 1)
+
+struct channel_field {
+  const char *name;         // Key in RPC and MQTT output
+  double scale;             // Multiplier from the raw value to its unit
+  int precision;            // Decimals when printed
+  const char *metric;       // Prometheus metric name
+  const char *metric_type;  // Prometheus metric type
+  const char *help;         // Prometheus metric help
+  // Raw value of channel ch of the given sensor state.
+  double (*get)(const struct pdu *pdu, const struct pdu_channel *ch);
+};
+
+/* fields_get(): Return the descriptor of field f, or NULL if there is none.
+ */
+const struct channel_field *fields_get(enum channel_field_id f);
+
+/* fields_find(): Look up a field by its name, which need not be terminated.
+ *
+ * Returns: the field, or -1 if there is no field with that name.
+ */
+int fields_find(const char *name, size_t len);
+
+/* fields_value(): Return the value of field f for channel chan
+ * (0..PDU_NUM_CHANNELS-1) of the given sensor state, in the field's unit.
+ */
+double fields_value(enum channel_field_id f, const struct pdu *pdu,
+                    uint8_t chan);
+
+/* fields_json_value(): Print the value of field f for channel chan of the
+ * given sensor state, with the field's precision.
+ *
+ * Returns: the number of bytes printed.
+ */
+int fields_json_value(struct json_out *out, enum channel_field_id f,
+                      const struct pdu *pdu, uint8_t chan);
+
+/* fields_json_channel(): Print channel idx (0..modbus_num_channels()-1) of the
+ * given state of its sensor as an object with its idx, addr and every field in
+ * the mask.
+ *
+ * Returns: the number of bytes printed.
+ */
+int fields_json_channel(struct json_out *out, int idx, const struct pdu *pdu,
+                        uint32_t mask);
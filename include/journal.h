@@ -0,0 +1,71 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "modbus.h"
+
+#define JOURNAL_MAGIC 0x4a4e4c31             // "JNL1"
+#define JOURNAL_CHECKPOINT_MAGIC 0x434b5031  // "CKP1"
+#define JOURNAL_SUFFIX ".jnl"
+#define JOURNAL_SLOT_SUFFIX_A ".a"
+#define JOURNAL_SLOT_SUFFIX_B ".b"
+
+/* The journal keeps the PDU state in two checkpoint slots, named after the
+ * state file with suffix JOURNAL_SLOT_SUFFIX_A and JOURNAL_SLOT_SUFFIX_B, and
+ * an append-only file of counter records with suffix JOURNAL_SUFFIX. Every
+ * checkpoint carries a generation number and is written to the slot that does
+ * not hold the newest checkpoint, so a torn write never destroys the last good
+ * copy. Journal records carry the generation of the checkpoint they follow,
+ * and the running counters of every channel at the time they were written.
+ * All records are protected by a CRC32.
+ */
+
+/* The position in the journal of one state file: the generation of its newest
+ * checkpoint, the number of records appended since, and whether the journal
+ * file holds records that replay stops at, such as a torn tail or records of
+ * an older generation. Nothing appended after those would be replayed, so the
+ * next append writes a checkpoint instead.
+ */
+struct journal {
+  uint32_t generation;
+  int records;
+  bool compact;
+};
+
+/* journal_read(): Load the newest valid checkpoint for state_filename into
+ * pdu, and apply the newest valid journal record written after it.
+ *
+ * Returns: true if a checkpoint was found, false otherwise.
+ */
+bool journal_read(struct journal *j, const char *state_filename,
+                  struct pdu *pdu);
+
+/* journal_checkpoint(): Write the full pdu into the older of the two
+ * checkpoint slots with the next generation number, and start a new journal.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool journal_checkpoint(struct journal *j, const char *state_filename,
+                        const struct pdu *pdu);
+
+/* journal_append(): Append a counter record for pdu to the journal. Once the
+ * journal holds max_records records, or replay would not reach a new record,
+ * a checkpoint is written instead, which compacts the journal.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool journal_append(struct journal *j, const char *state_filename,
+                    const struct pdu *pdu, int max_records);
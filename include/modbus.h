@@ -20,14 +20,17 @@
 #include "mgos.h"
 #include "mgos_modbus.h"
 
-#define PDU_NUM_CHANNELS 16
+#define PDU_NUM_CHANNELS 16  // Channels per sensor
+#define PDU_MAX_DEVICES 4    // Sensors on one Modbus segment
+#define PDU_MAX_CHANNELS (PDU_MAX_DEVICES * PDU_NUM_CHANNELS)
 #define PDU_VOLTAGE 220.
 
-#define STATE_FILENAME "state-v0.bin"
+#define STATE_FILENAME "state-v1.bin"
+#define STATE_FILENAME_V0 "state-v0.bin"
 
 struct pdu_channel {
   double last_cleared_time;
-  double ampere_seconds_total;
+  uint64_t centiamp_msecs_total;  // units of 0.01A * 1ms
   uint16_t raw_current;    // units of 0.01A
   uint16_t raw_frequency;  // units of 0.1Hz
   uint16_t raw_ratio;      // CT ratio 1:n
@@ -45,13 +48,24 @@ struct pdu {
   uint8_t pdu_build_year;         // Factory date (year)
   uint8_t pdu_build_month;        // Factory date (month)
   char state_filename[40];
+  uint8_t modbus_address;  // Modbus slave address of this sensor
+  uint8_t __pad[1];
   struct pdu_channel pdu_channel[PDU_NUM_CHANNELS];
 };
 
+/* Channels are numbered across all sensors configured in pdu.modbus_addresses,
+ * in the order given there: channel 0..15 are on the first sensor, 16..31 on
+ * the second, and so on, up to modbus_num_channels() - 1. Each sensor keeps
+ * its own struct pdu, persisted in its own state file: the given
+ * state_filename for slave address 1, and state_filename suffixed with
+ * ".<address>" for other addresses.
+ */
+
 /* modbus_init(): Initialize the modbus subsystem, start a timer each
- * modbus_read_secs that reads from the sensor, and a timer each
- * state_write_hours that persists the running state on disk under the given
- * file name in state_filename.
+ * modbus_read_secs that reads from all sensors back-to-back (shortened
+ * adaptively down to pdu.modbus_interval_min_ms while currents change), and a
+ * timer each state_write_hours that persists the running state on disk under
+ * the given file name in state_filename.
  *
  * Returns: true if successful, false otherwise.
  */
@@ -60,9 +74,12 @@ bool modbus_init(uint16_t modbus_read_secs, uint16_t state_write_hours,
 
 /* modbus_state_read(): (re)read the cache file with PDU channel counters from
  * disk. This allows the system to continue where it left off upon reboot /
- * crash / power failure.
+ * crash / power failure. The newest checkpoint is read and the counter journal
+ * replayed on top of it (see journal.h). If no checkpoint exists, the legacy
+ * floating point state file STATE_FILENAME_V0 is read and converted instead.
  * Note that the state file contains the state_filename as well, and it must be
  * the same given in the state_filename argument for the read to be successful.
+ * The state of every configured sensor is read.
  *
  * Returns: true if successful, false otherwise.
  */
@@ -71,7 +88,8 @@ bool modbus_state_read(const char *state_filename);
 /* modbus_state_write(): Persist the pdu struct including pdu_channel
  * information to disk. This allows the system to make a periodic backup of its
  * state, so that it can continue where it left off upon reboot / crash / power
- * failure.
+ * failure. The state of every sensor is written as a new checkpoint, which
+ * also compacts the counter journal.
  *
  * The filename written to is taken from the modbus_init() argument.
  *
@@ -80,35 +98,35 @@ bool modbus_state_read(const char *state_filename);
 bool modbus_state_write(void);
 
 /* modbus_channel_get_freq(): Return the frequency of the specificied channel
- * (0..15) in units of Hertz (eg 50.0)
+ * in units of Hertz (eg 50.0)
  *
  * Returns: true if successful, false otherwise.
  */
 bool modbus_channel_get_freq(uint8_t chan, double *hertz);
 
 /* modbus_channel_get_current(): Return the current of the specificied channel
- * (0..15) in units of Amperes (eg 0.55). The resolution is 0.01 Ampere (10 mA).
+ * in units of Amperes (eg 0.55). The resolution is 0.01 Ampere (10 mA).
  *
  * Returns: true if successful, false otherwise.
  */
 bool modbus_channel_get_current(uint8_t chan, double *amperes);
 
 /* modbus_channel_get_ratio(): Return the CT turn-ratio of the specificied
- * channel (0..15), eg. 1000 for 1:1000.
+ * channel, eg. 1000 for 1:1000.
  *
  * Returns: true if successful, false otherwise.
  */
 bool modbus_channel_get_ratio(uint8_t chan, uint16_t *ratio);
 
 /* modbus_channel_get_kwh(): Return the consumed power of the specificied
- * channel (0..15) since the last channel reset, in kilowatthours (kWh).
+ * channel since the last channel reset, in kilowatthours (kWh).
  *
  * Returns: true if successful, false otherwise.
  */
 bool modbus_channel_get_kwh(uint8_t chan, double *kwh);
 
 /* modbus_channel_get_freq(): Return the timestamp of the specificied channel's
- * (0..15) last clear time in type mgos_uptime, or 0 if it has never been
+ * last clear time in type mgos_uptime, or 0 if it has never been
  * cleared.
  *
  * Returns: true if successful, false otherwise.
@@ -116,16 +134,146 @@ bool modbus_channel_get_kwh(uint8_t chan, double *kwh);
 bool modbus_channel_get_last_clear(uint8_t chan, double *last_clear);
 
 /* modbus_channel_get_freq(): Return the timestamp of the specificied channel's
- * (0..15) last read time in type mgos_uptime, or 0 if it has never been read.
+ * last read time in type mgos_uptime, or 0 if it has never been read.
  *
  * Returns: true if successful, false otherwise.
  */
 bool modbus_channel_get_last_read(uint8_t chan, double *last_read);
 
 /* modbus_channel_clear(): Clear the cumulative counter on the specified
- * channel (0..15), and if the persist flag is true, also write the state
+ * channel, and if the persist flag is true, also write the state
  * to disk.
  *
  * Returns: true if successful, false otherwise.
  */
 bool modbus_channel_clear(uint8_t chan, bool persist);
+
+enum modbus_channel_op_type {
+  MODBUS_CHANNEL_OP_READ = 0,  // Only return the channel in the post-state
+  MODBUS_CHANNEL_OP_CLEAR,     // As modbus_channel_clear()
+  MODBUS_CHANNEL_OP_SET_KWH,   // Set the cumulative counter to kwh
+};
+
+struct modbus_channel_op {
+  enum modbus_channel_op_type type;
+  uint8_t chan;
+  double kwh;  // For MODBUS_CHANNEL_OP_SET_KWH
+};
+
+/* modbus_channel_batch(): Apply num_ops operations, in order, as one change:
+ * all of them are validated first, so either all or none are applied, and
+ * they are applied and published without a poll in between. If post is not
+ * NULL, the state of every sensor touched by an operation is copied into
+ * post[device] while still holding the lock, so it reflects exactly the
+ * applied batch. If the persist flag is true, the state of every sensor that
+ * was changed is then written to disk, once.
+ *
+ * Returns: true if successful, false otherwise. If persisting failed, the
+ * operations remain applied.
+ */
+bool modbus_channel_batch(const struct modbus_channel_op *ops, int num_ops,
+                          bool persist, struct pdu *post);
+
+/* modbus_channel_get_address(): Return the Modbus slave address of the sensor
+ * that the specified channel is on.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool modbus_channel_get_address(uint8_t chan, uint8_t *address);
+
+/* modbus_num_devices(): Return the number of configured sensors.
+ */
+int modbus_num_devices(void);
+
+/* modbus_num_channels(): Return the number of channels across all configured
+ * sensors.
+ */
+int modbus_num_channels(void);
+
+/* modbus_snapshot(): Copy the complete PDU state of the given sensor
+ * (0..modbus_num_devices()-1), including all channels, into the given struct,
+ * so that callers can report on all its channels from a single consistent set
+ * of readings. The copy comes from the frame published after the last poll,
+ * and never blocks the poll path. The modbus_channel_get_*() accessors read
+ * from the same frames, one channel at a time.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool modbus_snapshot(uint8_t device, struct pdu *pdu);
+
+/* modbus_centiamp_msecs_to_kwh(): Convert a channel's cumulative
+ * centiamp_msecs_total to kilowatthours (kWh) at PDU_VOLTAGE.
+ */
+double modbus_centiamp_msecs_to_kwh(uint64_t centiamp_msecs);
+
+/* Causes of a failed Modbus transaction, as reported by the mb library or
+ * found when decoding the response frame.
+ */
+enum modbus_fault {
+  MODBUS_FAULT_TIMEOUT = 0,  // No response within modbus.timeout
+  MODBUS_FAULT_CRC,          // Response failed its CRC check
+  MODBUS_FAULT_ADDRESS,      // Response came from another slave address
+  MODBUS_FAULT_FUNCTION,     // Response carried another function code
+  MODBUS_FAULT_LENGTH,       // Response was short, or had a wrong byte count
+  MODBUS_FAULT_OTHER,        // Any other mb library status
+  MODBUS_NUM_FAULTS
+};
+
+// Round-trip latency histogram, from sending a request to its response.
+// Bucket i counts responses that took at most modbus_latency_bucket_ms(i).
+#define MODBUS_LATENCY_BUCKETS 10
+
+struct modbus_stats {
+  uint64_t reads;              // Read requests sent
+  uint64_t responses;          // Responses (including timeouts) handled
+  uint64_t responses_invalid;  // Responses that were rejected
+  uint32_t send_failures;      // Requests the mb library refused to send
+  uint32_t stale_skips;        // Readings not integrated, as too far apart
+  uint32_t missed_deadlines;   // Polls skipped, as their deadline had passed
+  uint32_t task_drops;         // Responses dropped, as the task queue was full
+  uint32_t faults[MODBUS_NUM_FAULTS];
+  uint32_t latency_count;  // Responses timed, excludes timeouts
+  uint32_t latency_min_us;
+  uint32_t latency_max_us;
+  uint64_t latency_total_us;
+  uint32_t latency_buckets[MODBUS_LATENCY_BUCKETS];
+};
+
+/* modbus_get_stats(): Copy the Modbus transport counters and the round-trip
+ * latency histogram into *stats.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool modbus_get_stats(struct modbus_stats *stats);
+
+/* modbus_fault_name(): Return a short lowercase name of the given fault, for
+ * use in RPC replies and metric labels.
+ */
+const char *modbus_fault_name(enum modbus_fault fault);
+
+/* modbus_latency_bucket_ms(): Return the upper bound in milliseconds of the
+ * given latency histogram bucket, or 0 for the last, unbounded, bucket.
+ */
+uint32_t modbus_latency_bucket_ms(int bucket);
+
+#ifdef PDU_HOST
+/* The outcome of replaying a trace, see modbus_replay(). */
+struct modbus_replay {
+  uint32_t frames;       // Responses in the trace
+  uint32_t skipped;      // Responses from addresses that are not configured
+  uint32_t invalid;      // Responses that failed or were malformed
+  uint32_t stale_skips;  // Readings skipped as stale
+  uint64_t centiamp_msecs_total[PDU_MAX_CHANNELS];
+};
+
+/* modbus_replay(): Feed every response in the given trace file (see trace.h)
+ * through the same parsing and integration as live responses, into fresh
+ * state for each configured sensor. Only the responses themselves and their
+ * recorded times are used, so a trace replays as fast as it can be read. The
+ * live state is not touched. This reads the whole trace before returning, so
+ * it is only built for the host, where pdu_replay uses it (see host/).
+ *
+ * Returns: true if the trace was read, false otherwise.
+ */
+bool modbus_replay(const char *filename, struct modbus_replay *replay);
+#endif
@@ -24,3 +24,4 @@
 
 void mqtt_init();
 void mqtt_publish_stat(const char *stat, const char *fmt, ...);
+void mqtt_publish_stat_raw(const char *stat, const void *msg, size_t len);
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define OUTBOX_FILENAME "outbox.seg"
+
+struct outbox_stats {
+  uint32_t depth;    // Messages currently queued, in RAM and on flash
+  uint32_t queued;   // Messages queued since boot
+  uint32_t spilled;  // Messages moved from RAM to flash since boot
+  uint32_t dropped;  // Messages dropped because the outbox was full
+  uint32_t drained;  // Queued messages published since boot
+};
+
+/* The outbox holds MQTT messages produced while the broker is unreachable,
+ * or that could not be published. Messages are queued in a RAM ring of up to
+ * pdu.outbox_entries entries and pdu.outbox_ram_size bytes. When the ring is
+ * full its oldest messages are moved to the segment file OUTBOX_FILENAME,
+ * bounded by pdu.outbox_file_size bytes (0 to disable), and only when that is
+ * full too are messages dropped. A message larger than pdu.outbox_ram_size
+ * goes to the segment file directly. The segment file survives reboots, so it
+ * is drained after the next connect as well. A message that fails to publish
+ * while draining is kept and sent first on the next attempt.
+ */
+
+/* outbox_init(): Allocate the RAM ring and pick up a segment file left over
+ * from before a reboot.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool outbox_init(void);
+
+/* outbox_empty(): Return true if no messages are queued. Callers must queue
+ * rather than publish directly while this is false, to keep messages in order.
+ */
+bool outbox_empty(void);
+
+/* outbox_push(): Queue a message for topic.
+ *
+ * Returns: true if queued, false if it was dropped.
+ */
+bool outbox_push(const char *topic, const void *msg, size_t len);
+
+/* outbox_drain_start(): Start draining the outbox after a random delay of up
+ * to pdu.outbox_jitter_ms, publishing pdu.outbox_batch messages every
+ * pdu.outbox_drain_ms, until it is empty or the connection is lost. The delay
+ * and rate limit keep a row of devices that reconnect at the same time from
+ * flooding the broker.
+ */
+void outbox_drain_start(void);
+
+/* outbox_get_stats(): Return the outbox counters.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool outbox_get_stats(struct outbox_stats *stats);
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define PROMETHEUS_METRICS_URI "/metrics"
+#define PROMETHEUS_BUF_HEADROOM 8  // Grow the buffer by 1/8th over a render
+
+/* prometheus_init(): Render an initial exposition and register the HTTP
+ * handler on PROMETHEUS_METRICS_URI with the http-server library. This must
+ * be called after modbus_init().
+ */
+void prometheus_init();
+
+/* prometheus_update(): Re-render the exposition buffer from the current PDU
+ * state. This is called by the modbus subsystem once per poll cycle, so that
+ * serving a scrape is a single copy of the buffer. The exposition is rendered
+ * in place; only if it did not fit is it measured and the buffer grown to fit
+ * it. If that fails, the exposition is served up to the last line that fit.
+ */
+void prometheus_update();
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+// Largest response kept; a full read of all register blocks is 117 bytes.
+#define RAWLOG_FRAME_MAX 128
+
+/* A Modbus response exactly as the mb library handed it over, with the time
+ * at which it was requested and received.
+ */
+struct rawlog_frame {
+  uint32_t seq;          // Increases by one for every response
+  uint8_t addr;          // Slave address the request was sent to
+  uint8_t status;        // mb library status, RESP_SUCCESS (0) if valid
+  uint16_t first_reg;    // First register requested
+  uint16_t num_regs;     // Number of registers requested
+  uint16_t len;          // Bytes in buf
+  double request_time;   // Wall clock time the request was sent
+  double response_time;  // Wall clock time the response was received
+  uint8_t buf[RAWLOG_FRAME_MAX];
+};
+
+/* rawlog_init(): Allocate a ring of pdu.raw_frames raw responses.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool rawlog_init(void);
+
+/* rawlog_push(): Append a response to the ring, replacing the oldest one when
+ * it is full. Responses longer than RAWLOG_FRAME_MAX are truncated.
+ */
+void rawlog_push(uint8_t addr, uint8_t status, uint16_t first_reg,
+                 uint16_t num_regs, double request_time, double response_time,
+                 const void *buf, size_t len);
+
+/* rawlog_last_seq(): Return the sequence number of the newest response, or 0
+ * if none were received yet.
+ */
+uint32_t rawlog_last_seq(void);
+
+/* rawlog_first_seq(): Return the sequence number of the oldest response still
+ * in the ring, or 0 if it is empty.
+ */
+uint32_t rawlog_first_seq(void);
+
+/* rawlog_get(): Copy the response with sequence number seq into frame.
+ *
+ * Returns: true if it is still in the ring, false otherwise.
+ */
+bool rawlog_get(uint32_t seq, struct rawlog_frame *frame);
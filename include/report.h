@@ -0,0 +1,40 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define REPORT_STAT "pdu"
+#define REPORT_STAT_PACKED "pdu/packed"
+#define REPORT_PACKED_VERSION 1
+#define REPORT_PACKED_FLAG_FULL 0x01
+
+/* report_publish(): Publish the periodic channel report to the stat/pdu topic
+ * (JSON) or the stat/pdu/packed topic (binary), depending on
+ * pdu.report_format.
+ *
+ * Every pdu.report_full_every calls a full frame with all channels is sent.
+ * In between, only channels whose current moved by more than
+ * pdu.report_current_delta Ampere or whose energy moved by more than
+ * pdu.report_energy_delta kWh since they were last published are included,
+ * and nothing is sent if no channel changed.
+ *
+ * The packed format is big-endian: a header of version (u8), flags (u8),
+ * channel count (u8), a reserved byte and the wall clock time (u32 seconds),
+ * followed per channel by its idx (u8), Modbus address (u8), current (u16, in
+ * units of 0.01A) and energy (u32, in Wh).
+ */
+void report_publish(void);
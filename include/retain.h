@@ -0,0 +1,43 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "modbus.h"
+
+#define RETAIN_MAGIC 0x52544331  // "RTC1"
+
+/* The live state of every sensor is mirrored into RTC slow memory, which is
+ * not initialized at boot and survives soft resets, watchdog resets and
+ * brownouts, but not a loss of power. Each sensor has two slots that are
+ * written alternately with an increasing generation number and a CRC32, so a
+ * reset in the middle of an update leaves the previous copy intact.
+ */
+
+/* retain_write(): Mirror the given pdu of sensor device into the older of its
+ * two RTC slots.
+ */
+void retain_write(uint8_t device, const struct pdu *pdu);
+
+/* retain_read(): Load the newest valid RTC copy of sensor device into pdu.
+ *
+ * Returns: true if a valid copy was found, false otherwise.
+ */
+bool retain_read(uint8_t device, struct pdu *pdu);
+
+/* retain_invalidate(): Discard both RTC copies of sensor device, for example
+ * after the state was deliberately replaced.
+ */
+void retain_invalidate(uint8_t device);
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define ROLLUP_RES_MINUTE 60
+#define ROLLUP_RES_HOUR 3600
+
+/* A rollup of all samples of one channel within one bucket of time. */
+struct rollup_sample {
+  double start;             // Wall clock time at which the bucket starts
+  uint16_t min;             // units of 0.01A
+  uint16_t avg;             // units of 0.01A
+  uint16_t max;             // units of 0.01A
+  uint16_t count;           // Number of samples in this bucket
+  uint64_t centiamp_msecs;  // units of 0.01A * 1ms, consumed in this bucket
+};
+
+/* rollup_init(): Allocate ring buffers of pdu.rollup_minutes one-minute and
+ * pdu.rollup_hours one-hour buckets for each of num_channels channels.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool rollup_init(int num_channels);
+
+/* rollup_update(): Fold one sample of channel chan, taken at wall clock time
+ * now, into the current bucket of every resolution. The sample's current is
+ * in units of 0.01A, and its energy in 0.01A * 1ms since the previous sample,
+ * the same unit as the cumulative counters, so no rounding is lost per sample.
+ * This is O(1) per channel, amortized over bucket rollovers.
+ */
+void rollup_update(uint8_t chan, double now, uint16_t raw_current,
+                   uint64_t centiamp_msecs);
+
+/* rollup_get(): Return the i-th bucket, counting from the oldest one, of the
+ * given channel at the given resolution (ROLLUP_RES_*).
+ *
+ * Returns: true if successful, false if there is no such bucket.
+ */
+bool rollup_get(uint8_t chan, int resolution, int i,
+                struct rollup_sample *sample);
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+// Histogram of current per channel: bucket 0 holds zero readings, and every
+// power of two above it is split into STATS_HIST_SUB buckets, so each bucket
+// is at most 25% wide.
+#define STATS_HIST_SUB 4
+#define STATS_HIST_BUCKETS (1 + 16 * STATS_HIST_SUB)
+
+/* Summary of the current samples of one channel within one window. */
+struct stats_summary {
+  double start;    // Wall clock time at which the window started
+  uint32_t count;  // Number of samples
+  uint16_t min;    // units of 0.01A
+  uint16_t max;    // units of 0.01A
+  float mean;      // units of 0.01A
+  float stddev;    // units of 0.01A
+  uint16_t p50;    // units of 0.01A, estimated from the histogram
+  uint16_t p95;
+  uint16_t p99;
+};
+
+/* stats_init(): Allocate streaming statistics for num_channels channels. The
+ * statistics run over tumbling windows of pdu.stats_window seconds, aligned to
+ * the wall clock.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool stats_init(int num_channels);
+
+/* stats_update(): Fold one current sample (in units of 0.01A) of channel chan,
+ * taken at wall clock time now, into the running window. This is O(1); when a
+ * window ends, it is summarized and a new one is started.
+ */
+void stats_update(uint8_t chan, double now, uint16_t raw_current);
+
+/* stats_reset(): Discard both the running and the last completed window of
+ * channel chan.
+ */
+void stats_reset(uint8_t chan);
+
+/* stats_get(): Return the summary of the running window of channel chan, or
+ * of the last completed window if last is true.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool stats_get(uint8_t chan, bool last, struct stats_summary *summary);
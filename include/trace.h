@@ -0,0 +1,76 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+
+#define TRACE_MAGIC 0x50545231  // "PTR1"
+#define TRACE_BUF_SIZE 2048     // Bytes buffered in RAM before writing
+
+/* Capture mode: when pdu.trace_file is set, every Modbus response is appended
+ * to that file, up to pdu.trace_max_size bytes, across reboots. The file
+ * starts with TRACE_MAGIC, followed by a struct trace_record per response,
+ * each directly followed by the len bytes of the response. Responses are
+ * buffered in RAM and written when the buffer fills and before a reboot.
+ *
+ * A current reading takes 69 bytes, so a sensor polled every 5 seconds fills
+ * about 90KB and 45 buffer writes an hour: the default 256KB is a capture of
+ * hours, to be pulled off the device and replayed on a host (see
+ * host/pdu_replay.c), not a long-running log.
+ */
+struct trace_record {
+  int64_t request_us;    // mgos_uptime_micros() when the request was sent
+  int64_t response_us;   // mgos_uptime_micros() when the response arrived
+  double response_time;  // Wall clock time when the response arrived
+  uint8_t addr;          // Slave address the request was sent to
+  uint8_t status;        // mb library status, RESP_SUCCESS (0) if valid
+  uint8_t first_reg;     // First register requested
+  uint8_t num_regs;      // Number of registers requested
+  uint16_t len;          // Bytes of response following the record
+  uint16_t reserved;
+};
+
+/* trace_init(): Open pdu.trace_file for appending, if it is set.
+ *
+ * Returns: true if successful or capture is disabled, false otherwise.
+ */
+bool trace_init(void);
+
+/* trace_push(): Record a response, if capture is enabled and the file has not
+ * reached pdu.trace_max_size yet.
+ */
+void trace_push(uint8_t addr, uint8_t status, uint8_t first_reg,
+                uint8_t num_regs, int64_t request_us, int64_t response_us,
+                double response_time, const void *buf, size_t len);
+
+/* trace_flush(): Write the buffered responses to the trace file.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool trace_flush(void);
+
+/* Called by trace_read() for each recorded response. Returns false to stop
+ * reading.
+ */
+typedef bool (*trace_record_cb)(const struct trace_record *rec,
+                                const uint8_t *buf, void *arg);
+
+/* trace_read(): Call cb for every response in the given trace file, in the
+ * order they were recorded. A truncated last record is ignored.
+ *
+ * Returns: true if the file is a trace and was read, false otherwise.
+ */
+bool trace_read(const char *filename, trace_record_cb cb, void *arg);
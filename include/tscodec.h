@@ -0,0 +1,59 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Codec for one series of samples, each a timestamp and a vector of
+ * TSCODEC_VALUES 16-bit values. A record holds the delta-of-delta of the
+ * timestamp in milliseconds as a zigzag varint, a varint bitmask of the values
+ * that changed, and for each of those the XOR with its previous value as a
+ * varint. A steady poll interval with unchanged values thus takes 2 bytes.
+ * This file only depends on the C library, so it can be built anywhere.
+ */
+#define TSCODEC_VALUES 16
+
+// Longest record: a 10 byte timestamp, 3 byte mask and 3 bytes per value.
+#define TSCODEC_RECORD_MAX (10 + 3 + 3 * TSCODEC_VALUES)
+
+struct tscodec_state {
+  int64_t prev_ms;
+  int64_t prev_delta_ms;
+  uint16_t prev[TSCODEC_VALUES];
+};
+
+/* tscodec_reset(): Start a series at base_ms, with all values zero. Both the
+ * encoder and decoder of a series start from the same state.
+ */
+void tscodec_reset(struct tscodec_state *s, int64_t base_ms);
+
+/* tscodec_encode(): Encode a sample into buf, which has room for at least
+ * TSCODEC_RECORD_MAX bytes.
+ *
+ * Returns: the number of bytes written.
+ */
+size_t tscodec_encode(struct tscodec_state *s, int64_t t_ms,
+                      const uint16_t *values, uint8_t *buf);
+
+/* tscodec_decode(): Decode the next sample from the len bytes in buf.
+ *
+ * Returns: the number of bytes consumed, or 0 if buf does not hold a complete
+ * record, in which case the state is unchanged.
+ */
+size_t tscodec_decode(struct tscodec_state *s, const uint8_t *buf, size_t len,
+                      int64_t *t_ms, uint16_t *values);
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "mgos.h"
+#include "modbus.h"
+
+#define TSDB_MAGIC 0x54534731        // "TSG1"
+#define TSDB_INDEX_MAGIC 0x54534931  // "TSI1"
+#define TSDB_BUF_SIZE 1024           // Encoded bytes buffered in RAM per sensor
+
+/* The current of every channel is kept per poll in a series of segment files
+ * per sensor, named "ts<address>.<seq>". Each segment starts with a header
+ * holding its base time, followed by tscodec records, and is at most
+ * pdu.tsdb_segment_size bytes. Once the segments of a sensor exceed
+ * pdu.tsdb_budget bytes, the oldest one is removed. "ts<address>.idx" holds
+ * the range of segment numbers. Samples are buffered in RAM and appended to
+ * flash every pdu.tsdb_flush_interval seconds, when the buffer fills, and
+ * before a reboot.
+ */
+
+/* tsdb_init(): Load the segment index of num_devices sensors, and start the
+ * flush timer. A new segment is started for each sensor after boot.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool tsdb_init(int num_devices);
+
+/* tsdb_append(): Add the current of every channel of the given sensor state,
+ * at its last_read_time, to the series of that sensor.
+ */
+void tsdb_append(uint8_t device, const struct pdu *pdu);
+
+/* tsdb_flush(): Append the buffered samples of every sensor to flash.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool tsdb_flush(void);
+
+/* Called by tsdb_read() for each sample, with the current of all channels of
+ * the sensor in units of 0.01A. Returns false to stop reading.
+ */
+typedef bool (*tsdb_sample_cb)(double t, const uint16_t *currents, void *arg);
+
+/* tsdb_read(): Stream the samples of the given sensor with since <= t < until,
+ * oldest first, from flash and the RAM buffer. Segments are decoded through a
+ * small window, never loaded whole.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+bool tsdb_read(uint8_t device, double since, double until, tsdb_sample_cb cb,
+               void *arg);
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "alert.h"
+#include "mqtt.h"
+
+struct alert {
+  uint32_t threshold;  // units of 0.01A, 0 if disabled
+  bool active;
+  int64_t pending_us;  // Start of a pending transition, 0 if none
+};
+
+static struct alert s_channels[PDU_MAX_CHANNELS];
+static struct alert s_totals[PDU_MAX_DEVICES];
+static struct alert_stats s_stats;
+static int s_num_devices = 0;
+
+// Config the thresholds were loaded from, to reload them when it changes.
+static double s_current = 0;
+static double s_total_current = 0;
+static char *s_currents = NULL;
+
+// Set the threshold of an alert, clearing it if it got disabled.
+static void alert_set_threshold(struct alert *a, uint32_t threshold) {
+  a->threshold = threshold;
+  a->pending_us = 0;
+  if (threshold == 0 && a->active) {
+    a->active = false;
+    s_stats.active--;
+  }
+}
+
+// Parse "idx:amperes,..." in pdu.alert_currents into per-channel thresholds.
+static void alert_parse_currents(const char *p, uint32_t *thresholds,
+                                 int num_channels) {
+  while (p && *p) {
+    char *end;
+    long idx = strtol(p, &end, 10);
+    double amps;
+    if (end == p || *end != ':') break;
+    p = end + 1;
+    amps = strtod(p, &end);
+    if (end == p) break;
+    if (idx < 0 || idx >= num_channels || amps < 0) {
+      LOG(LL_ERROR, ("Ignoring invalid alert threshold %ld:%.2f", idx, amps));
+    } else {
+      thresholds[idx] = (uint32_t) (amps * 100);
+    }
+    p = end;
+    while (*p == ',' || *p == ' ') p++;
+  }
+}
+
+// (Re)load the thresholds from pdu.alert_*, keeping the state of alerts that
+// stay enabled.
+static void alert_load() {
+  const char *currents = mgos_sys_config_get_pdu_alert_currents();
+  uint32_t thresholds[PDU_MAX_CHANNELS];
+  int num_channels = s_num_devices * PDU_NUM_CHANNELS;
+  uint32_t total;
+
+  s_current = mgos_sys_config_get_pdu_alert_current();
+  s_total_current = mgos_sys_config_get_pdu_alert_total_current();
+  free(s_currents);
+  s_currents = strdup(currents ? currents : "");
+
+  for (int i = 0; i < num_channels; i++) thresholds[i] = s_current * 100;
+  alert_parse_currents(s_currents, thresholds, num_channels);
+  for (int i = 0; i < num_channels; i++)
+    alert_set_threshold(&s_channels[i], thresholds[i]);
+  total = s_total_current * 100;
+  for (int d = 0; d < s_num_devices; d++)
+    alert_set_threshold(&s_totals[d], total);
+}
+
+static bool alert_config_changed() {
+  const char *currents = mgos_sys_config_get_pdu_alert_currents();
+
+  return s_current != mgos_sys_config_get_pdu_alert_current() ||
+         s_total_current != mgos_sys_config_get_pdu_alert_total_current() ||
+         !s_currents || strcmp(s_currents, currents ? currents : "") != 0;
+}
+
+bool alert_init(int num_devices) {
+  memset(s_channels, 0, sizeof(s_channels));
+  memset(s_totals, 0, sizeof(s_totals));
+  s_num_devices = num_devices;
+  alert_load();
+  return true;
+}
+
+static void alert_publish(const struct alert *a, const char *type, int idx,
+                          const struct pdu *pdu, uint32_t current,
+                          int64_t sample_us) {
+  uint32_t latency_us;
+
+  LOG(LL_WARN, ("Alert %s %s %d: current=%.2fA threshold=%.2fA",
+                a->active ? "raised" : "cleared", type, idx, current * 0.01,
+                a->threshold * 0.01));
+  mqtt_publish_stat(ALERT_STAT,
+                    "{type: %Q, state: %Q, idx: %d, addr: %d, current: %.2f, "
+                    "threshold: %.2f, time: %.3f}",
+                    type, a->active ? "raised" : "cleared", idx,
+                    pdu->modbus_address, current * 0.01, a->threshold * 0.01,
+                    pdu->last_read_time);
+
+  latency_us = (uint32_t) (mgos_uptime_micros() - sample_us);
+  if (a->active)
+    s_stats.raised++;
+  else
+    s_stats.cleared++;
+  s_stats.latency_count++;
+  s_stats.latency_last_us = latency_us;
+  if (latency_us > s_stats.latency_max_us) s_stats.latency_max_us = latency_us;
+  s_stats.latency_total_us += latency_us;
+  if (latency_us > 1000000LL * mgos_sys_config_get_pdu_modbus_interval())
+    s_stats.latency_over_interval++;
+}
+
+/* alert_eval(): Advance the state of one alert with a new current sample.
+ *
+ * Returns: true if the alert changed state, false otherwise.
+ */
+static bool alert_eval(struct alert *a, uint32_t current, int64_t sample_us) {
+  int64_t hold_us = (int64_t) mgos_sys_config_get_pdu_alert_hold_ms() * 1000;
+  uint32_t hysteresis = mgos_sys_config_get_pdu_alert_hysteresis() * 100;
+  bool transition;
+
+  if (a->threshold == 0) return false;
+  // A hysteresis at or above the threshold would never let the alert clear.
+  if (hysteresis > a->threshold / 2) hysteresis = a->threshold / 2;
+  if (a->active)
+    transition = current + hysteresis < a->threshold;
+  else
+    transition = current > a->threshold;
+  if (!transition) {
+    a->pending_us = 0;
+    return false;
+  }
+  if (a->pending_us == 0) a->pending_us = sample_us;
+  if (sample_us - a->pending_us < hold_us) return false;
+
+  a->active = !a->active;
+  a->pending_us = 0;
+  if (a->active)
+    s_stats.active++;
+  else
+    s_stats.active--;
+  return true;
+}
+
+void alert_update(uint8_t device, const struct pdu *pdu, int64_t sample_us) {
+  uint32_t total = 0;
+
+  if (device >= PDU_MAX_DEVICES || !pdu) return;
+  if (alert_config_changed()) alert_load();
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+    uint8_t chan = device * PDU_NUM_CHANNELS + i;
+    uint32_t current = pdu->pdu_channel[i].raw_current;
+    total += current;
+    if (alert_eval(&s_channels[chan], current, sample_us))
+      alert_publish(&s_channels[chan], "channel", chan, pdu, current,
+                    sample_us);
+  }
+  if (alert_eval(&s_totals[device], total, sample_us))
+    alert_publish(&s_totals[device], "total", device, pdu, total, sample_us);
+}
+
+bool alert_channel_active(uint8_t chan) {
+  if (chan >= PDU_MAX_CHANNELS) return false;
+  return s_channels[chan].active;
+}
+
+bool alert_total_active(uint8_t device) {
+  if (device >= PDU_MAX_DEVICES) return false;
+  return s_totals[device].active;
+}
+
+bool alert_get_stats(struct alert_stats *stats) {
+  if (!stats) return false;
+  memcpy(stats, &s_stats, sizeof(struct alert_stats));
+  return true;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "budget.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_heap_caps.h"
+#endif
+#if CS_PLATFORM == CS_P_ESP32 || defined(PDU_HOST)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+struct budget_task {
+  const char *name;
+  void *task;
+};
+
+static struct budget_timing s_timing[BUDGET_NUM_SECTIONS];
+static struct budget_flash_stats s_flash[BUDGET_NUM_FLASH];
+static struct budget_heap_sample s_heap[BUDGET_HEAP_SAMPLES];
+static uint32_t s_heap_count = 0;
+static struct budget_task s_tasks[BUDGET_MAX_TASKS];
+static int s_num_tasks = 0;
+
+static const char *s_section_names[BUDGET_NUM_SECTIONS] = {
+    "poll", "rpc", "publish", "state_write"};
+static const char *s_flash_names[BUDGET_NUM_FLASH] = {
+    "state", "journal", "tsdb", "trace", "outbox"};
+
+static void budget_heap_timer(void *arg) {
+  budget_heap_now(&s_heap[s_heap_count % BUDGET_HEAP_SAMPLES]);
+  s_heap_count++;
+}
+
+bool budget_init(void) {
+#if CS_PLATFORM == CS_P_ESP32 || defined(PDU_HOST)
+  budget_register_task("mgos", xTaskGetCurrentTaskHandle());
+#endif
+  budget_heap_timer(NULL);
+  mgos_set_timer(1000 * BUDGET_HEAP_INTERVAL, MGOS_TIMER_REPEAT,
+                 budget_heap_timer, NULL);
+  return true;
+}
+
+void budget_register_task(const char *name, void *task) {
+#if CS_PLATFORM == CS_P_ESP32 || defined(PDU_HOST)
+  if (!task || s_num_tasks == BUDGET_MAX_TASKS) return;
+  s_tasks[s_num_tasks].name = name;
+  s_tasks[s_num_tasks].task = task;
+  s_num_tasks++;
+#endif
+}
+
+void budget_time(enum budget_section section, int64_t start_us) {
+  struct budget_timing *t;
+  int64_t us = mgos_uptime_micros() - start_us;
+
+  if (section < 0 || section >= BUDGET_NUM_SECTIONS || us < 0) return;
+  t = &s_timing[section];
+  t->count++;
+  t->total_us += us;
+  if (us > t->max_us) t->max_us = us;
+}
+
+void budget_flash_write(enum budget_flash writer, size_t len) {
+  if (writer < 0 || writer >= BUDGET_NUM_FLASH) return;
+  s_flash[writer].writes++;
+  s_flash[writer].bytes += len;
+}
+
+const char *budget_section_name(enum budget_section section) {
+  if (section < 0 || section >= BUDGET_NUM_SECTIONS) return "unknown";
+  return s_section_names[section];
+}
+
+const char *budget_flash_name(enum budget_flash writer) {
+  if (writer < 0 || writer >= BUDGET_NUM_FLASH) return "unknown";
+  return s_flash_names[writer];
+}
+
+bool budget_get_timing(enum budget_section section,
+                       struct budget_timing *timing) {
+  if (!timing || section < 0 || section >= BUDGET_NUM_SECTIONS) return false;
+  memcpy(timing, &s_timing[section], sizeof(struct budget_timing));
+  return true;
+}
+
+bool budget_get_flash(enum budget_flash writer,
+                      struct budget_flash_stats *stats) {
+  if (!stats || writer < 0 || writer >= BUDGET_NUM_FLASH) return false;
+  memcpy(stats, &s_flash[writer], sizeof(struct budget_flash_stats));
+  return true;
+}
+
+void budget_heap_now(struct budget_heap_sample *sample) {
+  sample->uptime = (uint32_t) mgos_uptime();
+  sample->free = mgos_get_free_heap_size();
+  sample->min_free = mgos_get_min_free_heap_size();
+#if CS_PLATFORM == CS_P_ESP32
+  sample->largest_free = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+  sample->largest_free = 0;
+#endif
+}
+
+int budget_heap_history(struct budget_heap_sample *samples, int max) {
+  uint32_t first = 0;
+  int n = 0;
+
+  if (s_heap_count > BUDGET_HEAP_SAMPLES)
+    first = s_heap_count - BUDGET_HEAP_SAMPLES;
+  for (uint32_t i = first; i < s_heap_count && n < max; i++)
+    samples[n++] = s_heap[i % BUDGET_HEAP_SAMPLES];
+  return n;
+}
+
+int budget_num_tasks(void) {
+  return s_num_tasks;
+}
+
+bool budget_task_stack(int i, const char **name, uint32_t *min_free) {
+  if (i < 0 || i >= s_num_tasks || !name || !min_free) return false;
+  *name = s_tasks[i].name;
+#if CS_PLATFORM == CS_P_ESP32 || defined(PDU_HOST)
+  // On ESP-IDF the high water mark is in bytes, as stack words are bytes.
+  *min_free = uxTaskGetStackHighWaterMark((TaskHandle_t) s_tasks[i].task);
+#else
+  *min_free = 0;
+#endif
+  return true;
+}
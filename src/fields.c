@@ -0,0 +1,123 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "fields.h"
+
+static double field_current(const struct pdu *pdu,
+                            const struct pdu_channel *ch) {
+  return ch->raw_current;
+}
+
+static double field_frequency(const struct pdu *pdu,
+                              const struct pdu_channel *ch) {
+  return ch->raw_frequency;
+}
+
+static double field_ratio(const struct pdu *pdu, const struct pdu_channel *ch) {
+  return ch->raw_ratio;
+}
+
+static double field_kwh(const struct pdu *pdu, const struct pdu_channel *ch) {
+  return modbus_centiamp_msecs_to_kwh(ch->centiamp_msecs_total);
+}
+
+static double field_last_clear(const struct pdu *pdu,
+                               const struct pdu_channel *ch) {
+  return ch->last_cleared_time;
+}
+
+static double field_last_read(const struct pdu *pdu,
+                              const struct pdu_channel *ch) {
+  return pdu->last_read_time;
+}
+
+static const struct channel_field s_fields[NUM_CHANNEL_FIELDS] = {
+    [CHANNEL_FIELD_CURRENT] = {"current", 0.01, 2,
+                               "pdu_channel_current_amperes", "gauge",
+                               "Last read current per channel, in Ampere.",
+                               field_current},
+    [CHANNEL_FIELD_FREQUENCY] = {"frequency", 0.1, 1,
+                                 "pdu_channel_frequency_hertz", "gauge",
+                                 "Last read frequency per channel, in Hertz.",
+                                 field_frequency},
+    [CHANNEL_FIELD_RATIO] = {"ratio", 1, 0, "pdu_channel_ct_ratio", "gauge",
+                             "Current transformer turn-ratio per channel "
+                             "(1:n).",
+                             field_ratio},
+    [CHANNEL_FIELD_KWH] = {"kwh", 1, 3, "pdu_channel_energy_kwh_total",
+                           "counter",
+                           "Consumed energy per channel since last clear, in "
+                           "kWh.",
+                           field_kwh},
+    [CHANNEL_FIELD_LAST_CLEAR] = {"last_clear", 1, 0,
+                                  "pdu_channel_last_clear_timestamp_seconds",
+                                  "gauge",
+                                  "Time of the last counter clear per channel, "
+                                  "0 if never.",
+                                  field_last_clear},
+    [CHANNEL_FIELD_LAST_READ] = {"last_read", 1, 0,
+                                 "pdu_channel_last_read_timestamp_seconds",
+                                 "gauge",
+                                 "Time of the last successful read per "
+                                 "channel, 0 if never.",
+                                 field_last_read},
+};
+
+const struct channel_field *fields_get(enum channel_field_id f) {
+  if (f < 0 || f >= NUM_CHANNEL_FIELDS) return NULL;
+  return &s_fields[f];
+}
+
+int fields_find(const char *name, size_t len) {
+  for (int f = 0; f < NUM_CHANNEL_FIELDS; f++)
+    if (len == strlen(s_fields[f].name) &&
+        0 == strncmp(name, s_fields[f].name, len))
+      return f;
+  return -1;
+}
+
+double fields_value(enum channel_field_id f, const struct pdu *pdu,
+                    uint8_t chan) {
+  const struct channel_field *field = fields_get(f);
+  if (!field || !pdu || chan >= PDU_NUM_CHANNELS) return 0;
+  return field->get(pdu, &pdu->pdu_channel[chan]) * field->scale;
+}
+
+int fields_json_value(struct json_out *out, enum channel_field_id f,
+                      const struct pdu *pdu, uint8_t chan) {
+  const struct channel_field *field = fields_get(f);
+  char buf[24];
+
+  if (!field) return json_printf(out, "%Q", NULL);
+  // json_printf() does not take a '*' precision, so format the number here.
+  snprintf(buf, sizeof(buf), "%.*f", field->precision,
+           fields_value(f, pdu, chan));
+  return json_printf(out, "%s", buf);
+}
+
+int fields_json_channel(struct json_out *out, int idx, const struct pdu *pdu,
+                        uint32_t mask) {
+  uint8_t chan = idx % PDU_NUM_CHANNELS;
+  int len = 0;
+
+  len += json_printf(out, "{idx: %d, addr: %d", idx, pdu->modbus_address);
+  for (int f = 0; f < NUM_CHANNEL_FIELDS; f++) {
+    if (!(mask & CHANNEL_FIELD_MASK(f))) continue;
+    len += json_printf(out, ", %Q: ", s_fields[f].name);
+    len += fields_json_value(out, f, pdu, chan);
+  }
+  len += json_printf(out, "}");
+  return len;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "journal.h"
+#include "budget.h"
+#include "common/cs_crc32.h"
+
+struct journal_checkpoint {
+  uint32_t magic;
+  uint32_t generation;
+  struct pdu pdu;
+  uint32_t crc;
+};
+
+struct journal_record {
+  uint32_t magic;
+  uint32_t generation;
+  double last_read_time;
+  struct {
+    double last_cleared_time;
+    uint64_t centiamp_msecs_total;
+  } channel[PDU_NUM_CHANNELS];
+  uint32_t crc;
+};
+
+static void journal_filename(char *buf, size_t len, const char *state_filename,
+                             const char *suffix) {
+  snprintf(buf, len, "%s%s", state_filename, suffix);
+}
+
+static bool journal_checkpoint_load(const char *filename,
+                                    struct journal_checkpoint *ckp) {
+  int fd;
+  int bytes_read;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  bytes_read = read(fd, ckp, sizeof(*ckp));
+  close(fd);
+  if (bytes_read != sizeof(*ckp)) {
+    LOG(LL_WARN, ("%s: Short read(), wanted %d got %d", filename,
+                  (int) sizeof(*ckp), bytes_read));
+    return false;
+  }
+  if (ckp->magic != JOURNAL_CHECKPOINT_MAGIC ||
+      ckp->crc != cs_crc32(0, ckp, offsetof(struct journal_checkpoint, crc))) {
+    LOG(LL_WARN, ("%s: Invalid checkpoint, ignoring", filename));
+    return false;
+  }
+  return true;
+}
+
+bool journal_read(struct journal *j, const char *state_filename,
+                  struct pdu *pdu) {
+  struct journal_checkpoint ckp_a, ckp_b, *ckp = NULL;
+  struct journal_record rec, last_rec;
+  char filename[64];
+  bool valid_a, valid_b;
+  int records = 0;
+  ssize_t n = 0;
+  int fd;
+
+  if (!j || !state_filename || !pdu) return false;
+
+  journal_filename(filename, sizeof(filename), state_filename,
+                   JOURNAL_SLOT_SUFFIX_A);
+  valid_a = journal_checkpoint_load(filename, &ckp_a);
+  journal_filename(filename, sizeof(filename), state_filename,
+                   JOURNAL_SLOT_SUFFIX_B);
+  valid_b = journal_checkpoint_load(filename, &ckp_b);
+  if (valid_a && valid_b) {
+    ckp = ckp_a.generation > ckp_b.generation ? &ckp_a : &ckp_b;
+  } else if (valid_a) {
+    ckp = &ckp_a;
+  } else if (valid_b) {
+    ckp = &ckp_b;
+  } else {
+    return false;
+  }
+  memcpy(pdu, &ckp->pdu, sizeof(struct pdu));
+  j->generation = ckp->generation;
+  j->records = 0;
+
+  // Replay the journal up to the first torn or foreign record. Records hold
+  // absolute counters, so only the last valid one needs to be applied.
+  journal_filename(filename, sizeof(filename), state_filename, JOURNAL_SUFFIX);
+  fd = open(filename, O_RDONLY);
+  if (fd >= 0) {
+    while ((n = read(fd, &rec, sizeof(rec))) == sizeof(rec)) {
+      if (rec.magic != JOURNAL_MAGIC || rec.generation != j->generation ||
+          rec.crc != cs_crc32(0, &rec, offsetof(struct journal_record, crc)))
+        break;
+      memcpy(&last_rec, &rec, sizeof(rec));
+      records++;
+    }
+    close(fd);
+  }
+  if (records > 0) {
+    pdu->last_read_time = last_rec.last_read_time;
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+      pdu->pdu_channel[i].last_cleared_time =
+          last_rec.channel[i].last_cleared_time;
+      pdu->pdu_channel[i].centiamp_msecs_total =
+          last_rec.channel[i].centiamp_msecs_total;
+    }
+  }
+  j->records = records;
+  // Anything appended after where replay stopped would never be reached.
+  j->compact = n != 0;
+  LOG(LL_INFO, ("%s: Loaded checkpoint generation %u and %d journal records%s",
+                state_filename, (unsigned) j->generation, records,
+                j->compact ? ", compacting" : ""));
+  return true;
+}
+
+bool journal_checkpoint(struct journal *j, const char *state_filename,
+                        const struct pdu *pdu) {
+  struct journal_checkpoint ckp;
+  char filename[64];
+  int bytes_written;
+  int fd;
+
+  if (!j || !state_filename || !pdu) return false;
+
+  memset(&ckp, 0, sizeof(ckp));
+  ckp.magic = JOURNAL_CHECKPOINT_MAGIC;
+  ckp.generation = j->generation + 1;
+  memcpy(&ckp.pdu, pdu, sizeof(struct pdu));
+  ckp.crc = cs_crc32(0, &ckp, offsetof(struct journal_checkpoint, crc));
+
+  journal_filename(
+      filename, sizeof(filename), state_filename,
+      (ckp.generation & 1) ? JOURNAL_SLOT_SUFFIX_A : JOURNAL_SLOT_SUFFIX_B);
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  bytes_written = write(fd, &ckp, sizeof(ckp));
+  close(fd);
+  if (bytes_written != sizeof(ckp)) {
+    LOG(LL_ERROR, ("%s: Short write(), wanted %d got %d", filename,
+                   (int) sizeof(ckp), bytes_written));
+    return false;
+  }
+  budget_flash_write(BUDGET_FLASH_STATE, sizeof(ckp));
+  j->generation = ckp.generation;
+
+  // Replay stops at the first record of the previous generation, so unless
+  // the journal is emptied, nothing appended to it would be reached. Try
+  // again on the next append if it could not be.
+  journal_filename(filename, sizeof(filename), state_filename, JOURNAL_SUFFIX);
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  j->records = 0;
+  j->compact = fd < 0;
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  close(fd);
+
+  LOG(LL_INFO, ("%s: Wrote checkpoint generation %u", state_filename,
+                (unsigned) j->generation));
+  return true;
+}
+
+bool journal_append(struct journal *j, const char *state_filename,
+                    const struct pdu *pdu, int max_records) {
+  struct journal_record rec;
+  char filename[64];
+  int bytes_written;
+  int fd;
+
+  if (!j || !state_filename || !pdu) return false;
+  if (j->generation == 0 || j->compact || j->records >= max_records)
+    return journal_checkpoint(j, state_filename, pdu);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = JOURNAL_MAGIC;
+  rec.generation = j->generation;
+  rec.last_read_time = pdu->last_read_time;
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+    rec.channel[i].last_cleared_time = pdu->pdu_channel[i].last_cleared_time;
+    rec.channel[i].centiamp_msecs_total =
+        pdu->pdu_channel[i].centiamp_msecs_total;
+  }
+  rec.crc = cs_crc32(0, &rec, offsetof(struct journal_record, crc));
+
+  journal_filename(filename, sizeof(filename), state_filename, JOURNAL_SUFFIX);
+  fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  bytes_written = write(fd, &rec, sizeof(rec));
+  close(fd);
+  if (bytes_written != sizeof(rec)) {
+    LOG(LL_ERROR, ("%s: Short write(), wanted %d got %d", filename,
+                   (int) sizeof(rec), bytes_written));
+    // Replay stops at a torn record, so compact on the next append.
+    j->compact = true;
+    return false;
+  }
+  budget_flash_write(BUDGET_FLASH_JOURNAL, sizeof(rec));
+  j->records++;
+  LOG(LL_DEBUG, ("%s: Appended journal record %d of generation %u", filename,
+                 j->records, (unsigned) j->generation));
+  return true;
+}
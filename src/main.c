@@ -14,9 +14,18 @@
  * limitations under the License.
  */
 #include "mgos.h"
+#include "alert.h"
+#include "budget.h"
 #include "modbus.h"
 #include "mqtt.h"
+#include "prometheus.h"
+#include "rawlog.h"
+#include "report.h"
+#include "rollup.h"
 #include "rpc.h"
+#include "stats.h"
+#include "trace.h"
+#include "tsdb.h"
 
 static void button_handler(int pin, void *args) {
   LOG(LL_INFO, ("Button pressed, persisting state"));
@@ -24,16 +33,27 @@ static void button_handler(int pin, void *args) {
 }
 
 static void mqtt_timer(void *args) {
-  mqtt_publish_stat("stat/pdu", "{%s:%s}", "\"something\"", "true");
+  int64_t start_us = mgos_uptime_micros();
+
+  report_publish();
+  budget_time(BUDGET_SECTION_PUBLISH, start_us);
 }
 
 enum mgos_app_init_result mgos_app_init(void) {
+  budget_init();
   modbus_init(mgos_sys_config_get_pdu_modbus_interval(),
               mgos_sys_config_get_pdu_state_interval(), STATE_FILENAME);
   mgos_gpio_set_button_handler(39, MGOS_GPIO_PULL_UP, MGOS_GPIO_INT_EDGE_NEG,
                                100, button_handler, NULL);
+  rollup_init(modbus_num_channels());
+  stats_init(modbus_num_channels());
+  rawlog_init();
+  trace_init();
+  alert_init(modbus_num_devices());
+  tsdb_init(modbus_num_devices());
 
   rpc_init();
+  prometheus_init();
 
   mqtt_init();
   mgos_set_timer(1000 * mgos_sys_config_get_pdu_mqtt_interval(),
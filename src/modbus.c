@@ -14,134 +14,886 @@
  * limitations under the License.
  */
 #include "modbus.h"
+#include "alert.h"
+#include "budget.h"
+#include "journal.h"
+#include "mgos_ota.h"
+#include "prometheus.h"
+#include "rawlog.h"
+#include "retain.h"
+#include "rollup.h"
+#include "stats.h"
+#include "trace.h"
+#include "tsdb.h"
 
-static struct pdu s_pdu;
+#if CS_PLATFORM == CS_P_ESP32 || defined(PDU_HOST)
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#endif
 
-static uint64_t s_modbus_reads = 0;
-static uint64_t s_modbus_responses = 0;
-static uint64_t s_modbus_responses_invalid = 0;
-
-static double ampsecs2kwh(double ampere_seconds) {
+static double cams2kwh(uint64_t centiamp_msecs) {
+  // centiamp*msec / 100000 = amp*sec
   // amp*sec * volts = Watts*sec
   // Watts*sec / 3600 = Watts/hr
   // Watts/hr / 1000 = kWh
-  return (ampere_seconds * PDU_VOLTAGE) / 3600000.;
+  return (centiamp_msecs * PDU_VOLTAGE) / 360000000000.;
 }
 
-static void mb_read_response_handler(uint8_t status,
-                                     struct mb_request_info mb_ri,
-                                     struct mbuf response, void *param) {
+static uint64_t kwh2cams(double kwh) {
+  return (uint64_t) (kwh * 360000000000. / PDU_VOLTAGE + 0.5);
+}
+
+// Big-endian holding register n of a block of register data.
+#define MB_REG(regs, n) (((regs)[(n) * 2] << 8) + (regs)[(n) * 2 + 1])
+
+static void pdu_parse_identity(struct pdu *pdu, const uint8_t *regs) {
+  pdu->pdu_version = MB_REG(regs, 0);
+  pdu->pdu_current_range[0] = MB_REG(regs, 1);
+  pdu->pdu_current_range[1] = MB_REG(regs, 2);
+  pdu->pdu_build_month = regs[8];
+  pdu->pdu_build_year = regs[9];
+  LOG(LL_DEBUG, ("Response: PDU version %d (build %d.%d, range=(%dA,%dA))",
+                 pdu->pdu_version, pdu->pdu_build_year, pdu->pdu_build_month,
+                 pdu->pdu_current_range[0], pdu->pdu_current_range[1]));
+}
+
+static void pdu_parse_current(struct pdu *pdu, const uint8_t *regs) {
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    pdu->pdu_channel[i].raw_current = MB_REG(regs, i);
+}
+
+static void pdu_parse_frequency(struct pdu *pdu, const uint8_t *regs) {
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    pdu->pdu_channel[i].raw_frequency = MB_REG(regs, i);
+}
+
+static void pdu_parse_ratio(struct pdu *pdu, const uint8_t *regs) {
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    pdu->pdu_channel[i].raw_ratio = MB_REG(regs, i);
+}
+
+/* The sensor's 56 holding registers are read as up to four blocks. The current
+ * block is read on every poll, the others only when their refresh interval
+ * (in seconds, 0 meaning every poll) has passed. Each poll reads the smallest
+ * contiguous register range that covers all due blocks.
+ */
+struct pdu_block {
+  const char *name;
+  uint16_t first_reg;
+  uint16_t num_regs;
+  void (*parse)(struct pdu *pdu, const uint8_t *regs);
+  int (*interval)(void);  // NULL for every poll
+};
+
+#define PDU_BLOCK_IDENTITY 0
+#define PDU_BLOCK_CURRENT 1
+#define PDU_BLOCK_FREQUENCY 2
+#define PDU_BLOCK_RATIO 3
+#define PDU_NUM_BLOCKS 4
+
+#define MODBUS_FRAME_MAX 256  // Largest Modbus RTU frame
+#define MODBUS_QUEUE_LEN (2 * PDU_MAX_DEVICES)
+#define MODBUS_TASK_STACK_SIZE 6144
+#define MODBUS_TASK_PRIORITY 5
+
+static const struct pdu_block s_pdu_blocks[PDU_NUM_BLOCKS] = {
+    {"identity", 0, 8, pdu_parse_identity,
+     mgos_sys_config_get_pdu_modbus_identity_interval},
+    {"current", 8, 16, pdu_parse_current, NULL},
+    {"frequency", 24, 16, pdu_parse_frequency,
+     mgos_sys_config_get_pdu_modbus_frequency_interval},
+    {"ratio", 40, 16, pdu_parse_ratio,
+     mgos_sys_config_get_pdu_modbus_ratio_interval},
+};
+
+/* A sensor on the Modbus segment, with its own PDU state, journal position
+ * and read schedule. The poll path owns pdu; readers copy from frame, two
+ * buffers that are published in turn by modbus_publish() under frame_seq.
+ * frame_seq is odd while a frame is being written, and frame[(frame_seq >> 1)
+ * & 1] is the newest complete one.
+ */
+struct pdu_device {
+  struct pdu pdu;
+  struct pdu frame[2];
+  uint32_t frame_seq;
+  struct journal journal;
+  double block_last_read[PDU_NUM_BLOCKS];  // mgos_uptime() of last read
+  uint16_t last_current[PDU_NUM_CHANNELS];
+  int64_t last_sample_us;  // mgos_uptime_micros() integrated up to
+};
+
+static struct pdu_device s_devices[PDU_MAX_DEVICES];
+
+/* A response from the mb library, handed from the event loop to wherever it
+ * is processed, with the time at which it was received.
+ */
+struct modbus_response {
+  uint8_t device;
+  uint8_t status;
+  uint16_t first_reg;
+  uint16_t num_regs;
+  uint16_t len;
+  int64_t sample_us;   // Monotonic time at which the sensor was sampled
+  double sample_time;  // Wall clock time corresponding to sample_us
+  uint8_t buf[MODBUS_FRAME_MAX];
+};
+
+/* The outcome of processing a response, handed back to the event loop. */
+struct modbus_result {
+  uint8_t device;
+  int blocks;         // Blocks parsed, 0 if the response was rejected
+  int fault;          // enum modbus_fault if rejected, -1 otherwise
+  bool stale;         // The current was read but not integrated, as stale
+  int64_t delta_ms;   // Time integrated, or -1 if nothing was integrated
+  int64_t sample_us;  // Monotonic time of the sample
+};
+static int s_num_devices = 0;
+
+// Index into s_devices of the sensor being polled, or -1 when idle.
+static int s_poll_device = -1;
+
+// Serializes writers of s_devices[].pdu: the response path, and the event loop
+// for clears, state reads and state writes.
+static struct mgos_rlock_type *s_modbus_lock = NULL;
+
+static int s_modbus_interval_ms = 0;
+
+// Monotonic (mgos_uptime_micros()) deadline of the next poll.
+static int64_t s_modbus_deadline_us = 0;
+static int s_modbus_change = 0;
+
+static struct modbus_stats s_modbus_stats;
+
+// Time at which the request on the bus was sent, for the latency histogram.
+static int64_t s_modbus_request_us = 0;
+
+static const uint32_t s_modbus_latency_bucket_ms[MODBUS_LATENCY_BUCKETS] = {
+    5, 10, 20, 50, 100, 200, 500, 1000, 2000, 0};
+
+static const char *s_modbus_fault_names[MODBUS_NUM_FAULTS] = {
+    "timeout", "crc", "address", "function", "length", "other"};
+
+/* pdu_parse_response(): Decode a read holding registers response covering
+ * num_regs registers starting at first_reg into the given pdu. Every block
+ * that is fully contained in the range is parsed, and its bit is set in
+ * *blocks. Only the Modbus frame is inspected, so this can run against any
+ * buffer regardless of where it was received.
+ *
+ * Returns: true if the frame was well-formed, false otherwise, in which case
+ * the cause is stored in *fault.
+ */
+static bool pdu_parse_response(struct pdu *pdu, const uint8_t *buf,
+                               size_t len, uint16_t first_reg,
+                               uint16_t num_regs, int *blocks,
+                               enum modbus_fault *fault) {
   uint8_t modbus_address, modbus_function, modbus_datalen;
-  double last_read_time;
-  double amps_total = 0;
-  double amp_secs_total = 0;
-  int channels_active = 0;
 
-  s_modbus_responses++;
-  if (status != RESP_SUCCESS) {
-    s_modbus_responses_invalid++;
-    LOG(LL_ERROR, ("Invalid response: status=%d", status));
-    return;
+  if (len < 3 + (size_t) num_regs * 2) {
+    LOG(LL_ERROR, ("Invalid response: length=%d", (int) len));
+    *fault = MODBUS_FAULT_LENGTH;
+    return false;
   }
-  modbus_address = response.buf[0];
-  modbus_function = response.buf[1];
-  modbus_datalen = response.buf[2];
-  if (modbus_address != 1 || modbus_function != 3 || modbus_datalen != 0x70) {
-    s_modbus_responses_invalid++;
+  modbus_address = buf[0];
+  modbus_function = buf[1];
+  modbus_datalen = buf[2];
+  if (modbus_address != pdu->modbus_address || modbus_function != 3 ||
+      modbus_datalen != num_regs * 2) {
     LOG(LL_ERROR, ("Invalid response: address=%d function=%d datalen=%d",
                    modbus_address, modbus_function, modbus_datalen));
-    return;
+    if (modbus_address != pdu->modbus_address)
+      *fault = MODBUS_FAULT_ADDRESS;
+    else if (modbus_function != 3)
+      *fault = MODBUS_FAULT_FUNCTION;
+    else
+      *fault = MODBUS_FAULT_LENGTH;
+    return false;
+  }
+  *blocks = 0;
+  for (int b = 0; b < PDU_NUM_BLOCKS; b++) {
+    const struct pdu_block *block = &s_pdu_blocks[b];
+    if (block->first_reg < first_reg ||
+        block->first_reg + block->num_regs > first_reg + num_regs)
+      continue;
+    block->parse(pdu, buf + 3 + (block->first_reg - first_reg) * 2);
+    *blocks |= (1 << b);
   }
-  last_read_time = s_pdu.last_read_time;
-  s_pdu.last_read_time = mg_time();
-  s_pdu.pdu_version = (response.buf[3] << 8) + response.buf[4];
-  s_pdu.pdu_current_range[0] = (response.buf[5] << 8) + response.buf[6];
-  s_pdu.pdu_current_range[1] = (response.buf[7] << 8) + response.buf[8];
-  s_pdu.pdu_build_month = response.buf[11];
-  s_pdu.pdu_build_year = response.buf[12];
-  LOG(LL_DEBUG, ("Response: PDU version %d (build %d.%d, range=(%dA,%dA))",
-                 s_pdu.pdu_version, s_pdu.pdu_build_year, s_pdu.pdu_build_month,
-                 s_pdu.pdu_current_range[0], s_pdu.pdu_current_range[1]));
-
   for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
-    s_pdu.pdu_channel[i].raw_current =
-        (response.buf[(8 + i) * 2 + 3] << 8) + response.buf[(8 + i) * 2 + 4];
-    s_pdu.pdu_channel[i].raw_frequency =
-        (response.buf[(24 + i) * 2 + 3] << 8) + response.buf[(24 + i) * 2 + 4];
-    s_pdu.pdu_channel[i].raw_ratio =
-        (response.buf[(40 + i) * 2 + 3] << 8) + response.buf[(40 + i) * 2 + 4];
     LOG(LL_DEBUG,
-        ("Channel %d: current=%d freq=%d ratio=%d", i,
-         s_pdu.pdu_channel[i].raw_current, s_pdu.pdu_channel[i].raw_frequency,
-         s_pdu.pdu_channel[i].raw_ratio));
-  }
-  double delta = s_pdu.last_read_time - last_read_time;
-  if (delta > 3 * mgos_sys_config_get_pdu_modbus_interval()) {
-    LOG(LL_WARN,
-        ("Modbus last read was %.f seconds ago, considering stale", delta));
-    return;
+        ("Address %d channel %d: current=%d freq=%d ratio=%d",
+         pdu->modbus_address, i,
+         pdu->pdu_channel[i].raw_current, pdu->pdu_channel[i].raw_frequency,
+         pdu->pdu_channel[i].raw_ratio));
   }
-  amp_secs_total = 0;
-  channels_active = 0;
+  return true;
+}
+
+/* pdu_integrate(): Add delta_ms milliseconds worth of the last read current to
+ * the cumulative counters of every channel in the given pdu. This is integer
+ * only, so the counters do not lose resolution as they grow.
+ */
+static void pdu_integrate(struct pdu *pdu, uint32_t delta_ms) {
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+    pdu->pdu_channel[i].centiamp_msecs_total +=
+        (uint64_t) pdu->pdu_channel[i].raw_current * delta_ms;
+}
+
+// Log the total current, power and energy of the given pdu.
+static void pdu_log_totals(const struct pdu *pdu) {
+  uint32_t centiamps_total = 0;
+  uint64_t centiamp_msecs_total = 0;
+  int channels_active = 0;
+
   for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
-    double amp_secs;
-    amp_secs = s_pdu.pdu_channel[i].raw_current * 0.01 * delta;
-    amps_total += s_pdu.pdu_channel[i].raw_current * 0.01;
-    s_pdu.pdu_channel[i].ampere_seconds_total += amp_secs;
-    amp_secs_total += s_pdu.pdu_channel[i].ampere_seconds_total;
-    if (s_pdu.pdu_channel[i].raw_frequency > 0 ||
-        s_pdu.pdu_channel[i].raw_current > 0)
+    centiamps_total += pdu->pdu_channel[i].raw_current;
+    centiamp_msecs_total += pdu->pdu_channel[i].centiamp_msecs_total;
+    if (pdu->pdu_channel[i].raw_frequency > 0 ||
+        pdu->pdu_channel[i].raw_current > 0)
       channels_active++;
   }
-  LOG(LL_INFO, ("PDU: channels=%d on=%d I=%.2fA P=%.2fW Pcum=%.2fkWh",
-                PDU_NUM_CHANNELS, channels_active, amps_total,
-                amps_total * PDU_VOLTAGE, ampsecs2kwh(amp_secs_total)));
+  LOG(LL_INFO, ("PDU %d: channels=%d on=%d I=%.2fA P=%.2fW Pcum=%.2fkWh",
+                pdu->modbus_address, PDU_NUM_CHANNELS, channels_active,
+                centiamps_total * 0.01,
+                centiamps_total * 0.01 * PDU_VOLTAGE,
+                cams2kwh(centiamp_msecs_total)));
+}
+
+/* modbus_adapt_interval(): Pick the next polling interval from the largest
+ * current change seen on any channel of any sensor since the previous poll.
+ * If it exceeds pdu.modbus_adaptive_threshold Ampere, drop to
+ * pdu.modbus_interval_min_ms, otherwise stretch the interval by half up to
+ * pdu.modbus_interval seconds. The bounds are read from the config on every
+ * poll, so they can be changed at runtime.
+ */
+static void modbus_adapt_interval(void) {
+  int max_ms = 1000 * mgos_sys_config_get_pdu_modbus_interval();
+  int min_ms = mgos_sys_config_get_pdu_modbus_interval_min_ms();
+  int threshold =
+      (int) (mgos_sys_config_get_pdu_modbus_adaptive_threshold() * 100);
+
+  if (min_ms <= 0 || min_ms > max_ms) min_ms = max_ms;
+  if (threshold <= 0) {
+    s_modbus_interval_ms = max_ms;
+  } else if (s_modbus_change > threshold) {
+    s_modbus_interval_ms = min_ms;
+  } else {
+    s_modbus_interval_ms += s_modbus_interval_ms / 2;
+  }
+  if (s_modbus_interval_ms < min_ms) s_modbus_interval_ms = min_ms;
+  if (s_modbus_interval_ms > max_ms) s_modbus_interval_ms = max_ms;
+  LOG(LL_DEBUG, ("Modbus interval %dms (max change %d.%02dA)",
+                 s_modbus_interval_ms, s_modbus_change / 100,
+                 s_modbus_change % 100));
+  s_modbus_change = 0;
+}
+
+// Track the largest current change of any channel since the previous poll.
+static void modbus_track_change(struct pdu_device *dev,
+                                const struct pdu *frame) {
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+    int d = frame->pdu_channel[i].raw_current - dev->last_current[i];
+    if (d < 0) d = -d;
+    if (d > s_modbus_change) s_modbus_change = d;
+    dev->last_current[i] = frame->pdu_channel[i].raw_current;
+  }
+}
+
+// Map a non-successful mb library status to a fault.
+static enum modbus_fault modbus_status_fault(uint8_t status) {
+  switch (status) {
+    case RESP_TIMED_OUT:
+      return MODBUS_FAULT_TIMEOUT;
+    case RESP_INVALID_CRC:
+      return MODBUS_FAULT_CRC;
+    case RESP_INVALID_SLAVE_ID:
+      return MODBUS_FAULT_ADDRESS;
+    case RESP_INVALID_FUNCTION:
+      return MODBUS_FAULT_FUNCTION;
+    default:
+      return MODBUS_FAULT_OTHER;
+  }
+}
+
+static void modbus_count_fault(enum modbus_fault fault) {
+  s_modbus_stats.responses_invalid++;
+  s_modbus_stats.faults[fault]++;
+}
+
+// Add the round-trip time of the request on the bus to the histogram.
+static void modbus_track_latency(void) {
+  int64_t us = mgos_uptime_micros() - s_modbus_request_us;
+  uint32_t latency_us = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : us;
+  int b;
+
+  for (b = 0; b < MODBUS_LATENCY_BUCKETS - 1; b++)
+    if (latency_us <= s_modbus_latency_bucket_ms[b] * 1000) break;
+  s_modbus_stats.latency_buckets[b]++;
+  if (s_modbus_stats.latency_count == 0 ||
+      latency_us < s_modbus_stats.latency_min_us)
+    s_modbus_stats.latency_min_us = latency_us;
+  if (latency_us > s_modbus_stats.latency_max_us)
+    s_modbus_stats.latency_max_us = latency_us;
+  s_modbus_stats.latency_total_us += latency_us;
+  s_modbus_stats.latency_count++;
+}
+
+/* modbus_publish(): Make the current state of the given sensor visible to
+ * readers as one consistent frame, and mirror it into RTC memory. Callers hold
+ * s_modbus_lock, so there is one writer at a time, and it never waits for a
+ * reader.
+ */
+static void modbus_publish(int device) {
+  struct pdu_device *dev = &s_devices[device];
+  uint32_t seq = dev->frame_seq;
+
+  __atomic_store_n(&dev->frame_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&dev->frame[((seq >> 1) + 1) & 1], &dev->pdu, sizeof(struct pdu));
+  __atomic_store_n(&dev->frame_seq, seq + 2, __ATOMIC_RELEASE);
+
+  retain_write(device, &dev->pdu);
+}
+
+/* modbus_frame_read(): Copy len bytes at offset from the newest frame of the
+ * given sensor. The copy is retried only if the writer started on that very
+ * buffer meanwhile, which takes two publishes during one copy.
+ */
+static void modbus_frame_read(const struct pdu_device *dev, size_t offset,
+                              void *buf, size_t len) {
+  uint32_t seq, seq_after;
+
+  do {
+    seq = __atomic_load_n(&dev->frame_seq, __ATOMIC_ACQUIRE);
+    memcpy(buf, (const uint8_t *) &dev->frame[(seq >> 1) & 1] + offset, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq_after = __atomic_load_n(&dev->frame_seq, __ATOMIC_RELAXED);
+  } while (seq_after - (seq & ~1u) >= 3);
+}
+
+static void modbus_poll_device(int device);
+
+static void modbus_poll_next(void *arg) {
+  modbus_poll_device(s_poll_device + 1);
+}
+
+/* pdu_device_sample(): Parse a valid response into the state of dev and, if it
+ * holds the current block, integrate it over the time since the previous
+ * sample. This is everything that moves the energy counters, shared by live
+ * responses and modbus_replay(). *delta_ms is set to the milliseconds
+ * integrated over, or -1 if nothing was integrated.
+ *
+ * Returns: true if the frame was well-formed, false otherwise, in which case
+ * the cause is stored in *fault.
+ */
+static bool pdu_device_sample(struct pdu_device *dev,
+                              const struct modbus_response *resp, int *blocks,
+                              int64_t *delta_ms, enum modbus_fault *fault) {
+  double last_read_time;
+
+  *delta_ms = -1;
+  if (!pdu_parse_response(&dev->pdu, resp->buf, resp->len, resp->first_reg,
+                          resp->num_regs, blocks, fault)) {
+    *blocks = 0;
+    return false;
+  }
+  if (!(*blocks & (1 << PDU_BLOCK_CURRENT))) return true;
+
+  // Integrate over the monotonic time between samples, so that neither bus
+  // and event loop latency nor wall clock steps end up in the energy. Only
+  // the first sample after boot has to fall back to the wall clock.
+  last_read_time = dev->pdu.last_read_time;
+  dev->pdu.last_read_time = resp->sample_time;
+  if (dev->last_sample_us > 0) {
+    *delta_ms = (resp->sample_us - dev->last_sample_us) / 1000;
+    // Carry the sub-millisecond remainder over to the next sample, rather
+    // than losing half a millisecond per poll to truncation.
+    dev->last_sample_us += *delta_ms * 1000;
+  } else {
+    *delta_ms = (int64_t) ((dev->pdu.last_read_time - last_read_time) * 1000);
+    dev->last_sample_us = resp->sample_us;
+  }
+  if (*delta_ms < 0 ||
+      *delta_ms > 3000 * mgos_sys_config_get_pdu_modbus_interval()) {
+    LOG(LL_WARN, ("Modbus address %d last read was %.f seconds ago, "
+                  "considering stale",
+                  dev->pdu.modbus_address, *delta_ms / 1000.));
+    dev->last_sample_us = resp->sample_us;
+    *delta_ms = -1;
+    return true;
+  }
+  pdu_integrate(&dev->pdu, (uint32_t) *delta_ms);
+  return true;
+}
+
+/* modbus_process(): Parse a response into the state of its sensor, integrate
+ * the readings and publish the new frame. This runs on the Modbus task if it
+ * is enabled, and never touches anything owned by the event loop; what is
+ * left to do there is described in *res, for modbus_apply().
+ */
+static void modbus_process(const struct modbus_response *resp,
+                           struct modbus_result *res) {
+  struct pdu_device *dev = &s_devices[resp->device];
+  enum modbus_fault fault;
+
+  res->device = resp->device;
+  res->sample_us = resp->sample_us;
+  res->blocks = 0;
+  res->fault = -1;
+  res->stale = false;
+  res->delta_ms = -1;
+  if (resp->status != RESP_SUCCESS) {
+    res->fault = modbus_status_fault(resp->status);
+    LOG(LL_ERROR, ("Invalid response from address %d: status=%d (%s)",
+                   dev->pdu.modbus_address, resp->status,
+                   modbus_fault_name(res->fault)));
+    return;
+  }
+
+  mgos_rlock(s_modbus_lock);
+  if (!pdu_device_sample(dev, resp, &res->blocks, &res->delta_ms, &fault))
+    res->fault = fault;
+  else if (res->delta_ms >= 0)
+    pdu_log_totals(&dev->pdu);
+  else if (res->blocks & (1 << PDU_BLOCK_CURRENT))
+    res->stale = true;
+  if (res->blocks) modbus_publish(resp->device);
+  mgos_runlock(s_modbus_lock);
+}
+
+/* modbus_apply_current(): Update the adaptive interval, statistics and
+ * rollups from the published frame of a sensor whose current was read, and
+ * evaluate its alerts.
+ */
+static void modbus_apply_current(const struct modbus_result *res) {
+  static struct pdu frame;
+  struct pdu_device *dev = &s_devices[res->device];
+
+  modbus_snapshot(res->device, &frame);
+  modbus_track_change(dev, &frame);
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+    uint8_t chan = res->device * PDU_NUM_CHANNELS + i;
+    uint16_t raw_current = frame.pdu_channel[i].raw_current;
+    stats_update(chan, frame.last_read_time, raw_current);
+    if (res->delta_ms < 0) continue;
+    rollup_update(chan, frame.last_read_time, raw_current,
+                  (uint64_t) raw_current * res->delta_ms);
+  }
+  alert_update(res->device, &frame, res->sample_us);
+  tsdb_append(res->device, &frame);
+}
+
+/* modbus_apply(): Finish handling a processed response on the event loop:
+ * count faults and stale readings, update the read schedule, apply a current
+ * reading, and update the metrics once per poll cycle. All of s_modbus_stats
+ * is only written here and elsewhere on the event loop, never from the Modbus
+ * task.
+ */
+static void modbus_apply(const struct modbus_result *res) {
+  struct pdu_device *dev = &s_devices[res->device];
+
+  if (res->fault >= 0) modbus_count_fault(res->fault);
+  if (res->stale) s_modbus_stats.stale_skips++;
+
+  for (int b = 0; b < PDU_NUM_BLOCKS; b++)
+    if (res->blocks & (1 << b)) dev->block_last_read[b] = mgos_uptime();
+  if (res->blocks & (1 << PDU_BLOCK_CURRENT)) modbus_apply_current(res);
+
+  // The exposition covers every sensor, so render it once the response of
+  // the last one in the poll cycle has been handled, whatever its outcome.
+  if (res->device == s_num_devices - 1) prometheus_update();
+}
+
+#if CS_PLATFORM == CS_P_ESP32 || defined(PDU_HOST)
+static QueueHandle_t s_modbus_responses = NULL;
+static QueueHandle_t s_modbus_results = NULL;
+
+static void modbus_results_cb(void *arg) {
+  struct modbus_result res;
+  int64_t start_us;
+
+  while (xQueueReceive(s_modbus_results, &res, 0) == pdTRUE) {
+    start_us = mgos_uptime_micros();
+    modbus_apply(&res);
+    budget_time(BUDGET_SECTION_POLL, start_us);
+  }
+}
+
+static void modbus_task(void *arg) {
+  struct modbus_response resp;
+  struct modbus_result res;
+
+  for (;;) {
+    if (xQueueReceive(s_modbus_responses, &resp, portMAX_DELAY) != pdTRUE)
+      continue;
+    modbus_process(&resp, &res);
+    if (xQueueSend(s_modbus_results, &res, portMAX_DELAY) == pdTRUE)
+      mgos_invoke_cb(modbus_results_cb, NULL, false);
+  }
+}
+
+/* modbus_task_start(): Create the queues and the Modbus task, pinned to the
+ * given core.
+ *
+ * Returns: true if successful, false otherwise.
+ */
+static bool modbus_task_start(int core) {
+  TaskHandle_t task;
+
+  s_modbus_responses =
+      xQueueCreate(MODBUS_QUEUE_LEN, sizeof(struct modbus_response));
+  s_modbus_results =
+      xQueueCreate(MODBUS_QUEUE_LEN, sizeof(struct modbus_result));
+  if (!s_modbus_responses || !s_modbus_results) goto err;
+  if (xTaskCreatePinnedToCore(modbus_task, "modbus", MODBUS_TASK_STACK_SIZE,
+                              NULL, MODBUS_TASK_PRIORITY, &task,
+                              core) != pdPASS)
+    goto err;
+  budget_register_task("modbus", task);
+  LOG(LL_INFO, ("Modbus task running on core %d", core));
+  return true;
+
+err:
+  if (s_modbus_responses) vQueueDelete(s_modbus_responses);
+  if (s_modbus_results) vQueueDelete(s_modbus_results);
+  s_modbus_responses = NULL;
+  s_modbus_results = NULL;
+  return false;
+}
+
+static bool modbus_task_enabled(void) {
+  return s_modbus_responses != NULL;
+}
+
+/* modbus_task_submit(): Hand a response to the Modbus task.
+ *
+ * Returns: true if it was queued, false if the queue was full.
+ */
+static bool modbus_task_submit(const struct modbus_response *resp) {
+  if (xQueueSend(s_modbus_responses, resp, 0) == pdTRUE) return true;
+  LOG(LL_ERROR, ("Modbus task queue full, dropping response from address %d",
+                 s_devices[resp->device].pdu.modbus_address));
+  return false;
+}
+#else
+static bool modbus_task_start(int core) {
+  LOG(LL_ERROR, ("Modbus task is not supported on this platform"));
+  return false;
+}
+
+static bool modbus_task_enabled(void) {
+  return false;
+}
+
+static bool modbus_task_submit(const struct modbus_response *resp) {
+  return false;
+}
+#endif
+
+/* modbus_sample_time(): Set the monotonic and wall clock time of the sample in
+ * resp from when its request was sent and its response was received.
+ */
+static void modbus_sample_time(struct modbus_response *resp,
+                               int64_t request_us, int64_t response_us,
+                               double response_time) {
+  // The sensor answers a request somewhere between sending it and receiving
+  // the response; take the middle as the time of the sample.
+  resp->sample_us = request_us + (response_us - request_us) / 2;
+  resp->sample_time = response_time - (response_us - resp->sample_us) / 1e6;
+}
+
+static void mb_read_response_handler(uint8_t status,
+                                     struct mb_request_info mb_ri,
+                                     struct mbuf response, void *param) {
+  struct modbus_response resp;
+  struct modbus_result res;
+  int64_t now_us = mgos_uptime_micros();
+  double now = mg_time();
+
+  modbus_sample_time(&resp, s_modbus_request_us, now_us, now);
+  resp.device = ((uintptr_t) param) >> 16;
+  resp.first_reg = (((uintptr_t) param) >> 8) & 0xff;
+  resp.num_regs = ((uintptr_t) param) & 0xff;
+  resp.status = status;
+  resp.len = response.len < sizeof(resp.buf) ? response.len : sizeof(resp.buf);
+  memcpy(resp.buf, response.buf, resp.len);
+  rawlog_push(s_devices[resp.device].pdu.modbus_address, status,
+              resp.first_reg, resp.num_regs,
+              now - (now_us - s_modbus_request_us) / 1e6, now, response.buf,
+              response.len);
+  trace_push(s_devices[resp.device].pdu.modbus_address, status,
+             resp.first_reg, resp.num_regs, s_modbus_request_us, now_us, now,
+             response.buf, response.len);
+
+  // Poll the next sensor from the event loop, once the bus is released.
+  if (resp.device == s_poll_device)
+    mgos_invoke_cb(modbus_poll_next, NULL, false);
+
+  s_modbus_stats.responses++;
+  // A timed out request has no meaningful round-trip time.
+  if (status != RESP_TIMED_OUT) modbus_track_latency();
+
+  if (!modbus_task_enabled()) {
+    modbus_process(&resp, &res);
+    modbus_apply(&res);
+  } else if (!modbus_task_submit(&resp)) {
+    // Handling it here would integrate it ahead of the older responses still
+    // queued for the task, so it is dropped. The next reading of the sensor
+    // integrates over the time since the last one that was handled.
+    s_modbus_stats.task_drops++;
+  }
+  budget_time(BUDGET_SECTION_POLL, now_us);
+}
+
+static bool pdu_block_due(const struct pdu_device *dev, int b, double now) {
+  const struct pdu_block *block = &s_pdu_blocks[b];
+  if (!block->interval || dev->block_last_read[b] == 0) return true;
+  return now - dev->block_last_read[b] >= block->interval();
+}
+
+/* modbus_poll_device(): Send the read request for the given sensor. Sensors
+ * are polled back-to-back: each response handler schedules the next one, so
+ * only one request is on the bus at any time.
+ */
+static void modbus_poll_device(int device) {
+  const struct pdu_block *current = &s_pdu_blocks[PDU_BLOCK_CURRENT];
+  uint16_t first_reg = current->first_reg;
+  uint16_t last_reg = current->first_reg + current->num_regs;
+  double now = mgos_uptime();
+  struct pdu_device *dev;
+  uintptr_t param;
+
+  if (device >= s_num_devices) {
+    s_poll_device = -1;
+    return;
+  }
+  s_poll_device = device;
+  dev = &s_devices[device];
+
+  for (int b = 0; b < PDU_NUM_BLOCKS; b++) {
+    const struct pdu_block *block = &s_pdu_blocks[b];
+    if (!pdu_block_due(dev, b, now)) continue;
+    if (block->first_reg < first_reg) first_reg = block->first_reg;
+    if (block->first_reg + block->num_regs > last_reg)
+      last_reg = block->first_reg + block->num_regs;
+  }
+  LOG(LL_DEBUG, ("Reading modbus address %d holding registers %d..%d",
+                 dev->pdu.modbus_address, first_reg, last_reg - 1));
+  s_modbus_stats.reads++;
+  s_modbus_request_us = mgos_uptime_micros();
+  param = (device << 16) | (first_reg << 8) | (last_reg - first_reg);
+  if (!mb_read_holding_registers(dev->pdu.modbus_address, first_reg,
+                                 last_reg - first_reg, mb_read_response_handler,
+                                 (void *) param)) {
+    LOG(LL_ERROR, ("Could not send request to address %d",
+                   dev->pdu.modbus_address));
+    s_modbus_stats.send_failures++;
+    s_poll_device = -1;
+  }
+}
+
+/* modbus_next_deadline(): Return the monotonic deadline interval_ms after the
+ * given one. With pdu.modbus_phase_align, and once the wall clock is set, the
+ * deadline is snapped to the nearest multiple of the interval in wall clock
+ * time, so that devices in a fleet poll at the same moments. Deadlines that
+ * have already passed are skipped, rather than polled back-to-back.
+ */
+static int64_t modbus_next_deadline(int64_t deadline_us, int interval_ms) {
+  int64_t interval_us = (int64_t) interval_ms * 1000;
+  int64_t now_us = mgos_uptime_micros();
+  int64_t next_us = deadline_us + interval_us;
+  double now = mg_time();
+
+  if (mgos_sys_config_get_pdu_modbus_phase_align() && now > 1e9) {
+    int64_t wall_us = (int64_t) ((now + (next_us - now_us) / 1e6) * 1e6);
+    int64_t offset_us = wall_us % interval_us;
+    next_us -= offset_us;
+    if (offset_us > interval_us / 2) next_us += interval_us;
+  }
+  if (next_us <= now_us) {
+    int64_t missed = (now_us - next_us) / interval_us + 1;
+    s_modbus_stats.missed_deadlines += missed;
+    next_us += missed * interval_us;
+  }
+  return next_us;
+}
+
+static void modbus_timer(void *args);
+
+static void modbus_timer_arm(void) {
+  int64_t wait_us = s_modbus_deadline_us - mgos_uptime_micros();
+  int wait_ms = (int) ((wait_us + 999) / 1000);
+
+  mgos_set_timer(wait_ms > 0 ? wait_ms : 1, 0, modbus_timer, NULL);
 }
 
 static void modbus_timer(void *args) {
-  LOG(LL_DEBUG, ("Reading modbus holding registers"));
-  s_modbus_reads++;
-  mb_read_holding_registers(1, 0, 56, mb_read_response_handler, NULL);
+  if (s_poll_device != -1)
+    LOG(LL_WARN, ("Modbus poll overrun at address %d, restarting",
+                  s_devices[s_poll_device].pdu.modbus_address));
+  modbus_poll_device(0);
+
+  modbus_adapt_interval();
+  s_modbus_deadline_us =
+      modbus_next_deadline(s_modbus_deadline_us, s_modbus_interval_ms);
+  modbus_timer_arm();
+}
+
+static void journal_timer(void *args) {
+  for (int d = 0; d < s_num_devices; d++) {
+    struct pdu_device *dev = &s_devices[d];
+    if (0 == strlen(dev->pdu.state_filename)) continue;
+
+    mgos_rlock(s_modbus_lock);
+    journal_append(&dev->journal, dev->pdu.state_filename, &dev->pdu,
+                   mgos_sys_config_get_pdu_state_journal_records());
+    mgos_runlock(s_modbus_lock);
+  }
 }
 
 static void state_timer(void *args) {
-  if (0 == strlen(s_pdu.state_filename)) return;
+  LOG(LL_INFO, ("Persisting state"));
+  modbus_state_write();
+}
 
-  LOG(LL_INFO, ("Persisting state to %s", s_pdu.state_filename));
+// Persist all state before a scheduled reboot or an OTA update, so that no
+// energy is lost since the last state_timer or journal_timer run.
+static void modbus_reboot_handler(int ev, void *ev_data, void *userdata) {
+  LOG(LL_INFO, ("Persisting state before %s",
+                ev == MGOS_EVENT_OTA_BEGIN ? "OTA update" : "reboot"));
   modbus_state_write();
 }
 
+static bool modbus_device_state_read(struct pdu_device *dev,
+                                     const char *state_filename);
+static bool modbus_device_state_write(struct pdu_device *dev);
+
+/* modbus_device_retain_restore(): Replace the state of sensor d read from flash
+ * with its RTC copy if that copy is newer, which is the case after a soft
+ * reset, and persist it right away.
+ */
+static void modbus_device_retain_restore(int d) {
+  struct pdu_device *dev = &s_devices[d];
+  struct pdu rtc_pdu;
+
+  if (!retain_read(d, &rtc_pdu)) return;
+  if (rtc_pdu.modbus_address != dev->pdu.modbus_address ||
+      0 != strncmp(rtc_pdu.state_filename, dev->pdu.state_filename,
+                   sizeof(rtc_pdu.state_filename))) {
+    retain_invalidate(d);
+    return;
+  }
+  if (rtc_pdu.last_read_time <= dev->pdu.last_read_time) return;
+
+  LOG(LL_INFO, ("Restoring state of address %d from RTC memory, %.f seconds "
+                "newer than %s",
+                dev->pdu.modbus_address,
+                rtc_pdu.last_read_time - dev->pdu.last_read_time,
+                dev->pdu.state_filename));
+  rtc_pdu.modbus_read_secs = dev->pdu.modbus_read_secs;
+  rtc_pdu.state_write_hours = dev->pdu.state_write_hours;
+  memcpy(&dev->pdu, &rtc_pdu, sizeof(struct pdu));
+  modbus_device_state_write(dev);
+}
+
+/* modbus_boot_state_read(): Read the state of every sensor from flash, or its
+ * newer RTC copy, and publish it. Unlike modbus_state_read(), nothing is
+ * published before the RTC copy has been compared, as publishing mirrors the
+ * state into RTC memory and would overwrite that copy.
+ */
+static void modbus_boot_state_read(const char *state_filename) {
+  for (int d = 0; d < s_num_devices; d++) {
+    mgos_rlock(s_modbus_lock);
+    modbus_device_state_read(&s_devices[d], state_filename);
+    modbus_device_retain_restore(d);
+    modbus_publish(d);
+    mgos_runlock(s_modbus_lock);
+  }
+}
+
+// Parse the comma separated list of slave addresses in pdu.modbus_addresses.
+static int modbus_parse_addresses(uint8_t *addresses, int max) {
+  const char *p = mgos_sys_config_get_pdu_modbus_addresses();
+  int n = 0;
+
+  while (p && *p && n < max) {
+    char *end;
+    long address = strtol(p, &end, 10);
+    if (end == p) break;
+    if (address < 1 || address > 247) {
+      LOG(LL_ERROR, ("Ignoring invalid modbus address %ld", address));
+    } else {
+      addresses[n++] = address;
+    }
+    p = end;
+    while (*p == ',' || *p == ' ') p++;
+  }
+  return n;
+}
+
+static void modbus_device_filename(char *buf, size_t len,
+                                   const char *state_filename,
+                                   uint8_t address) {
+  if (address == 1) {
+    snprintf(buf, len, "%s", state_filename);
+  } else {
+    snprintf(buf, len, "%s.%d", state_filename, address);
+  }
+}
+
 bool modbus_init(uint16_t modbus_read_secs, uint16_t state_write_hours,
                  const char *state_filename) {
+  uint8_t addresses[PDU_MAX_DEVICES];
+
+  if (!s_modbus_lock) s_modbus_lock = mgos_rlock_create();
   if (!mgos_modbus_connect()) {
     LOG(LL_INFO, ("Unable to connect MODBUS"));
     return false;
   }
-  memset(&s_pdu, 0, sizeof(struct pdu));
-
-  strncpy(s_pdu.state_filename, state_filename, sizeof(s_pdu.state_filename));
-  modbus_state_read(state_filename);
+  memset(s_devices, 0, sizeof(s_devices));
+  s_num_devices = modbus_parse_addresses(addresses, PDU_MAX_DEVICES);
+  if (s_num_devices == 0) {
+    LOG(LL_ERROR, ("No modbus addresses configured"));
+    return false;
+  }
+  for (int d = 0; d < s_num_devices; d++) {
+    struct pdu *pdu = &s_devices[d].pdu;
+    pdu->modbus_address = addresses[d];
+    modbus_device_filename(pdu->state_filename, sizeof(pdu->state_filename),
+                           state_filename, addresses[d]);
+    pdu->modbus_read_secs = modbus_read_secs;
+    pdu->state_write_hours = state_write_hours;
+  }
+  modbus_boot_state_read(state_filename);
 
-  s_pdu.modbus_read_secs = modbus_read_secs;
-  mgos_set_timer(1000 * s_pdu.modbus_read_secs, MGOS_TIMER_REPEAT, modbus_timer,
-                 NULL);
+  s_modbus_interval_ms = 1000 * modbus_read_secs;
+  s_modbus_deadline_us =
+      modbus_next_deadline(mgos_uptime_micros(), s_modbus_interval_ms);
+  modbus_timer_arm();
 
-  s_pdu.state_write_hours = state_write_hours;
-  mgos_set_timer(1000 * 3600 * s_pdu.state_write_hours, MGOS_TIMER_REPEAT,
+  mgos_set_timer(1000 * 3600 * state_write_hours, MGOS_TIMER_REPEAT,
                  state_timer, NULL);
+
+  if (mgos_sys_config_get_pdu_state_journal_interval() > 0)
+    mgos_set_timer(1000 * mgos_sys_config_get_pdu_state_journal_interval(),
+                   MGOS_TIMER_REPEAT, journal_timer, NULL);
+
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, modbus_reboot_handler, NULL);
+  mgos_event_add_handler(MGOS_EVENT_OTA_BEGIN, modbus_reboot_handler, NULL);
+
+  if (mgos_sys_config_get_pdu_modbus_task() &&
+      !modbus_task_start(mgos_sys_config_get_pdu_modbus_task_core()))
+    LOG(LL_ERROR, ("Could not start Modbus task, using the event loop"));
   return true;
 }
 
-bool modbus_state_read(const char *state_filename) {
+// Read a single-file state as written before the journal was introduced.
+static bool modbus_state_read_legacy(const char *state_filename,
+                                     struct pdu *new_pdu) {
   int fd;
-  struct pdu new_pdu;
   struct stat stat;
   int bytes_read = -1;
   bool ret = false;
 
-  if (!state_filename) return false;
-
-  LOG(LL_INFO, ("Reading state from %s", state_filename));
   fd = open(state_filename, O_RDONLY);
   if (fd < 0) {
     LOG(LL_ERROR,
@@ -158,105 +910,358 @@ bool modbus_state_read(const char *state_filename) {
                    state_filename, (int) stat.st_size, sizeof(struct pdu)));
     goto exit;
   }
-  bytes_read = read(fd, &new_pdu, sizeof(struct pdu));
+  bytes_read = read(fd, new_pdu, sizeof(struct pdu));
   if (bytes_read != sizeof(struct pdu)) {
     LOG(LL_ERROR, ("%s: Short read(), wanted %d got %d", state_filename,
                    sizeof(struct pdu), bytes_read));
     goto exit;
   }
-  if (0 != memcmp(&new_pdu.state_filename, &s_pdu.state_filename,
-                  strlen(s_pdu.state_filename))) {
+  ret = true;
+exit:
+  if (fd >= 0) close(fd);
+  return ret;
+}
+
+// Convert the state file written by firmware that integrated in floating
+// point. It has the same layout, except that each channel holds a double of
+// ampere seconds where centiamp_msecs_total is now.
+static bool modbus_state_read_v0(struct pdu *new_pdu,
+                                 const char *state_filename) {
+  double ampere_seconds_total;
+
+  if (!modbus_state_read_legacy(STATE_FILENAME_V0, new_pdu)) return false;
+  if (0 != strncmp(new_pdu->state_filename, STATE_FILENAME_V0,
+                   sizeof(new_pdu->state_filename))) {
     LOG(LL_ERROR, ("%s: Read state filename '%s' does not correspond",
-                   state_filename, new_pdu.state_filename));
-    goto exit;
+                   STATE_FILENAME_V0, new_pdu->state_filename));
+    return false;
+  }
+  for (int i = 0; i < PDU_NUM_CHANNELS; i++) {
+    memcpy(&ampere_seconds_total, &new_pdu->pdu_channel[i].centiamp_msecs_total,
+           sizeof(ampere_seconds_total));
+    new_pdu->pdu_channel[i].centiamp_msecs_total =
+        ampere_seconds_total > 0 ? (uint64_t) (ampere_seconds_total * 100000)
+                                 : 0;
+  }
+  strncpy(new_pdu->state_filename, state_filename,
+          sizeof(new_pdu->state_filename));
+  LOG(LL_INFO, ("OK: Converted state from %s", STATE_FILENAME_V0));
+  return true;
+}
+
+static bool modbus_device_state_read(struct pdu_device *dev,
+                                     const char *state_filename) {
+  struct pdu new_pdu;
+  char filename[sizeof(new_pdu.state_filename)];
+
+  modbus_device_filename(filename, sizeof(filename), state_filename,
+                         dev->pdu.modbus_address);
+  LOG(LL_INFO, ("Reading state from %s", filename));
+  if (!journal_read(&dev->journal, filename, &new_pdu) &&
+      !(dev->pdu.modbus_address == 1 &&
+        modbus_state_read_v0(&new_pdu, filename)))
+    return false;
+
+  if (0 != strncmp(new_pdu.state_filename, dev->pdu.state_filename,
+                   sizeof(new_pdu.state_filename))) {
+    LOG(LL_ERROR, ("%s: Read state filename '%s' does not correspond",
+                   filename, new_pdu.state_filename));
+    return false;
   }
 
   // All sanity checks passed, let's consume the state file!
-  memcpy(&s_pdu, &new_pdu, sizeof(struct pdu));
-  LOG(LL_INFO, ("OK: Read state from %s", state_filename));
+  new_pdu.modbus_address = dev->pdu.modbus_address;
+  memcpy(&dev->pdu, &new_pdu, sizeof(struct pdu));
+  LOG(LL_INFO, ("OK: Read state from %s", filename));
+  return true;
+}
 
-  ret = true;
-exit:
-  if (fd >= 0) close(fd);
+bool modbus_state_read(const char *state_filename) {
+  bool ret = true;
+
+  if (!state_filename) return false;
+
+  for (int d = 0; d < s_num_devices; d++) {
+    mgos_rlock(s_modbus_lock);
+    if (!modbus_device_state_read(&s_devices[d], state_filename)) ret = false;
+    modbus_publish(d);
+    mgos_runlock(s_modbus_lock);
+  }
   return ret;
 }
 
-bool modbus_state_write(void) {
-  bool ret = false;
-  int bytes_written = -1;
+static bool modbus_device_state_write(struct pdu_device *dev) {
+  int64_t start_us = mgos_uptime_micros();
   double last_save_time;
-  int fd;
+  bool ret = false;
 
-  if (0 == strlen(s_pdu.state_filename)) return false;
-  last_save_time = s_pdu.last_save_time;
+  if (0 == strlen(dev->pdu.state_filename)) return false;
+  mgos_rlock(s_modbus_lock);
+  last_save_time = dev->pdu.last_save_time;
 
-  LOG(LL_INFO, ("Writing state to %s", s_pdu.state_filename));
-  fd = open(s_pdu.state_filename, O_WRONLY | O_CREAT | O_TRUNC);
-  if (fd < 0) {
-    LOG(LL_ERROR,
-        ("%s: Could not open(): %s", s_pdu.state_filename, strerror(errno)));
+  LOG(LL_INFO, ("Writing state to %s", dev->pdu.state_filename));
+  dev->pdu.last_save_time = mg_time();
+  if (!journal_checkpoint(&dev->journal, dev->pdu.state_filename, &dev->pdu)) {
+    dev->pdu.last_save_time = last_save_time;
     goto exit;
   }
-  s_pdu.last_save_time = mg_time();
-  bytes_written = write(fd, &s_pdu, sizeof(struct pdu));
-  if (bytes_written != sizeof(struct pdu)) {
-    LOG(LL_ERROR, ("%s: Short write(), wanted %d got %d", s_pdu.state_filename,
-                   sizeof(struct pdu), bytes_written));
-    goto exit;
-  }
-  LOG(LL_INFO, ("OK: Wrote state to %s", s_pdu.state_filename));
-
+  LOG(LL_INFO, ("OK: Wrote state to %s", dev->pdu.state_filename));
   ret = true;
+
 exit:
-  if (!ret) s_pdu.last_save_time = last_save_time;
-  if (fd >= 0) close(fd);
+  mgos_runlock(s_modbus_lock);
+  budget_time(BUDGET_SECTION_STATE_WRITE, start_us);
+  return ret;
+}
+
+bool modbus_state_write(void) {
+  bool ret = s_num_devices > 0;
+
+  for (int d = 0; d < s_num_devices; d++)
+    if (!modbus_device_state_write(&s_devices[d])) ret = false;
   return ret;
 }
 
+// Return the sensor that holds the given channel, or NULL if out of range.
+static struct pdu_device *modbus_channel_device(uint8_t chan) {
+  if (chan >= s_num_devices * PDU_NUM_CHANNELS) return NULL;
+  return &s_devices[chan / PDU_NUM_CHANNELS];
+}
+
+#define DEVICE_CHANNEL(dev, chan) \
+  (&(dev)->pdu.pdu_channel[(chan) % PDU_NUM_CHANNELS])
+
+// Copy one channel from the newest published frame of its sensor.
+static bool modbus_channel_read(uint8_t chan, struct pdu_channel *ch) {
+  struct pdu_device *dev = modbus_channel_device(chan);
+  if (!dev) return false;
+  modbus_frame_read(dev,
+                    offsetof(struct pdu, pdu_channel) +
+                        (chan % PDU_NUM_CHANNELS) * sizeof(struct pdu_channel),
+                    ch, sizeof(struct pdu_channel));
+  return true;
+}
+
 bool modbus_channel_get_freq(uint8_t chan, double *hertz) {
-  if (chan >= PDU_NUM_CHANNELS || !hertz) return false;
-  *hertz = s_pdu.pdu_channel[chan].raw_frequency * 0.1;
+  struct pdu_channel ch;
+  if (!hertz || !modbus_channel_read(chan, &ch)) return false;
+  *hertz = ch.raw_frequency * 0.1;
   return true;
 }
 
 bool modbus_channel_get_current(uint8_t chan, double *amperes) {
-  if (chan >= PDU_NUM_CHANNELS || !amperes) return false;
-  *amperes = s_pdu.pdu_channel[chan].raw_current * 0.01;
+  struct pdu_channel ch;
+  if (!amperes || !modbus_channel_read(chan, &ch)) return false;
+  *amperes = ch.raw_current * 0.01;
   return true;
 }
 
 bool modbus_channel_get_ratio(uint8_t chan, uint16_t *ratio) {
-  if (chan >= PDU_NUM_CHANNELS || !ratio) return false;
-  *ratio = s_pdu.pdu_channel[chan].raw_ratio;
+  struct pdu_channel ch;
+  if (!ratio || !modbus_channel_read(chan, &ch)) return false;
+  *ratio = ch.raw_ratio;
   return true;
 }
 
 bool modbus_channel_get_kwh(uint8_t chan, double *kwh) {
-  if (chan >= PDU_NUM_CHANNELS || !kwh) return false;
-  *kwh = ampsecs2kwh(s_pdu.pdu_channel[chan].ampere_seconds_total);
+  struct pdu_channel ch;
+  if (!kwh || !modbus_channel_read(chan, &ch)) return false;
+  *kwh = cams2kwh(ch.centiamp_msecs_total);
   return true;
 }
 
 bool modbus_channel_get_last_clear(uint8_t chan, double *last_clear) {
-  if (chan >= PDU_NUM_CHANNELS || !last_clear) return false;
-  *last_clear = s_pdu.pdu_channel[chan].last_cleared_time;
+  struct pdu_channel ch;
+  if (!last_clear || !modbus_channel_read(chan, &ch)) return false;
+  *last_clear = ch.last_cleared_time;
   return true;
 }
 
 bool modbus_channel_get_last_read(uint8_t chan, double *last_read) {
-  if (chan >= PDU_NUM_CHANNELS || !last_read) return false;
-  *last_read = s_pdu.last_read_time;
+  struct pdu_device *dev = modbus_channel_device(chan);
+  if (!dev || !last_read) return false;
+  modbus_frame_read(dev, offsetof(struct pdu, last_read_time), last_read,
+                    sizeof(double));
+  return true;
+}
+
+bool modbus_channel_get_address(uint8_t chan, uint8_t *address) {
+  struct pdu_device *dev = modbus_channel_device(chan);
+  if (!dev || !address) return false;
+  *address = dev->pdu.modbus_address;
   return true;
 }
 
 bool modbus_channel_clear(uint8_t chan, bool persist) {
-  if (chan >= PDU_NUM_CHANNELS) return false;
+  struct modbus_channel_op op = {MODBUS_CHANNEL_OP_CLEAR, chan, 0};
 
-  LOG(LL_INFO, ("Clearing counters for channel %d", chan));
-  memset(&s_pdu.pdu_channel[chan], 0, sizeof(struct pdu_channel));
-  s_pdu.pdu_channel[chan].last_cleared_time = mg_time();
+  return modbus_channel_batch(&op, 1, persist, NULL);
+}
 
-  if (persist) return modbus_state_write();
+bool modbus_channel_batch(const struct modbus_channel_op *ops, int num_ops,
+                          bool persist, struct pdu *post) {
+  bool touched[PDU_MAX_DEVICES] = {false};
+  bool changed[PDU_MAX_DEVICES] = {false};
+  struct pdu_device *dev;
+  struct pdu_channel *ch;
+  double now = mg_time();
+  bool ret = true;
+  int i, d;
 
+  if (num_ops < 0 || (num_ops > 0 && !ops)) return false;
+  for (i = 0; i < num_ops; i++) {
+    if (!modbus_channel_device(ops[i].chan) ||
+        ops[i].type > MODBUS_CHANNEL_OP_SET_KWH)
+      return false;
+    if (ops[i].type == MODBUS_CHANNEL_OP_SET_KWH && !(ops[i].kwh >= 0))
+      return false;
+  }
+
+  mgos_rlock(s_modbus_lock);
+  for (i = 0; i < num_ops; i++) {
+    dev = modbus_channel_device(ops[i].chan);
+    ch = DEVICE_CHANNEL(dev, ops[i].chan);
+    d = dev - s_devices;
+    touched[d] = true;
+    switch (ops[i].type) {
+      case MODBUS_CHANNEL_OP_CLEAR:
+        LOG(LL_INFO, ("Clearing counters for channel %d", ops[i].chan));
+        memset(ch, 0, sizeof(struct pdu_channel));
+        ch->last_cleared_time = now;
+        changed[d] = true;
+        break;
+      case MODBUS_CHANNEL_OP_SET_KWH:
+        LOG(LL_INFO, ("Setting counter of channel %d to %.3fkWh", ops[i].chan,
+                      ops[i].kwh));
+        ch->centiamp_msecs_total = kwh2cams(ops[i].kwh);
+        ch->last_cleared_time = now;
+        changed[d] = true;
+        break;
+      default:
+        break;
+    }
+  }
+  for (d = 0; d < s_num_devices; d++) {
+    if (changed[d]) modbus_publish(d);
+    if (post && touched[d])
+      memcpy(&post[d], &s_devices[d].pdu, sizeof(struct pdu));
+  }
+  mgos_runlock(s_modbus_lock);
+
+  for (i = 0; i < num_ops; i++)
+    if (ops[i].type == MODBUS_CHANNEL_OP_CLEAR) stats_reset(ops[i].chan);
+
+  if (!persist) return true;
+  for (d = 0; d < s_num_devices; d++)
+    if (changed[d] && !modbus_device_state_write(&s_devices[d])) ret = false;
+  return ret;
+}
+
+int modbus_num_devices(void) {
+  return s_num_devices;
+}
+
+int modbus_num_channels(void) {
+  return s_num_devices * PDU_NUM_CHANNELS;
+}
+
+bool modbus_snapshot(uint8_t device, struct pdu *pdu) {
+  if (device >= s_num_devices || !pdu) return false;
+  modbus_frame_read(&s_devices[device], 0, pdu, sizeof(struct pdu));
+  return true;
+}
+
+double modbus_centiamp_msecs_to_kwh(uint64_t centiamp_msecs) {
+  return cams2kwh(centiamp_msecs);
+}
+
+bool modbus_get_stats(struct modbus_stats *stats) {
+  if (!stats) return false;
+  memcpy(stats, &s_modbus_stats, sizeof(struct modbus_stats));
+  return true;
+}
+
+const char *modbus_fault_name(enum modbus_fault fault) {
+  if (fault < 0 || fault >= MODBUS_NUM_FAULTS) return "unknown";
+  return s_modbus_fault_names[fault];
+}
+
+uint32_t modbus_latency_bucket_ms(int bucket) {
+  if (bucket < 0 || bucket >= MODBUS_LATENCY_BUCKETS) return 0;
+  return s_modbus_latency_bucket_ms[bucket];
+}
+
+#ifdef PDU_HOST
+struct modbus_replay_ctx {
+  struct pdu_device *devices;
+  int64_t last_response_us;
+  struct modbus_replay *replay;
+};
+
+static bool modbus_replay_record(const struct trace_record *rec,
+                                 const uint8_t *buf, void *arg) {
+  struct modbus_replay_ctx *ctx = (struct modbus_replay_ctx *) arg;
+  struct modbus_response resp;
+  enum modbus_fault fault;
+  int64_t delta_ms;
+  int blocks;
+  int d;
+
+  ctx->replay->frames++;
+  // Uptime going backwards means the device rebooted, after which the first
+  // sample is integrated from the wall clock, as it is live.
+  if (rec->response_us < ctx->last_response_us)
+    for (d = 0; d < s_num_devices; d++) ctx->devices[d].last_sample_us = 0;
+  ctx->last_response_us = rec->response_us;
+
+  for (d = 0; d < s_num_devices; d++)
+    if (ctx->devices[d].pdu.modbus_address == rec->addr) break;
+  if (d == s_num_devices) {
+    ctx->replay->skipped++;
+    return true;
+  }
+  if (rec->status != RESP_SUCCESS) {
+    ctx->replay->invalid++;
+    return true;
+  }
+
+  resp.device = d;
+  resp.status = rec->status;
+  resp.first_reg = rec->first_reg;
+  resp.num_regs = rec->num_regs;
+  resp.len = rec->len < sizeof(resp.buf) ? rec->len : sizeof(resp.buf);
+  memcpy(resp.buf, buf, resp.len);
+  modbus_sample_time(&resp, rec->request_us, rec->response_us,
+                     rec->response_time);
+  if (!pdu_device_sample(&ctx->devices[d], &resp, &blocks, &delta_ms, &fault))
+    ctx->replay->invalid++;
+  else if (delta_ms < 0 && (blocks & (1 << PDU_BLOCK_CURRENT)))
+    ctx->replay->stale_skips++;
   return true;
 }
+
+bool modbus_replay(const char *filename, struct modbus_replay *replay) {
+  struct modbus_replay_ctx ctx;
+  bool ret;
+
+  if (!replay) return false;
+  memset(replay, 0, sizeof(struct modbus_replay));
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.replay = replay;
+  ctx.devices = calloc(PDU_MAX_DEVICES, sizeof(struct pdu_device));
+  if (!ctx.devices) {
+    LOG(LL_ERROR, ("Could not allocate replay state"));
+    return false;
+  }
+  for (int d = 0; d < s_num_devices; d++)
+    ctx.devices[d].pdu.modbus_address = s_devices[d].pdu.modbus_address;
+
+  ret = trace_read(filename, modbus_replay_record, &ctx);
+  for (int d = 0; d < s_num_devices; d++)
+    for (int i = 0; i < PDU_NUM_CHANNELS; i++)
+      replay->centiamp_msecs_total[d * PDU_NUM_CHANNELS + i] =
+          ctx.devices[d].pdu.pdu_channel[i].centiamp_msecs_total;
+  free(ctx.devices);
+  return ret;
+}
+#endif
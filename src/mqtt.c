@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "mqtt.h"
+#include "outbox.h"
 
 static void mqtt_publish_broadcast_stat(const char *stat, const char *msg) {
   char topic[80];
@@ -24,7 +25,7 @@ static void mqtt_publish_broadcast_stat(const char *stat, const char *msg) {
 }
 
 static void mqtt_broadcast_cmd_id() {
-  char resp[300];
+  char *resp;
   struct mgos_net_ip_info ip_info;
   char sta_ip[16], ap_ip[16];
 
@@ -40,15 +41,18 @@ static void mqtt_broadcast_cmd_id() {
     mgos_net_ip_to_str(&ip_info.ip, ap_ip);
   }
 
-  snprintf(
-      resp, sizeof(resp) - 1,
-      "{\"deviceid\": \"%s\", \"macaddress\": \"%s\", \"sta_ip\": \"%s\", "
-      "\"ap_ip\": \"%s\", \"app\": \"%s\", \"arch\": \"%s\", \"uptime\": %lu}",
+  // Built on the heap: this runs on the MQTT event path, whose stack is
+  // shared with everything else on the Mongoose OS task.
+  resp = json_asprintf(
+      "{deviceid: %Q, macaddress: %Q, sta_ip: %Q, ap_ip: %Q, app: %Q, "
+      "arch: %Q, uptime: %lu}",
       mgos_sys_config_get_device_id(), mgos_sys_ro_vars_get_mac_address(),
       sta_ip, ap_ip, MGOS_APP, mgos_sys_ro_vars_get_arch(),
       (unsigned long) mgos_uptime());
+  if (!resp) return;
 
   mqtt_publish_broadcast_stat("id", resp);
+  free(resp);
 }
 
 static void mqtt_cb(struct mg_connection *nc, const char *topic, int topic_len,
@@ -68,30 +72,63 @@ static void mqtt_ev(struct mg_connection *nc, int ev, void *ev_data,
   switch (ev) {
     case MG_EV_MQTT_CONNACK:
       mqtt_broadcast_cmd_id();
+      outbox_drain_start();
       break;
   }
 }
 
+// Publish right away if connected, otherwise (or while older messages are
+// still waiting) queue the message in the outbox. Returns true if the message
+// was sent right away.
+static bool mqtt_publish_or_queue(const char *topic, const void *msg,
+                                  size_t len) {
+  if (mgos_mqtt_global_is_connected() && outbox_empty() &&
+      mgos_mqtt_pub(topic, msg, len, 0, false))
+    return true;
+  if (!outbox_push(topic, msg, len)) {
+    LOG(LL_WARN, ("Dropped topic='%s', outbox is full", topic));
+    return false;
+  }
+  LOG(LL_INFO, ("Queued topic='%s' len=%d", topic, (int) len));
+  if (mgos_mqtt_global_is_connected()) outbox_drain_start();
+  return false;
+}
+
 void mqtt_publish_stat(const char *stat, const char *fmt, ...) {
   char topic[80];
-  char msg[200];
-  struct json_out out = JSON_OUT_BUF(msg, 200);
+  char *msg;
   va_list ap;
 
   snprintf(topic, sizeof(topic) - 1, "%s%s/stat/%s", MQTT_TOPIC_PREFIX,
            mgos_sys_config_get_device_id(), stat);
 
   va_start(ap, fmt);
-  json_vprintf(&out, fmt, ap);
+  msg = json_vasprintf(fmt, ap);
   va_end(ap);
+  if (!msg) {
+    LOG(LL_ERROR, ("Could not format message for topic='%s'", topic));
+    return;
+  }
 
-  mgos_mqtt_pub((char *) topic, (char *) msg, strlen(msg), 0, false);
-  LOG(LL_INFO, ("Sent topic='%s' msg='%s'", topic, msg));
+  if (mqtt_publish_or_queue(topic, msg, strlen(msg)))
+    LOG(LL_INFO, ("Sent topic='%s' msg='%s'", topic, msg));
+  free(msg);
+}
+
+void mqtt_publish_stat_raw(const char *stat, const void *msg, size_t len) {
+  char topic[80];
+
+  snprintf(topic, sizeof(topic) - 1, "%s%s/stat/%s", MQTT_TOPIC_PREFIX,
+           mgos_sys_config_get_device_id(), stat);
+
+  if (mqtt_publish_or_queue(topic, msg, len))
+    LOG(LL_INFO, ("Sent topic='%s' len=%d", topic, (int) len));
 }
 
 void mqtt_init() {
   char topic[100];
 
+  outbox_init();
   mgos_mqtt_add_global_handler(mqtt_ev, NULL);
 
   // Subscribe to broadcast for identification purposes
@@ -0,0 +1,298 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "outbox.h"
+#include "budget.h"
+#include "mgos_mqtt.h"
+
+struct outbox_entry {
+  char *topic;
+  char *msg;
+  size_t len;
+};
+
+struct outbox_record {
+  uint16_t topic_len;
+  uint16_t reserved;
+  uint32_t msg_len;
+};
+
+static struct outbox_entry *s_ring = NULL;
+static int s_ring_size = 0;
+static int s_ring_head = 0;     // Oldest entry
+static int s_ring_count = 0;
+static size_t s_ring_bytes = 0;  // Topic and message bytes held in the ring
+
+// A message whose publish failed, sent again before any other.
+static struct outbox_entry s_pending;
+static bool s_has_pending = false;
+
+static uint32_t s_file_count = 0;  // Records in the segment file
+static size_t s_file_len = 0;      // Bytes in the segment file
+static size_t s_file_off = 0;      // Read offset of the oldest record
+
+static struct outbox_stats s_stats;
+static mgos_timer_id s_drain_timer = MGOS_INVALID_TIMER_ID;
+
+// Bytes of heap an entry holds on to.
+static size_t outbox_entry_bytes(const struct outbox_entry *e) {
+  return strlen(e->topic) + 1 + e->len;
+}
+
+static void outbox_file_reset(void) {
+  remove(OUTBOX_FILENAME);
+  s_file_count = 0;
+  s_file_len = 0;
+  s_file_off = 0;
+}
+
+static bool outbox_file_append(const struct outbox_entry *e) {
+  struct outbox_record rec;
+  size_t topic_len = strlen(e->topic);
+  size_t rec_len = sizeof(rec) + topic_len + e->len;
+  int file_size = mgos_sys_config_get_pdu_outbox_file_size();
+  bool ok;
+  int fd;
+
+  if (file_size <= 0 || s_file_len + rec_len > (size_t) file_size) return false;
+  fd = open(OUTBOX_FILENAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", OUTBOX_FILENAME,
+                   strerror(errno)));
+    return false;
+  }
+  rec.topic_len = topic_len;
+  rec.reserved = 0;
+  rec.msg_len = e->len;
+  ok = write(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+       write(fd, e->topic, topic_len) == (int) topic_len &&
+       write(fd, e->msg, e->len) == (int) e->len;
+  close(fd);
+  if (!ok) {
+    // A torn record would end the drain early, so start the segment over.
+    LOG(LL_ERROR, ("%s: Short write(), discarding segment", OUTBOX_FILENAME));
+    s_stats.dropped += s_file_count;
+    s_stats.depth -= s_file_count;
+    outbox_file_reset();
+    return false;
+  }
+  budget_flash_write(BUDGET_FLASH_OUTBOX, rec_len);
+  s_file_count++;
+  s_file_len += rec_len;
+  return true;
+}
+
+// Read the oldest record of the segment file into e, allocating its buffers.
+static bool outbox_file_pop(struct outbox_entry *e) {
+  struct outbox_record rec;
+  bool ok = false;
+  int fd;
+
+  fd = open(OUTBOX_FILENAME, O_RDONLY);
+  if (fd < 0) goto exit;
+  if (lseek(fd, s_file_off, SEEK_SET) != (off_t) s_file_off ||
+      read(fd, &rec, sizeof(rec)) != sizeof(rec))
+    goto exit;
+  e->topic = calloc(1, rec.topic_len + 1);
+  e->msg = malloc(rec.msg_len);
+  e->len = rec.msg_len;
+  if (!e->topic || !e->msg ||
+      read(fd, e->topic, rec.topic_len) != rec.topic_len ||
+      read(fd, e->msg, rec.msg_len) != (int) rec.msg_len) {
+    free(e->topic);
+    free(e->msg);
+    goto exit;
+  }
+  s_file_off += sizeof(rec) + rec.topic_len + rec.msg_len;
+  s_file_count--;
+  ok = true;
+exit:
+  if (fd >= 0) close(fd);
+  if (!ok) {
+    LOG(LL_ERROR, ("%s: Could not read record, discarding %u messages",
+                   OUTBOX_FILENAME, (unsigned) s_file_count));
+    s_stats.dropped += s_file_count;
+    s_stats.depth -= s_file_count;
+    outbox_file_reset();
+  } else if (s_file_count == 0) {
+    outbox_file_reset();
+  }
+  return ok;
+}
+
+bool outbox_init(void) {
+  struct outbox_record rec;
+  struct stat st;
+  int fd;
+
+  s_ring_size = mgos_sys_config_get_pdu_outbox_entries();
+  if (s_ring_size > 0) {
+    s_ring = calloc(s_ring_size, sizeof(struct outbox_entry));
+    if (!s_ring) {
+      LOG(LL_ERROR, ("Could not allocate %d outbox entries", s_ring_size));
+      s_ring_size = 0;
+      return false;
+    }
+  }
+
+  // Count the records of a segment file left from before a reboot.
+  if (0 != stat(OUTBOX_FILENAME, &st)) return true;
+  fd = open(OUTBOX_FILENAME, O_RDONLY);
+  if (fd < 0) return true;
+  while (s_file_len + sizeof(rec) <= (size_t) st.st_size &&
+         read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+    size_t rec_len = sizeof(rec) + rec.topic_len + rec.msg_len;
+    if (s_file_len + rec_len > (size_t) st.st_size) break;
+    lseek(fd, rec.topic_len + rec.msg_len, SEEK_CUR);
+    s_file_len += rec_len;
+    s_file_count++;
+  }
+  close(fd);
+  s_stats.depth = s_file_count;
+  LOG(LL_INFO, ("%s: Found %u queued messages", OUTBOX_FILENAME,
+                (unsigned) s_file_count));
+  if (s_file_count == 0) outbox_file_reset();
+  return true;
+}
+
+bool outbox_empty(void) {
+  return !s_has_pending && s_ring_count == 0 && s_file_count == 0;
+}
+
+// Move the oldest message in RAM to flash, or drop it if that is full too.
+static void outbox_spill(void) {
+  struct outbox_entry *e = &s_ring[s_ring_head];
+
+  if (outbox_file_append(e)) {
+    s_stats.spilled++;
+  } else {
+    s_stats.dropped++;
+    s_stats.depth--;
+  }
+  s_ring_bytes -= outbox_entry_bytes(e);
+  free(e->topic);
+  free(e->msg);
+  s_ring_head = (s_ring_head + 1) % s_ring_size;
+  s_ring_count--;
+}
+
+bool outbox_push(const char *topic, const void *msg, size_t len) {
+  struct outbox_entry *e, in = {(char *) topic, (char *) msg, len};
+  size_t bytes = outbox_entry_bytes(&in);
+  size_t ram_size = mgos_sys_config_get_pdu_outbox_ram_size();
+
+  // Make room in RAM by moving the oldest messages to flash. A message that
+  // does not fit in RAM at all follows them there, so order is kept.
+  while (s_ring_count > 0 &&
+         (s_ring_count == s_ring_size || s_ring_bytes + bytes > ram_size))
+    outbox_spill();
+  if (s_ring_size == 0 || bytes > ram_size) {
+    if (!outbox_file_append(&in)) {
+      s_stats.dropped++;
+      return false;
+    }
+    s_stats.queued++;
+    s_stats.spilled++;
+    s_stats.depth++;
+    return true;
+  }
+
+  e = &s_ring[(s_ring_head + s_ring_count) % s_ring_size];
+  e->topic = strdup(topic);
+  e->msg = malloc(len);
+  e->len = len;
+  if (!e->topic || !e->msg) {
+    free(e->topic);
+    free(e->msg);
+    s_stats.dropped++;
+    return false;
+  }
+  memcpy(e->msg, msg, len);
+  s_ring_count++;
+  s_ring_bytes += bytes;
+  s_stats.queued++;
+  s_stats.depth++;
+  return true;
+}
+
+// Remove the oldest message from the outbox, a failed one first and then
+// flash before RAM, into e.
+static bool outbox_pop(struct outbox_entry *e) {
+  if (s_has_pending) {
+    *e = s_pending;
+    s_has_pending = false;
+    s_stats.depth--;
+    return true;
+  }
+  if (s_file_count > 0) {
+    if (outbox_file_pop(e)) {
+      s_stats.depth--;
+      return true;
+    }
+  }
+  if (s_ring_count == 0) return false;
+  *e = s_ring[s_ring_head];
+  s_ring_bytes -= outbox_entry_bytes(e);
+  s_ring_head = (s_ring_head + 1) % s_ring_size;
+  s_ring_count--;
+  s_stats.depth--;
+  return true;
+}
+
+static void outbox_drain_timer(void *arg) {
+  int batch = mgos_sys_config_get_pdu_outbox_batch();
+  struct outbox_entry e;
+
+  while (batch-- > 0 && mgos_mqtt_global_is_connected() && outbox_pop(&e)) {
+    if (!mgos_mqtt_pub(e.topic, e.msg, e.len, 0, false)) {
+      // Keep the message, and try again on the next tick or connect.
+      LOG(LL_WARN, ("Could not drain topic='%s', keeping it", e.topic));
+      s_pending = e;
+      s_has_pending = true;
+      s_stats.depth++;
+      break;
+    }
+    LOG(LL_DEBUG, ("Drained topic='%s' len=%d", e.topic, (int) e.len));
+    free(e.topic);
+    free(e.msg);
+    s_stats.drained++;
+  }
+  if (outbox_empty() || !mgos_mqtt_global_is_connected()) {
+    mgos_clear_timer(s_drain_timer);
+    s_drain_timer = MGOS_INVALID_TIMER_ID;
+    return;
+  }
+  if (arg) {
+    // This was the initial, jittered, run. Continue at the drain rate.
+    s_drain_timer =
+        mgos_set_timer(mgos_sys_config_get_pdu_outbox_drain_ms(),
+                       MGOS_TIMER_REPEAT, outbox_drain_timer, NULL);
+  }
+}
+
+void outbox_drain_start(void) {
+  int jitter = mgos_sys_config_get_pdu_outbox_jitter_ms();
+
+  if (outbox_empty() || s_drain_timer != MGOS_INVALID_TIMER_ID) return;
+  LOG(LL_INFO, ("Draining %u queued messages", (unsigned) s_stats.depth));
+  s_drain_timer = mgos_set_timer(jitter > 0 ? rand() % jitter : 0, 0,
+                                 outbox_drain_timer, (void *) 1);
+}
+
+bool outbox_get_stats(struct outbox_stats *stats) {
+  if (!stats) return false;
+  memcpy(stats, &s_stats, sizeof(*stats));
+  return true;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "prometheus.h"
+#include "alert.h"
+#include "fields.h"
+#include "mgos_http_server.h"
+#include "modbus.h"
+#include "outbox.h"
+#include "stats.h"
+
+static char *s_metrics = NULL;
+static size_t s_metrics_size = 0;
+static size_t s_metrics_len = 0;
+static struct pdu s_frames[PDU_MAX_DEVICES];
+
+// Target of the current render; NULL while measuring its length.
+static char *s_out = NULL;
+static bool s_overflow = false;
+
+
+// Append to the exposition, tracking the rendered length in *len. While
+// measuring, only the length is counted. Returns false once a line did not
+// fit, after which the render stops at the last complete line.
+static bool metrics_printf(size_t *len, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (s_overflow) return false;
+  va_start(ap, fmt);
+  if (s_out)
+    n = vsnprintf(s_out + *len, s_metrics_size - *len, fmt, ap);
+  else
+    n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (s_out && (size_t) n >= s_metrics_size - *len)) {
+    if (s_out) s_out[*len] = 0;
+    s_overflow = true;
+    return false;
+  }
+  *len += n;
+  return true;
+}
+
+static bool metrics_header(size_t *len, const char *name, const char *type,
+                           const char *help) {
+  return metrics_printf(len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+                        type);
+}
+
+// A sample for a channel, labeled with its sensor's address and the channel
+// number on that sensor.
+static bool metrics_channel(size_t *len, const char *name, uint8_t chan,
+                            int precision, double val) {
+  uint8_t addr = 0;
+
+  modbus_channel_get_address(chan, &addr);
+  return metrics_printf(len, "%s{address=\"%d\",channel=\"%d\"} %.*f\n", name,
+                        addr, chan % PDU_NUM_CHANNELS, precision, val);
+}
+
+static bool metrics_channel_quantile(size_t *len, const char *name,
+                                     uint8_t chan, const char *quantile,
+                                     double val) {
+  uint8_t addr = 0;
+
+  modbus_channel_get_address(chan, &addr);
+  return metrics_printf(
+      len, "%s{address=\"%d\",channel=\"%d\",quantile=\"%s\"} %.2f\n", name,
+      addr, chan % PDU_NUM_CHANNELS, quantile, val);
+}
+
+// Render the exposition into s_out, or measure it if s_out is NULL. Returns
+// the rendered length.
+static size_t prometheus_render() {
+  struct modbus_stats modbus = {0};
+  uint32_t latency_count = 0;
+  struct outbox_stats outbox = {0};
+  struct alert_stats alerts = {0};
+  struct stats_summary summary;
+  size_t len = 0;
+  int i, f;
+
+  s_overflow = false;
+  modbus_get_stats(&modbus);
+
+  metrics_header(&len, "pdu_modbus_reads_total", "counter",
+                 "Modbus read requests sent.");
+  metrics_printf(&len, "pdu_modbus_reads_total %llu\n",
+                 (unsigned long long) modbus.reads);
+  metrics_header(&len, "pdu_modbus_responses_total", "counter",
+                 "Modbus responses received.");
+  metrics_printf(&len, "pdu_modbus_responses_total %llu\n",
+                 (unsigned long long) modbus.responses);
+  metrics_header(&len, "pdu_modbus_responses_invalid_total", "counter",
+                 "Modbus responses that were rejected.");
+  metrics_printf(&len, "pdu_modbus_responses_invalid_total %llu\n",
+                 (unsigned long long) modbus.responses_invalid);
+  metrics_header(&len, "pdu_modbus_faults_total", "counter",
+                 "Modbus transactions that failed, by cause.");
+  for (i = 0; i < MODBUS_NUM_FAULTS; i++)
+    metrics_printf(&len, "pdu_modbus_faults_total{cause=\"%s\"} %u\n",
+                   modbus_fault_name(i), (unsigned) modbus.faults[i]);
+  metrics_header(&len, "pdu_modbus_send_failures_total", "counter",
+                 "Modbus read requests that could not be sent.");
+  metrics_printf(&len, "pdu_modbus_send_failures_total %u\n",
+                 (unsigned) modbus.send_failures);
+  metrics_header(&len, "pdu_modbus_stale_skips_total", "counter",
+                 "Readings not integrated because the previous one was stale.");
+  metrics_printf(&len, "pdu_modbus_stale_skips_total %u\n",
+                 (unsigned) modbus.stale_skips);
+  metrics_header(&len, "pdu_modbus_missed_deadlines_total", "counter",
+                 "Modbus polls skipped because their deadline had passed.");
+  metrics_printf(&len, "pdu_modbus_missed_deadlines_total %u\n",
+                 (unsigned) modbus.missed_deadlines);
+  metrics_header(&len, "pdu_modbus_task_drops_total", "counter",
+                 "Modbus responses dropped because the task queue was full.");
+  metrics_printf(&len, "pdu_modbus_task_drops_total %u\n",
+                 (unsigned) modbus.task_drops);
+  metrics_header(&len, "pdu_modbus_latency_seconds", "histogram",
+                 "Modbus round-trip time from request to response.");
+  for (i = 0; i < MODBUS_LATENCY_BUCKETS; i++) {
+    latency_count += modbus.latency_buckets[i];
+    if (modbus_latency_bucket_ms(i) == 0)
+      metrics_printf(&len,
+                     "pdu_modbus_latency_seconds_bucket{le=\"+Inf\"} %u\n",
+                     (unsigned) latency_count);
+    else
+      metrics_printf(&len,
+                     "pdu_modbus_latency_seconds_bucket{le=\"%.3f\"} %u\n",
+                     modbus_latency_bucket_ms(i) / 1000.,
+                     (unsigned) latency_count);
+  }
+  metrics_printf(&len, "pdu_modbus_latency_seconds_sum %.6f\n",
+                 modbus.latency_total_us / 1e6);
+  metrics_printf(&len, "pdu_modbus_latency_seconds_count %u\n",
+                 (unsigned) modbus.latency_count);
+
+  outbox_get_stats(&outbox);
+  metrics_header(&len, "pdu_mqtt_outbox_depth", "gauge",
+                 "MQTT messages queued while disconnected.");
+  metrics_printf(&len, "pdu_mqtt_outbox_depth %u\n", (unsigned) outbox.depth);
+  metrics_header(&len, "pdu_mqtt_outbox_queued_total", "counter",
+                 "MQTT messages queued in the outbox.");
+  metrics_printf(&len, "pdu_mqtt_outbox_queued_total %u\n",
+                 (unsigned) outbox.queued);
+  metrics_header(&len, "pdu_mqtt_outbox_spilled_total", "counter",
+                 "MQTT messages moved from RAM to the flash segment.");
+  metrics_printf(&len, "pdu_mqtt_outbox_spilled_total %u\n",
+                 (unsigned) outbox.spilled);
+  metrics_header(&len, "pdu_mqtt_outbox_dropped_total", "counter",
+                 "MQTT messages dropped because the outbox was full.");
+  metrics_printf(&len, "pdu_mqtt_outbox_dropped_total %u\n",
+                 (unsigned) outbox.dropped);
+  metrics_header(&len, "pdu_mqtt_outbox_drained_total", "counter",
+                 "Queued MQTT messages published after reconnecting.");
+  metrics_printf(&len, "pdu_mqtt_outbox_drained_total %u\n",
+                 (unsigned) outbox.drained);
+
+  for (f = 0; f < NUM_CHANNEL_FIELDS; f++) {
+    const struct channel_field *field = fields_get(f);
+    metrics_header(&len, field->metric, field->metric_type, field->help);
+    for (i = 0; i < modbus_num_channels(); i++)
+      metrics_channel(&len, field->metric, i, field->precision,
+                      fields_value(f, &s_frames[i / PDU_NUM_CHANNELS],
+                                   i % PDU_NUM_CHANNELS));
+  }
+  alert_get_stats(&alerts);
+  metrics_header(&len, "pdu_alerts_active", "gauge",
+                 "Current threshold alerts that are raised.");
+  metrics_printf(&len, "pdu_alerts_active %u\n", (unsigned) alerts.active);
+  metrics_header(&len, "pdu_alerts_raised_total", "counter",
+                 "Current threshold alerts raised.");
+  metrics_printf(&len, "pdu_alerts_raised_total %u\n",
+                 (unsigned) alerts.raised);
+  metrics_header(&len, "pdu_alert_latency_max_seconds", "gauge",
+                 "Longest time from sample to alert publish.");
+  metrics_printf(&len, "pdu_alert_latency_max_seconds %.6f\n",
+                 alerts.latency_max_us / 1e6);
+
+  metrics_header(&len, "pdu_channel_current_window_amperes", "summary",
+                 "Current per channel over the last completed stats window.");
+  for (i = 0; i < modbus_num_channels(); i++) {
+    if (!stats_get(i, true, &summary) || summary.count == 0) continue;
+    metrics_channel_quantile(&len, "pdu_channel_current_window_amperes", i,
+                             "0.5", summary.p50 * 0.01);
+    metrics_channel_quantile(&len, "pdu_channel_current_window_amperes", i,
+                             "0.95", summary.p95 * 0.01);
+    metrics_channel_quantile(&len, "pdu_channel_current_window_amperes", i,
+                             "0.99", summary.p99 * 0.01);
+    metrics_channel(&len, "pdu_channel_current_window_amperes_sum", i, 2,
+                    summary.mean * summary.count * 0.01);
+    metrics_channel(&len, "pdu_channel_current_window_amperes_count", i, 0,
+                    summary.count);
+  }
+  metrics_header(&len, "pdu_channel_current_window_min_amperes", "gauge",
+                 "Minimum current per channel over the last stats window.");
+  for (i = 0; i < modbus_num_channels(); i++) {
+    if (!stats_get(i, true, &summary) || summary.count == 0) continue;
+    metrics_channel(&len, "pdu_channel_current_window_min_amperes", i, 2,
+                    summary.min * 0.01);
+  }
+  metrics_header(&len, "pdu_channel_current_window_max_amperes", "gauge",
+                 "Maximum current per channel over the last stats window.");
+  for (i = 0; i < modbus_num_channels(); i++) {
+    if (!stats_get(i, true, &summary) || summary.count == 0) continue;
+    metrics_channel(&len, "pdu_channel_current_window_max_amperes", i, 2,
+                    summary.max * 0.01);
+  }
+  metrics_header(&len, "pdu_channel_current_window_mean_amperes", "gauge",
+                 "Mean current per channel over the last stats window.");
+  for (i = 0; i < modbus_num_channels(); i++) {
+    if (!stats_get(i, true, &summary) || summary.count == 0) continue;
+    metrics_channel(&len, "pdu_channel_current_window_mean_amperes", i, 3,
+                    summary.mean * 0.01);
+  }
+  metrics_header(&len, "pdu_channel_current_window_stddev_amperes", "gauge",
+                 "Current standard deviation per channel over the last stats "
+                 "window.");
+  for (i = 0; i < modbus_num_channels(); i++) {
+    if (!stats_get(i, true, &summary) || summary.count == 0) continue;
+    metrics_channel(&len, "pdu_channel_current_window_stddev_amperes", i, 3,
+                    summary.stddev * 0.01);
+  }
+
+  return len;
+}
+
+void prometheus_update() {
+  size_t len, size;
+  char *buf;
+  int i;
+
+  // Render all channels of a sensor from one consistent frame, so that a
+  // measured and a rendered exposition are the same.
+  for (i = 0; i < modbus_num_devices(); i++)
+    if (!modbus_snapshot(i, &s_frames[i]))
+      memset(&s_frames[i], 0, sizeof(struct pdu));
+
+  if (s_metrics) {
+    s_out = s_metrics;
+    s_metrics_len = prometheus_render();
+    s_out = NULL;
+    if (!s_overflow) return;
+  }
+
+  // Only when the exposition outgrew the buffer is it measured, and the
+  // buffer grown with some headroom, so that values gaining a digit do not
+  // cause a reallocation on every render.
+  len = prometheus_render();
+  size = len + 1 + len / PROMETHEUS_BUF_HEADROOM;
+  buf = realloc(s_metrics, size);
+  if (!buf) {
+    LOG(LL_ERROR, ("Could not grow metrics buffer to %d bytes, exposition "
+                   "truncated at %d bytes",
+                   (int) size, (int) s_metrics_len));
+    return;
+  }
+  s_metrics = buf;
+  s_metrics_size = size;
+  s_out = s_metrics;
+  s_metrics_len = prometheus_render();
+  s_out = NULL;
+  if (s_overflow)
+    LOG(LL_ERROR, ("Metrics exposition truncated at %d bytes",
+                   (int) s_metrics_len));
+}
+
+static void prometheus_handler(struct mg_connection *nc, int ev, void *ev_data,
+                               void *user_data) {
+  if (ev != MG_EV_HTTP_REQUEST) return;
+
+  mg_send_head(nc, 200, s_metrics_len,
+               "Content-Type: text/plain; version=0.0.4");
+  mg_send(nc, s_metrics, s_metrics_len);
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+void prometheus_init() {
+  prometheus_update();
+  mgos_register_http_endpoint(PROMETHEUS_METRICS_URI, prometheus_handler,
+                              NULL);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "rawlog.h"
+
+static struct rawlog_frame *s_frames = NULL;
+static int s_size = 0;
+static uint32_t s_last_seq = 0;
+
+bool rawlog_init(void) {
+  int size = mgos_sys_config_get_pdu_raw_frames();
+
+  if (size <= 0) return true;
+  s_frames = calloc(size, sizeof(struct rawlog_frame));
+  if (!s_frames) {
+    LOG(LL_ERROR, ("Could not allocate %d raw frames", size));
+    return false;
+  }
+  s_size = size;
+  return true;
+}
+
+void rawlog_push(uint8_t addr, uint8_t status, uint16_t first_reg,
+                 uint16_t num_regs, double request_time, double response_time,
+                 const void *buf, size_t len) {
+  struct rawlog_frame *frame;
+
+  if (s_size == 0) return;
+  s_last_seq++;
+  frame = &s_frames[s_last_seq % s_size];
+  frame->seq = s_last_seq;
+  frame->addr = addr;
+  frame->status = status;
+  frame->first_reg = first_reg;
+  frame->num_regs = num_regs;
+  frame->request_time = request_time;
+  frame->response_time = response_time;
+  frame->len = len < sizeof(frame->buf) ? len : sizeof(frame->buf);
+  memcpy(frame->buf, buf, frame->len);
+}
+
+uint32_t rawlog_last_seq(void) {
+  return s_last_seq;
+}
+
+uint32_t rawlog_first_seq(void) {
+  if (s_last_seq == 0) return 0;
+  if (s_last_seq <= (uint32_t) s_size) return 1;
+  return s_last_seq - s_size + 1;
+}
+
+bool rawlog_get(uint32_t seq, struct rawlog_frame *frame) {
+  if (!frame || seq == 0 || seq < rawlog_first_seq() || seq > s_last_seq)
+    return false;
+  memcpy(frame, &s_frames[seq % s_size], sizeof(struct rawlog_frame));
+  return true;
+}
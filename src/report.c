@@ -0,0 +1,149 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "report.h"
+#include "fields.h"
+#include "modbus.h"
+#include "mqtt.h"
+
+#define REPORT_PACKED_HEADER_LEN 8
+#define REPORT_PACKED_CHANNEL_LEN 8
+
+struct report_channel {
+  uint8_t idx;
+  uint8_t addr;
+  uint16_t current;  // units of 0.01A
+  uint32_t energy;   // units of 1Wh
+};
+
+struct report {
+  bool full;
+  int num_channels;
+  struct report_channel channel[PDU_MAX_CHANNELS];
+};
+
+static uint16_t s_published_current[PDU_MAX_CHANNELS];
+static uint32_t s_published_energy[PDU_MAX_CHANNELS];
+static int s_intervals = 0;
+static struct pdu s_frames[PDU_MAX_DEVICES];
+
+// Fields of a channel in JSON reports.
+#define REPORT_FIELDS \
+  (CHANNEL_FIELD_MASK(CHANNEL_FIELD_CURRENT) | \
+   CHANNEL_FIELD_MASK(CHANNEL_FIELD_KWH))
+
+static void report_collect(struct report *r, bool full) {
+  int current_delta =
+      (int) (mgos_sys_config_get_pdu_report_current_delta() * 100);
+  int energy_delta =
+      (int) (mgos_sys_config_get_pdu_report_energy_delta() * 1000);
+
+  r->full = full;
+  r->num_channels = 0;
+  // Take all channels of a sensor from one frame.
+  for (int d = 0; d < modbus_num_devices(); d++)
+    if (!modbus_snapshot(d, &s_frames[d]))
+      memset(&s_frames[d], 0, sizeof(struct pdu));
+
+  for (int i = 0; i < modbus_num_channels(); i++) {
+    const struct pdu *pdu = &s_frames[i / PDU_NUM_CHANNELS];
+    struct report_channel *ch = &r->channel[r->num_channels];
+    const struct pdu_channel *pc;
+    int d_current, d_energy;
+
+    pc = &pdu->pdu_channel[i % PDU_NUM_CHANNELS];
+    ch->idx = i;
+    ch->addr = pdu->modbus_address;
+    ch->current = pc->raw_current;
+    ch->energy =
+        (uint32_t) (modbus_centiamp_msecs_to_kwh(pc->centiamp_msecs_total) *
+                    1000);
+
+    d_current = ch->current - s_published_current[i];
+    d_energy = ch->energy - s_published_energy[i];
+    if (!full && abs(d_current) <= current_delta &&
+        abs(d_energy) <= energy_delta)
+      continue;
+    s_published_current[i] = ch->current;
+    s_published_energy[i] = ch->energy;
+    r->num_channels++;
+  }
+}
+
+static int json_report_channels(struct json_out *out, va_list *ap) {
+  const struct report *r = va_arg(*ap, const struct report *);
+  int len = 0;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < r->num_channels; i++) {
+    const struct report_channel *ch = &r->channel[i];
+    if (i > 0) len += json_printf(out, ", ");
+    len += fields_json_channel(
+        out, ch->idx, &s_frames[ch->idx / PDU_NUM_CHANNELS], REPORT_FIELDS);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void report_publish_packed(const struct report *r) {
+  uint8_t buf[REPORT_PACKED_HEADER_LEN +
+              PDU_MAX_CHANNELS * REPORT_PACKED_CHANNEL_LEN];
+  uint32_t now = (uint32_t) mg_time();
+  uint8_t *p = buf;
+
+  *p++ = REPORT_PACKED_VERSION;
+  *p++ = r->full ? REPORT_PACKED_FLAG_FULL : 0;
+  *p++ = r->num_channels;
+  *p++ = 0;
+  *p++ = now >> 24;
+  *p++ = now >> 16;
+  *p++ = now >> 8;
+  *p++ = now;
+  for (int i = 0; i < r->num_channels; i++) {
+    const struct report_channel *ch = &r->channel[i];
+    *p++ = ch->idx;
+    *p++ = ch->addr;
+    *p++ = ch->current >> 8;
+    *p++ = ch->current;
+    *p++ = ch->energy >> 24;
+    *p++ = ch->energy >> 16;
+    *p++ = ch->energy >> 8;
+    *p++ = ch->energy;
+  }
+  mqtt_publish_stat_raw(REPORT_STAT_PACKED, buf, p - buf);
+}
+
+// Kept off the stack, as it holds every channel of every sensor.
+static struct report s_report;
+
+void report_publish(void) {
+  int full_every = mgos_sys_config_get_pdu_report_full_every();
+  bool full = (full_every <= 1 || s_intervals % full_every == 0);
+
+  s_intervals++;
+  report_collect(&s_report, full);
+  if (!full && s_report.num_channels == 0) {
+    LOG(LL_DEBUG, ("No channels changed, not reporting"));
+    return;
+  }
+
+  if (0 == strcmp(mgos_sys_config_get_pdu_report_format(), "packed")) {
+    report_publish_packed(&s_report);
+  } else {
+    mqtt_publish_stat(REPORT_STAT, "{full: %B, t: %.f, channels: %M}",
+                      s_report.full, mg_time(), json_report_channels,
+                      &s_report);
+  }
+}
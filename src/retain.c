@@ -0,0 +1,87 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "retain.h"
+#include "common/cs_crc32.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_attr.h"
+#else
+// Elsewhere there is no memory that survives a reset, so the mirror is plain
+// RAM and never holds anything valid after boot.
+#define RTC_NOINIT_ATTR
+#endif
+
+#define RETAIN_SLOTS 2
+
+struct retain_slot {
+  uint32_t magic;
+  uint32_t generation;
+  struct pdu pdu;
+  uint32_t crc;
+};
+
+static RTC_NOINIT_ATTR struct retain_slot s_retain[PDU_MAX_DEVICES]
+                                                  [RETAIN_SLOTS];
+
+static bool retain_slot_valid(const struct retain_slot *slot) {
+  return slot->magic == RETAIN_MAGIC &&
+         slot->crc == cs_crc32(0, slot, offsetof(struct retain_slot, crc));
+}
+
+// Return the index of the newest valid slot of device, or -1 if there is none.
+static int retain_newest(uint8_t device) {
+  int newest = -1;
+
+  for (int i = 0; i < RETAIN_SLOTS; i++) {
+    const struct retain_slot *slot = &s_retain[device][i];
+    if (!retain_slot_valid(slot)) continue;
+    if (newest == -1 ||
+        (int32_t) (slot->generation - s_retain[device][newest].generation) > 0)
+      newest = i;
+  }
+  return newest;
+}
+
+void retain_write(uint8_t device, const struct pdu *pdu) {
+  struct retain_slot *slot;
+  uint32_t generation = 0;
+  int newest;
+
+  if (device >= PDU_MAX_DEVICES || !pdu) return;
+  newest = retain_newest(device);
+  if (newest != -1) generation = s_retain[device][newest].generation;
+  slot = &s_retain[device][newest == 0 ? 1 : 0];
+
+  slot->magic = RETAIN_MAGIC;
+  slot->generation = generation + 1;
+  memcpy(&slot->pdu, pdu, sizeof(struct pdu));
+  slot->crc = cs_crc32(0, slot, offsetof(struct retain_slot, crc));
+}
+
+bool retain_read(uint8_t device, struct pdu *pdu) {
+  int newest;
+
+  if (device >= PDU_MAX_DEVICES || !pdu) return false;
+  newest = retain_newest(device);
+  if (newest == -1) return false;
+  memcpy(pdu, &s_retain[device][newest].pdu, sizeof(struct pdu));
+  return true;
+}
+
+void retain_invalidate(uint8_t device) {
+  if (device >= PDU_MAX_DEVICES) return;
+  for (int i = 0; i < RETAIN_SLOTS; i++) s_retain[device][i].magic = 0;
+}
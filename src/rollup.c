@@ -0,0 +1,125 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "rollup.h"
+
+struct rollup_bucket {
+  uint64_t centiamp_msecs;
+  uint32_t sum;  // units of 0.01A, summed over count samples
+  uint16_t min;
+  uint16_t max;
+  uint16_t count;
+};
+
+/* A ring of buckets at one resolution. The bucket start times are shared by
+ * all channels; the buckets themselves are stored per slot, one per channel.
+ */
+struct rollup_ring {
+  int resolution;  // seconds per bucket
+  int size;        // number of slots
+  int head;        // slot of the current bucket
+  int used;        // number of slots holding a bucket
+  double *start;
+  struct rollup_bucket *buckets;
+};
+
+#define ROLLUP_NUM_RINGS 2
+
+static struct rollup_ring s_rings[ROLLUP_NUM_RINGS];
+static int s_num_channels = 0;
+
+static bool rollup_ring_init(struct rollup_ring *ring, int resolution,
+                             int size) {
+  memset(ring, 0, sizeof(*ring));
+  if (size <= 0) return true;
+  ring->start = calloc(size, sizeof(double));
+  ring->buckets = calloc(size * s_num_channels, sizeof(struct rollup_bucket));
+  if (!ring->start || !ring->buckets) {
+    free(ring->start);
+    free(ring->buckets);
+    memset(ring, 0, sizeof(*ring));
+    return false;
+  }
+  ring->resolution = resolution;
+  ring->size = size;
+  return true;
+}
+
+bool rollup_init(int num_channels) {
+  s_num_channels = num_channels;
+  if (!rollup_ring_init(&s_rings[0], ROLLUP_RES_MINUTE,
+                        mgos_sys_config_get_pdu_rollup_minutes()) ||
+      !rollup_ring_init(&s_rings[1], ROLLUP_RES_HOUR,
+                        mgos_sys_config_get_pdu_rollup_hours())) {
+    LOG(LL_ERROR, ("Could not allocate rollup buffers"));
+    return false;
+  }
+  LOG(LL_INFO, ("Rollups: %d channels, %d minutes, %d hours", num_channels,
+                s_rings[0].size, s_rings[1].size));
+  return true;
+}
+
+static void rollup_ring_update(struct rollup_ring *ring, uint8_t chan,
+                               double now, uint16_t raw_current,
+                               uint64_t centiamp_msecs) {
+  double start = (double) ((int64_t) now / ring->resolution * ring->resolution);
+  struct rollup_bucket *b;
+
+  if (ring->size == 0) return;
+  if (ring->used == 0 || start > ring->start[ring->head]) {
+    if (ring->used > 0) ring->head = (ring->head + 1) % ring->size;
+    if (ring->used < ring->size) ring->used++;
+    ring->start[ring->head] = start;
+    memset(&ring->buckets[ring->head * s_num_channels], 0,
+           s_num_channels * sizeof(struct rollup_bucket));
+  }
+  b = &ring->buckets[ring->head * s_num_channels + chan];
+  if (b->count == 0 || raw_current < b->min) b->min = raw_current;
+  if (b->count == 0 || raw_current > b->max) b->max = raw_current;
+  if (b->count < UINT16_MAX) {
+    b->sum += raw_current;
+    b->count++;
+  }
+  b->centiamp_msecs += centiamp_msecs;
+}
+
+void rollup_update(uint8_t chan, double now, uint16_t raw_current,
+                   uint64_t centiamp_msecs) {
+  if (chan >= s_num_channels) return;
+  for (int r = 0; r < ROLLUP_NUM_RINGS; r++)
+    rollup_ring_update(&s_rings[r], chan, now, raw_current, centiamp_msecs);
+}
+
+bool rollup_get(uint8_t chan, int resolution, int i,
+                struct rollup_sample *sample) {
+  const struct rollup_ring *ring = NULL;
+  const struct rollup_bucket *b;
+  int slot;
+
+  if (chan >= s_num_channels || !sample) return false;
+  for (int r = 0; r < ROLLUP_NUM_RINGS; r++)
+    if (s_rings[r].resolution == resolution) ring = &s_rings[r];
+  if (!ring || i < 0 || i >= ring->used) return false;
+
+  slot = (ring->head - ring->used + 1 + i + ring->size) % ring->size;
+  b = &ring->buckets[slot * s_num_channels + chan];
+  sample->start = ring->start[slot];
+  sample->min = b->min;
+  sample->avg = b->count ? b->sum / b->count : 0;
+  sample->max = b->max;
+  sample->count = b->count;
+  sample->centiamp_msecs = b->centiamp_msecs;
+  return true;
+}
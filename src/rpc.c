@@ -1,5 +1,15 @@
 #include "rpc.h"
+
+#include <math.h>
+
+#include "alert.h"
+#include "budget.h"
+#include "fields.h"
 #include "modbus.h"
+#include "rawlog.h"
+#include "rollup.h"
+#include "stats.h"
+#include "tsdb.h"
 
 static void rpc_log(struct mg_rpc_request_info *ri, struct mg_str args) {
   LOG(LL_INFO,
@@ -7,182 +17,508 @@ static void rpc_log(struct mg_rpc_request_info *ri, struct mg_str args) {
        ri->src.len, ri->src.p, ri->method.len, ri->method.p, args.len, args.p));
 }
 
+// Size of the reply sent by the running handler, and whether it was an error.
+static size_t s_reply_len = 0;
+static bool s_reply_error = false;
+
+// The format and arguments of a reply, rendered by json_rpc_reply().
+struct rpc_reply {
+  const char *fmt;
+  va_list ap;
+};
+
+// Render a reply straight into the outgoing frame, counting its size.
+static int json_rpc_reply(struct json_out *out, va_list *ap) {
+  struct rpc_reply *reply = va_arg(*ap, struct rpc_reply *);
+  va_list reply_ap;
+  int len;
+
+  va_copy(reply_ap, reply->ap);
+  len = json_vprintf(out, reply->fmt, reply_ap);
+  va_end(reply_ap);
+  s_reply_len = len;
+  return len;
+}
+
+/* rpc_respond(): Send a successful reply, as mg_rpc_send_responsef(), and
+ * account its size to the method being handled.
+ */
+static bool rpc_respond(struct mg_rpc_request_info *ri, const char *fmt, ...) {
+  struct rpc_reply reply = {.fmt = fmt};
+  bool ret;
+
+  va_start(reply.ap, fmt);
+  ret = mg_rpc_send_responsef(ri, "%M", json_rpc_reply, &reply);
+  va_end(reply.ap);
+  return ret;
+}
+
+/* rpc_error(): Send an error reply, as mg_rpc_send_errorf(), and count it
+ * against the method being handled.
+ */
+static bool rpc_error(struct mg_rpc_request_info *ri, int code,
+                      const char *fmt, ...) {
+  char msg[100];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  s_reply_len = strlen(msg);
+  s_reply_error = true;
+  return mg_rpc_send_errorf(ri, code, "%s", msg);
+}
+
+// Parse a channel index of at least min, which must be a whole JSON number.
+static bool parse_idx(const struct json_token *t, int min, int *idx) {
+  char *end;
+  long v;
+
+  if (t->type != JSON_TYPE_NUMBER) return false;
+  v = strtol(t->ptr, &end, 10);
+  if (end != t->ptr + t->len || v < min || v >= modbus_num_channels())
+    return false;
+  *idx = (int) v;
+  return true;
+}
+
+// Parse the optional idx argument into *idx, which is left as is without one.
 static bool valid_idx(struct mg_str args, struct mg_rpc_request_info *ri,
                       int *idx) {
-  json_scanf(args.p, args.len, ri->args_fmt, idx);
-  if (*idx < -1 || *idx >= PDU_NUM_CHANNELS) {
-    mg_rpc_send_errorf(ri, 400, "idx must be between 0..%d or -1 for all",
-                       PDU_NUM_CHANNELS - 1);
+  struct json_token t;
+
+  memset(&t, 0, sizeof(t));
+  if (json_scanf(args.p, args.len, "{idx: %T}", &t) < 1) return true;
+  if (!parse_idx(&t, -1, idx)) {
+    rpc_error(ri, 400, "idx must be between 0..%d or -1 for all",
+              modbus_num_channels() - 1);
     return false;
   }
   return true;
 }
 
-static void rpc_channel_get_current(struct mg_rpc_request_info *ri,
-                                    void *cb_arg, struct mg_rpc_frame_info *fi,
-                                    struct mg_str args) {
+// Snapshots of every sensor, kept off the stack and shared by the handlers.
+static struct pdu s_frames[PDU_MAX_DEVICES];
+
+static bool rpc_snapshot(struct mg_rpc_request_info *ri) {
+  for (int i = 0; i < modbus_num_devices(); i++) {
+    if (!modbus_snapshot(i, &s_frames[i])) {
+      rpc_error(ri, 500, "could not get channels");
+      return false;
+    }
+  }
+  return true;
+}
+
+#define FRAME(idx) (&s_frames[(idx) / PDU_NUM_CHANNELS])
+
+static int json_channel_field_list(struct json_out *out, va_list *ap) {
+  int f = va_arg(*ap, int);
+  int len = 0;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < modbus_num_channels(); i++) {
+    if (i > 0) len += json_printf(out, ", ");
+    len += fields_json_value(out, f, FRAME(i), i % PDU_NUM_CHANNELS);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static int json_channel_field(struct json_out *out, va_list *ap) {
+  int f = va_arg(*ap, int);
+  int idx = va_arg(*ap, int);
+
+  return fields_json_value(out, f, FRAME(idx), idx % PDU_NUM_CHANNELS);
+}
+
+/* rpc_channel_get_field(): Handler of Channel.GetCurrent, GetFrequency,
+ * GetRatio and GetkWh, with the field id in cb_arg. The reply is streamed
+ * straight into the outgoing frame.
+ */
+static void rpc_channel_get_field(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, struct mg_rpc_frame_info *fi,
+                                  struct mg_str args) {
+  enum channel_field_id f = (enum channel_field_id) (intptr_t) cb_arg;
+  const char *name = fields_get(f)->name;
   int idx = -1;
-  double amps;
 
   rpc_log(ri, args);
   if (!valid_idx(args, ri, &idx)) return;
+  if (!rpc_snapshot(ri)) return;
 
-  if (idx != -1) {
-    if (!modbus_channel_get_current(idx, &amps)) {
-      mg_rpc_send_errorf(ri, 500, "could not get current for channel %d", idx);
-      return;
-    } else {
-      mg_rpc_send_responsef(ri, "{retval: %B, idx: %d, current: %.2f}", true,
-                            idx, amps);
-      return;
-    }
-  } else {
-    char rpl_str[1000];
-    struct json_out rpl = JSON_OUT_BUF(rpl_str, sizeof(rpl_str));
-    json_printf(&rpl, "{ retval: %B, current: [", true);
-    for (idx = 0; idx < PDU_NUM_CHANNELS; idx++) {
-      if (idx > 0) json_printf(&rpl, ",");
-      amps = 0;
-      if (!modbus_channel_get_current(idx, &amps)) {
-        mg_rpc_send_errorf(ri, 500, "could not get current for channel %d",
-                           idx);
-        return;
-      }
-      json_printf(&rpl, "%.2f", amps);
-    }
-    json_printf(&rpl, "] }");
-    mg_rpc_send_responsef(ri, "%s", rpl_str);
-    return;
-  }
-
-  /* NOTREACH */
+  if (idx != -1)
+    rpc_respond(ri, "{retval: %B, idx: %d, %Q: %M}", true, idx, name,
+                json_channel_field, f, idx);
+  else
+    rpc_respond(ri, "{retval: %B, %Q: %M}", true, name, json_channel_field_list,
+                f);
   ri = NULL;
   return;
 }
 
-static void rpc_channel_get_ratio(struct mg_rpc_request_info *ri, void *cb_arg,
-                                  struct mg_rpc_frame_info *fi,
-                                  struct mg_str args) {
+struct channel_get_all {
+  bool idx[PDU_MAX_CHANNELS];
+  uint32_t fields;
+};
+
+static struct channel_get_all s_get_all;
+
+static int json_channel_get_all(struct json_out *out, va_list *ap) {
+  const struct channel_get_all *ga =
+      va_arg(*ap, const struct channel_get_all *);
+  int len = 0;
+  bool first = true;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < modbus_num_channels(); i++) {
+    if (!ga->idx[i]) continue;
+    if (!first) len += json_printf(out, ", ");
+    first = false;
+    len += fields_json_channel(out, i, FRAME(i), ga->fields);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_channel_get_all(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args) {
+  struct channel_get_all *ga = &s_get_all;
+  struct json_token t;
   int idx = -1;
-  uint16_t ratio;
+  int i, f;
 
   rpc_log(ri, args);
-  if (!valid_idx(args, ri, &idx)) return;
+  memset(ga, 0, sizeof(*ga));
 
-  if (idx != -1) {
-    if (!modbus_channel_get_ratio(idx, &ratio)) {
-      mg_rpc_send_errorf(ri, 500, "could not get ratio for channel %d", idx);
-      return;
-    } else {
-      mg_rpc_send_responsef(ri, "{retval: %B, idx: %d, ratio: %d}", true, idx,
-                            ratio);
+  // Optional list of field names, defaulting to all fields.
+  for (i = 0; json_scanf_array_elem(args.p, args.len, ".fields", i, &t) > 0;
+       i++) {
+    f = fields_find(t.ptr, t.len);
+    if (f < 0) {
+      rpc_error(ri, 400, "unknown field '%.*s'", t.len, t.ptr);
       return;
     }
-  } else {
-    char rpl_str[1000];
-    struct json_out rpl = JSON_OUT_BUF(rpl_str, sizeof(rpl_str));
-    json_printf(&rpl, "{ retval: %B, ratio: [", true);
-    for (idx = 0; idx < PDU_NUM_CHANNELS; idx++) {
-      if (idx > 0) json_printf(&rpl, ",");
-      ratio = 0;
-      if (!modbus_channel_get_ratio(idx, &ratio)) {
-        mg_rpc_send_errorf(ri, 500, "could not get ratio for channel %d", idx);
-        return;
-      }
-      json_printf(&rpl, "%d", ratio);
+    ga->fields |= CHANNEL_FIELD_MASK(f);
+  }
+  if (i == 0) ga->fields = CHANNEL_FIELD_MASK_ALL;
+
+  // Optional idx, either a list of channels or a scalar, defaulting to all.
+  for (i = 0; json_scanf_array_elem(args.p, args.len, ".idx", i, &t) > 0;
+       i++) {
+    if (!parse_idx(&t, 0, &idx)) {
+      rpc_error(ri, 400, "idx must be between 0..%d",
+                modbus_num_channels() - 1);
+      return;
     }
-    json_printf(&rpl, "] }");
-    mg_rpc_send_responsef(ri, "%s", rpl_str);
-    return;
+    ga->idx[idx] = true;
+  }
+  if (i == 0) {
+    idx = -1;
+    if (!valid_idx(args, ri, &idx)) return;
+    for (i = 0; i < modbus_num_channels(); i++)
+      ga->idx[i] = (idx == -1 || idx == i);
   }
 
-  /* NOTREACH */
+  if (!rpc_snapshot(ri)) return;
+  rpc_respond(ri, "{retval: %B, channels: %M}", true, json_channel_get_all, ga);
   ri = NULL;
   return;
 }
 
-static void rpc_channel_get_frequency(struct mg_rpc_request_info *ri,
-                                      void *cb_arg,
-                                      struct mg_rpc_frame_info *fi,
-                                      struct mg_str args) {
-  int idx = -1;
-  double hertz;
+// Frames returned by one Channel.GetRaw call at most.
+#define RPC_RAW_MAX_FRAMES 16
+
+static int json_channel_raw(struct json_out *out, va_list *ap) {
+  uint32_t first = va_arg(*ap, uint32_t);
+  uint32_t last = va_arg(*ap, uint32_t);
+  struct rawlog_frame frame;
+  int len = 0;
+  bool comma = false;
+
+  len += json_printf(out, "[");
+  for (uint32_t seq = first; seq <= last && seq != 0; seq++) {
+    if (!rawlog_get(seq, &frame)) continue;
+    len += json_printf(out,
+                       "%s{seq: %u, addr: %d, status: %d, first_reg: %d, "
+                       "num_regs: %d, request_time: %.3f, "
+                       "response_time: %.3f, data: %V}",
+                       comma ? ", " : "", (unsigned) frame.seq, frame.addr,
+                       frame.status, frame.first_reg, frame.num_regs,
+                       frame.request_time, frame.response_time, frame.buf,
+                       (int) frame.len);
+    comma = true;
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_channel_get_raw(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args) {
+  uint32_t last = rawlog_last_seq();
+  uint32_t first = last;
+  unsigned int since_seq = 0;
 
   rpc_log(ri, args);
-  if (!valid_idx(args, ri, &idx)) return;
+  // Without since_seq, return only the newest frame.
+  if (json_scanf(args.p, args.len, "{since_seq: %u}", &since_seq) == 1) {
+    first = since_seq + 1;
+    if (first < rawlog_first_seq()) first = rawlog_first_seq();
+    if (last >= first && last - first >= RPC_RAW_MAX_FRAMES)
+      last = first + RPC_RAW_MAX_FRAMES - 1;
+  }
 
-  if (idx != -1) {
-    if (!modbus_channel_get_freq(idx, &hertz)) {
-      mg_rpc_send_errorf(ri, 500, "could not get frequency for channel %d",
-                         idx);
-      return;
-    } else {
-      mg_rpc_send_responsef(ri, "{retval: %B, idx: %d, frequency: %.2f}", true,
-                            idx, hertz);
-      return;
-    }
-  } else {
-    char rpl_str[1000];
-    struct json_out rpl = JSON_OUT_BUF(rpl_str, sizeof(rpl_str));
-    json_printf(&rpl, "{ retval: %B, frequency: [", true);
-    for (idx = 0; idx < PDU_NUM_CHANNELS; idx++) {
-      if (idx > 0) json_printf(&rpl, ",");
-      hertz = 0;
-      if (!modbus_channel_get_freq(idx, &hertz)) {
-        mg_rpc_send_errorf(ri, 500, "could not get frequency for channel %d",
-                           idx);
-        return;
-      }
-      json_printf(&rpl, "%.2f", hertz);
-    }
-    json_printf(&rpl, "] }");
-    mg_rpc_send_responsef(ri, "%s", rpl_str);
+  rpc_respond(ri, "{retval: %B, last_seq: %u, frames: %M}", true,
+              (unsigned) rawlog_last_seq(), json_channel_raw, first, last);
+  ri = NULL;
+  return;
+}
+
+// Samples returned by one Channel.GetSamples call at most.
+#define RPC_SAMPLES_MAX 1000
+
+struct channel_samples {
+  int idx;
+  int max;
+  double since;
+  double until;
+  // Filled in while streaming.
+  struct json_out *out;
+  int len;
+  int count;
+  double next;  // Time to continue from, or 0 if all samples were returned
+};
+
+static bool json_channel_sample(double t, const uint16_t *currents,
+                                void *arg) {
+  struct channel_samples *cs = (struct channel_samples *) arg;
+
+  if (cs->count == cs->max) {
+    cs->next = t;
+    return false;
+  }
+  cs->len += json_printf(cs->out, "%s[%.3f, %.2f]", cs->count ? ", " : "", t,
+                         currents[cs->idx % PDU_NUM_CHANNELS] * 0.01);
+  cs->count++;
+  return true;
+}
+
+static int json_channel_samples(struct json_out *out, va_list *ap) {
+  struct channel_samples *cs = va_arg(*ap, struct channel_samples *);
+
+  cs->out = out;
+  cs->len = json_printf(out, "[");
+  tsdb_read(cs->idx / PDU_NUM_CHANNELS, cs->since, cs->until,
+            json_channel_sample, cs);
+  cs->len += json_printf(out, "]");
+  return cs->len;
+}
+
+static int json_channel_samples_next(struct json_out *out, va_list *ap) {
+  const struct channel_samples *cs =
+      va_arg(*ap, const struct channel_samples *);
+
+  if (cs->next == 0) return json_printf(out, "%Q", NULL);
+  return json_printf(out, "%.3f", cs->next);
+}
+
+static void rpc_channel_get_samples(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  struct channel_samples cs = {.idx = -1, .max = RPC_SAMPLES_MAX};
+
+  rpc_log(ri, args);
+  cs.until = mg_time() + 1;
+  json_scanf(args.p, args.len, "{idx: %d, since: %lf, until: %lf, max: %d}",
+             &cs.idx, &cs.since, &cs.until, &cs.max);
+  if (cs.idx < 0 || cs.idx >= modbus_num_channels()) {
+    rpc_error(ri, 400, "idx must be between 0..%d", modbus_num_channels() - 1);
     return;
   }
+  if (cs.max <= 0 || cs.max > RPC_SAMPLES_MAX) cs.max = RPC_SAMPLES_MAX;
 
-  /* NOTREACH */
+  // Samples are decoded from flash straight into the reply; next is only
+  // known once they have been printed, so it goes last.
+  rpc_respond(ri, "{retval: %B, idx: %d, samples: %M, next: %M}", true, cs.idx,
+              json_channel_samples, &cs, json_channel_samples_next, &cs);
   ri = NULL;
   return;
 }
 
-static void rpc_channel_get_kwh(struct mg_rpc_request_info *ri, void *cb_arg,
-                                struct mg_rpc_frame_info *fi,
-                                struct mg_str args) {
+struct channel_history {
+  int idx;
+  int resolution;
+  double since;
+};
+
+static int json_channel_history(struct json_out *out, va_list *ap) {
+  const struct channel_history *h = va_arg(*ap, const struct channel_history *);
+  struct rollup_sample sample;
+  int len = 0;
+  bool first = true;
+
+  len += json_printf(out, "[");
+  for (int i = 0; rollup_get(h->idx, h->resolution, i, &sample); i++) {
+    if (sample.start < h->since) continue;
+    len += json_printf(out,
+                       "%s{t: %.f, min: %.2f, avg: %.2f, max: %.2f, n: %d, "
+                       "wh: %.3f}",
+                       first ? "" : ", ", sample.start, sample.min * 0.01,
+                       sample.avg * 0.01, sample.max * 0.01, sample.count,
+                       modbus_centiamp_msecs_to_kwh(sample.centiamp_msecs) *
+                           1000);
+    first = false;
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_channel_get_history(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  struct channel_history h = {-1, ROLLUP_RES_MINUTE, 0};
+
+  rpc_log(ri, args);
+  json_scanf(args.p, args.len, ri->args_fmt, &h.idx, &h.resolution, &h.since);
+  if (h.idx < 0 || h.idx >= modbus_num_channels()) {
+    rpc_error(ri, 400, "idx must be between 0..%d", modbus_num_channels() - 1);
+    return;
+  }
+  if (h.resolution != ROLLUP_RES_MINUTE && h.resolution != ROLLUP_RES_HOUR) {
+    rpc_error(ri, 400, "resolution must be %d or %d", ROLLUP_RES_MINUTE,
+              ROLLUP_RES_HOUR);
+    return;
+  }
+  rpc_respond(ri, "{retval: %B, idx: %d, resolution: %d, history: %M}", true,
+              h.idx, h.resolution, json_channel_history, &h);
+  ri = NULL;
+  return;
+}
+
+static int json_stats_summary(struct json_out *out,
+                              const struct stats_summary *s) {
+  return json_printf(out,
+                     "{start: %.f, n: %u, min: %.2f, max: %.2f, mean: %.3f, "
+                     "stddev: %.3f, p50: %.2f, p95: %.2f, p99: %.2f}",
+                     s->start, (unsigned) s->count, s->min * 0.01,
+                     s->max * 0.01, s->mean * 0.01, s->stddev * 0.01,
+                     s->p50 * 0.01, s->p95 * 0.01, s->p99 * 0.01);
+}
+
+static int json_channel_stats(struct json_out *out, va_list *ap) {
+  int idx = va_arg(*ap, int);
+  struct stats_summary s;
+  int len = 0;
+  bool first = true;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < modbus_num_channels(); i++) {
+    if (idx != -1 && idx != i) continue;
+    len += json_printf(out, "%s{idx: %d, window: ", first ? "" : ", ", i);
+    first = false;
+    stats_get(i, false, &s);
+    len += json_stats_summary(out, &s);
+    len += json_printf(out, ", last: ");
+    stats_get(i, true, &s);
+    len += json_stats_summary(out, &s);
+    len += json_printf(out, "}");
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_channel_get_stats(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, struct mg_rpc_frame_info *fi,
+                                  struct mg_str args) {
   int idx = -1;
-  double kwh;
 
   rpc_log(ri, args);
   if (!valid_idx(args, ri, &idx)) return;
 
-  if (idx != -1) {
-    if (!modbus_channel_get_kwh(idx, &kwh)) {
-      mg_rpc_send_errorf(ri, 500, "could not get kWh for channel %d", idx);
-      return;
-    } else {
-      mg_rpc_send_responsef(ri, "{retval: %B, idx: %d, kwh: %.2f}", true, idx,
-                            kwh);
-      return;
+  rpc_respond(ri, "{retval: %B, window: %d, stats: %M}", true,
+              mgos_sys_config_get_pdu_stats_window(), json_channel_stats, idx);
+  ri = NULL;
+  return;
+}
+
+// Operations in one Channel.Batch call at most, after expanding idx -1.
+#define RPC_BATCH_MAX_OPS (2 * PDU_MAX_CHANNELS)
+
+static struct modbus_channel_op s_batch_ops[RPC_BATCH_MAX_OPS];
+
+static void rpc_channel_batch(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  struct channel_get_all *ga = &s_get_all;
+  struct modbus_channel_op *op;
+  struct json_token t;
+  int num_ops = 0;
+  bool persist = true;
+  char *type;
+  double kwh;
+  int idx;
+  int i, first, last;
+
+  rpc_log(ri, args);
+  memset(ga, 0, sizeof(*ga));
+  ga->fields = CHANNEL_FIELD_MASK_ALL;
+  json_scanf(args.p, args.len, "{persist: %B}", &persist);
+
+  for (i = 0; json_scanf_array_elem(args.p, args.len, ".ops", i, &t) > 0;
+       i++) {
+    type = NULL;
+    idx = -2;
+    kwh = -1;
+    json_scanf(t.ptr, t.len, "{op: %Q, idx: %d, kwh: %lf}", &type, &idx, &kwh);
+    if (idx < -1 || idx >= modbus_num_channels()) {
+      rpc_error(ri, 400, "ops[%d]: idx must be between 0..%d or -1 for all", i,
+                modbus_num_channels() - 1);
+      goto exit;
     }
-  } else {
-    char rpl_str[1000];
-    struct json_out rpl = JSON_OUT_BUF(rpl_str, sizeof(rpl_str));
-    json_printf(&rpl, "{ retval: %B, kwh: [", true);
-    for (idx = 0; idx < PDU_NUM_CHANNELS; idx++) {
-      if (idx > 0) json_printf(&rpl, ",");
-      kwh = 0;
-      if (!modbus_channel_get_kwh(idx, &kwh)) {
-        mg_rpc_send_errorf(ri, 500, "could not get kWh for channel %d", idx);
-        return;
+    // idx -1 applies the operation to every channel.
+    first = idx == -1 ? 0 : idx;
+    last = idx == -1 ? modbus_num_channels() - 1 : idx;
+    if (num_ops + last - first + 1 > RPC_BATCH_MAX_OPS) {
+      rpc_error(ri, 400, "more than %d operations", RPC_BATCH_MAX_OPS);
+      goto exit;
+    }
+    for (idx = first; idx <= last; idx++) {
+      op = &s_batch_ops[num_ops++];
+      op->chan = idx;
+      op->kwh = kwh;
+      if (type && 0 == strcmp(type, "read")) {
+        op->type = MODBUS_CHANNEL_OP_READ;
+      } else if (type && 0 == strcmp(type, "clear")) {
+        op->type = MODBUS_CHANNEL_OP_CLEAR;
+      } else if (type && 0 == strcmp(type, "set") && kwh >= 0) {
+        op->type = MODBUS_CHANNEL_OP_SET_KWH;
+      } else {
+        rpc_error(ri, 400, "ops[%d]: op must be read, clear or set", i);
+        goto exit;
       }
-      json_printf(&rpl, "%.2f", kwh);
+      ga->idx[idx] = true;
     }
-    json_printf(&rpl, "] }");
-    mg_rpc_send_responsef(ri, "%s", rpl_str);
-    return;
+    free(type);
+  }
+  type = NULL;
+  if (num_ops == 0) {
+    rpc_error(ri, 400, "ops must hold at least one operation");
+    goto exit;
   }
 
-  /* NOTREACH */
+  if (!modbus_channel_batch(s_batch_ops, num_ops, persist, s_frames)) {
+    rpc_error(ri, 500, "could not %s batch",
+              persist ? "apply or persist" : "apply");
+    goto exit;
+  }
+  rpc_respond(ri, "{retval: %B, persisted: %B, channels: %M}", true, persist,
+              json_channel_get_all, ga);
   ri = NULL;
+
+exit:
+  free(type);
   return;
 }
 
@@ -196,20 +532,23 @@ static void rpc_channel_clear(struct mg_rpc_request_info *ri, void *cb_arg,
 
   if (idx != -1) {
     if (!modbus_channel_clear(idx, false)) {
-      mg_rpc_send_errorf(ri, 500, "could not clear channel %d", idx);
+      rpc_error(ri, 500, "could not clear channel %d", idx);
       return;
     } else {
-      mg_rpc_send_responsef(ri, "{retval: %B}", true);
+      rpc_respond(ri, "{retval: %B}", true);
       return;
     }
   } else {
-    for (idx = 0; idx < PDU_NUM_CHANNELS; idx++) {
-      if (!modbus_channel_clear(idx, false)) {
-        mg_rpc_send_errorf(ri, 500, "could not clear channel %d", idx);
-        return;
-      }
+    for (idx = 0; idx < modbus_num_channels(); idx++) {
+      s_batch_ops[idx].type = MODBUS_CHANNEL_OP_CLEAR;
+      s_batch_ops[idx].chan = idx;
+    }
+    if (!modbus_channel_batch(s_batch_ops, modbus_num_channels(), false,
+                              NULL)) {
+      rpc_error(ri, 500, "could not clear channels");
+      return;
     }
-    mg_rpc_send_responsef(ri, "{retval: %B}", true);
+    rpc_respond(ri, "{retval: %B}", true);
     return;
   }
 
@@ -218,13 +557,56 @@ static void rpc_channel_clear(struct mg_rpc_request_info *ri, void *cb_arg,
   return;
 }
 
+static int json_alerts_active(struct json_out *out, va_list *ap) {
+  int len = 0;
+  bool comma = false;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < modbus_num_channels(); i++) {
+    if (!alert_channel_active(i)) continue;
+    len += json_printf(out, "%s{type: %Q, idx: %d}", comma ? ", " : "",
+                       "channel", i);
+    comma = true;
+  }
+  for (int d = 0; d < modbus_num_devices(); d++) {
+    if (!alert_total_active(d)) continue;
+    len += json_printf(out, "%s{type: %Q, idx: %d}", comma ? ", " : "",
+                       "total", d);
+    comma = true;
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_alert_status(struct mg_rpc_request_info *ri, void *cb_arg,
+                             struct mg_rpc_frame_info *fi,
+                             struct mg_str args) {
+  struct alert_stats stats;
+  double mean_ms = 0;
+
+  rpc_log(ri, args);
+  alert_get_stats(&stats);
+  if (stats.latency_count > 0)
+    mean_ms = stats.latency_total_us / 1000. / stats.latency_count;
+  rpc_respond(ri,
+              "{retval: %B, active: %M, raised: %u, cleared: %u, "
+              "latency: {n: %u, last_ms: %.1f, max_ms: %.1f, "
+              "mean_ms: %.1f, over_interval: %u}}",
+              true, json_alerts_active, (unsigned) stats.raised,
+              (unsigned) stats.cleared, (unsigned) stats.latency_count,
+              stats.latency_last_us / 1000., stats.latency_max_us / 1000.,
+              mean_ms, (unsigned) stats.latency_over_interval);
+  ri = NULL;
+  return;
+}
+
 static void rpc_state_read(struct mg_rpc_request_info *ri, void *cb_arg,
                            struct mg_rpc_frame_info *fi, struct mg_str args) {
   rpc_log(ri, args);
   if (!modbus_state_read(STATE_FILENAME)) {
-    mg_rpc_send_errorf(ri, 500, "FAILED");
+    rpc_error(ri, 500, "FAILED");
   } else {
-    mg_rpc_send_responsef(ri, "{retval: %B}", true);
+    rpc_respond(ri, "{retval: %B}", true);
   }
   ri = NULL;
   return;
@@ -234,26 +616,333 @@ static void rpc_state_write(struct mg_rpc_request_info *ri, void *cb_arg,
                             struct mg_rpc_frame_info *fi, struct mg_str args) {
   rpc_log(ri, args);
   if (!modbus_state_write()) {
-    mg_rpc_send_errorf(ri, 500, "FAILED");
+    rpc_error(ri, 500, "FAILED");
   } else {
-    mg_rpc_send_responsef(ri, "{retval: %B}", true);
+    rpc_respond(ri, "{retval: %B}", true);
+  }
+  ri = NULL;
+  return;
+}
+
+static int json_modbus_faults(struct json_out *out, va_list *ap) {
+  const struct modbus_stats *stats = va_arg(*ap, const struct modbus_stats *);
+  int len = 0;
+
+  len += json_printf(out, "{");
+  for (int i = 0; i < MODBUS_NUM_FAULTS; i++)
+    len += json_printf(out, "%s%Q: %u", i ? ", " : "", modbus_fault_name(i),
+                       (unsigned) stats->faults[i]);
+  len += json_printf(out, "}");
+  return len;
+}
+
+static int json_modbus_latency(struct json_out *out, va_list *ap) {
+  const struct modbus_stats *stats = va_arg(*ap, const struct modbus_stats *);
+  double mean_ms = 0;
+  int len = 0;
+
+  if (stats->latency_count > 0)
+    mean_ms = stats->latency_total_us / 1000. / stats->latency_count;
+  len += json_printf(out,
+                     "{n: %u, min_ms: %.1f, max_ms: %.1f, mean_ms: %.1f, "
+                     "buckets: [",
+                     (unsigned) stats->latency_count,
+                     stats->latency_min_us / 1000.,
+                     stats->latency_max_us / 1000., mean_ms);
+  for (int i = 0; i < MODBUS_LATENCY_BUCKETS; i++) {
+    uint32_t le = modbus_latency_bucket_ms(i);
+    if (le > 0)
+      len += json_printf(out, "%s{le_ms: %u, n: %u}", i ? ", " : "",
+                         (unsigned) le, (unsigned) stats->latency_buckets[i]);
+    else
+      len += json_printf(out, "%s{le_ms: %Q, n: %u}", i ? ", " : "", NULL,
+                         (unsigned) stats->latency_buckets[i]);
+  }
+  len += json_printf(out, "]}");
+  return len;
+}
+
+static void rpc_modbus_stats(struct mg_rpc_request_info *ri, void *cb_arg,
+                             struct mg_rpc_frame_info *fi,
+                             struct mg_str args) {
+  struct modbus_stats stats;
+
+  rpc_log(ri, args);
+  if (!modbus_get_stats(&stats)) {
+    rpc_error(ri, 500, "could not get modbus stats");
+    return;
+  }
+  rpc_respond(ri,
+              "{retval: %B, reads: %llu, responses: %llu, "
+              "invalid: %llu, send_failures: %u, stale_skips: %u, "
+              "missed_deadlines: %u, task_drops: %u, faults: %M, "
+              "latency: %M}",
+              true, (unsigned long long) stats.reads,
+              (unsigned long long) stats.responses,
+              (unsigned long long) stats.responses_invalid,
+              (unsigned) stats.send_failures, (unsigned) stats.stale_skips,
+              (unsigned) stats.missed_deadlines, (unsigned) stats.task_drops,
+              json_modbus_faults, &stats, json_modbus_latency, &stats);
+  ri = NULL;
+  return;
+}
+
+static int json_budget_sections(struct json_out *out, va_list *ap) {
+  struct budget_timing t;
+  int len = 0;
+
+  len += json_printf(out, "{");
+  for (int i = 0; i < BUDGET_NUM_SECTIONS; i++) {
+    budget_get_timing(i, &t);
+    len += json_printf(out, "%s%Q: {n: %u, max_us: %u, mean_us: %u}",
+                       i ? ", " : "", budget_section_name(i),
+                       (unsigned) t.count, (unsigned) t.max_us,
+                       t.count ? (unsigned) (t.total_us / t.count) : 0);
+  }
+  len += json_printf(out, "}");
+  return len;
+}
+
+static int json_budget_flash(struct json_out *out, va_list *ap) {
+  struct budget_flash_stats f;
+  int len = 0;
+
+  len += json_printf(out, "{");
+  for (int i = 0; i < BUDGET_NUM_FLASH; i++) {
+    budget_get_flash(i, &f);
+    len += json_printf(out, "%s%Q: {writes: %u, bytes: %llu}", i ? ", " : "",
+                       budget_flash_name(i), (unsigned) f.writes,
+                       (unsigned long long) f.bytes);
+  }
+  len += json_printf(out, "}");
+  return len;
+}
+
+static int json_budget_heap_sample(struct json_out *out,
+                                   const struct budget_heap_sample *h) {
+  return json_printf(out,
+                     "{uptime: %u, free: %u, min_free: %u, largest_free: %u}",
+                     (unsigned) h->uptime, (unsigned) h->free,
+                     (unsigned) h->min_free, (unsigned) h->largest_free);
+}
+
+static int json_budget_heap(struct json_out *out, va_list *ap) {
+  static struct budget_heap_sample history[BUDGET_HEAP_SAMPLES];
+  struct budget_heap_sample now;
+  int n = budget_heap_history(history, BUDGET_HEAP_SAMPLES);
+  int len = 0;
+
+  budget_heap_now(&now);
+  len += json_printf(out, "{now: ");
+  len += json_budget_heap_sample(out, &now);
+  len += json_printf(out, ", interval: %d, history: [", BUDGET_HEAP_INTERVAL);
+  for (int i = 0; i < n; i++) {
+    if (i) len += json_printf(out, ", ");
+    len += json_budget_heap_sample(out, &history[i]);
+  }
+  len += json_printf(out, "]}");
+  return len;
+}
+
+static int json_budget_tasks(struct json_out *out, va_list *ap) {
+  const char *name;
+  uint32_t min_free;
+  int len = 0;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < budget_num_tasks(); i++) {
+    if (!budget_task_stack(i, &name, &min_free)) continue;
+    len += json_printf(out, "%s{name: %Q, stack_min_free: %u}", i ? ", " : "",
+                       name, (unsigned) min_free);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_sys_budget(struct mg_rpc_request_info *ri, void *cb_arg,
+                           struct mg_rpc_frame_info *fi, struct mg_str args) {
+  rpc_log(ri, args);
+  rpc_respond(ri, "{retval: %B, tasks: %M, heap: %M, flash: %M, sections: %M}",
+              true, json_budget_tasks, json_budget_heap, json_budget_flash,
+              json_budget_sections);
+  ri = NULL;
+  return;
+}
+
+// Handlers registered through rpc_add_handler(), which are timed.
+#define RPC_MAX_HANDLERS 32
+#define RPC_LATENCY_BUCKETS 10
+
+// Upper bounds of the handler latency buckets; the last one is unbounded.
+static const uint32_t s_rpc_latency_bucket_us[RPC_LATENCY_BUCKETS] = {
+    100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 0};
+
+struct rpc_handler {
+  const char *method;
+  mg_handler_cb_t cb;
+  void *cb_arg;
+  uint32_t calls;
+  uint32_t errors;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint64_t request_bytes;
+  uint64_t reply_bytes;
+  uint32_t reply_max_bytes;
+  uint32_t latency_buckets[RPC_LATENCY_BUCKETS];
+};
+
+static struct rpc_handler s_handlers[RPC_MAX_HANDLERS];
+static int s_num_handlers = 0;
+static double s_stats_since = 0;  // mgos_uptime() the counters started at
+
+static void rpc_timed_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  struct rpc_handler *h = (struct rpc_handler *) cb_arg;
+  int64_t start_us = mgos_uptime_micros();
+  uint32_t us;
+  int b;
+
+  s_reply_len = 0;
+  s_reply_error = false;
+  h->cb(ri, h->cb_arg, fi, args);
+  us = mgos_uptime_micros() - start_us;
+  budget_time(BUDGET_SECTION_RPC, start_us);
+
+  h->calls++;
+  if (s_reply_error) h->errors++;
+  h->total_us += us;
+  if (us > h->max_us) h->max_us = us;
+  for (b = 0; b < RPC_LATENCY_BUCKETS - 1; b++)
+    if (us <= s_rpc_latency_bucket_us[b]) break;
+  h->latency_buckets[b]++;
+  h->request_bytes += args.len;
+  h->reply_bytes += s_reply_len;
+  if (s_reply_len > h->reply_max_bytes) h->reply_max_bytes = s_reply_len;
+}
+
+static void rpc_add_handler(struct mg_rpc *c, const char *method,
+                            const char *args_fmt, mg_handler_cb_t cb,
+                            void *cb_arg) {
+  struct rpc_handler *h;
+
+  if (s_num_handlers == RPC_MAX_HANDLERS) {
+    LOG(LL_ERROR, ("Too many RPC handlers, %s is not timed", method));
+    mg_rpc_add_handler(c, method, args_fmt, cb, cb_arg);
+    return;
   }
+  h = &s_handlers[s_num_handlers++];
+  h->method = method;
+  h->cb = cb;
+  h->cb_arg = cb_arg;
+  mg_rpc_add_handler(c, method, args_fmt, rpc_timed_handler, h);
+}
+
+/* rpc_latency_quantile(): Return the upper bound in microseconds of the
+ * latency bucket holding quantile q of the calls of h, or 0 if that is the
+ * unbounded bucket or there were no calls.
+ */
+static uint32_t rpc_latency_quantile(const struct rpc_handler *h, double q) {
+  uint32_t rank = (uint32_t) ceil(q * h->calls);
+  uint32_t seen = 0;
+
+  if (h->calls == 0) return 0;
+  for (int b = 0; b < RPC_LATENCY_BUCKETS; b++) {
+    seen += h->latency_buckets[b];
+    if (seen >= rank) return s_rpc_latency_bucket_us[b];
+  }
+  return 0;
+}
+
+static int json_rpc_latency_us(struct json_out *out, uint32_t us) {
+  if (us == 0) return json_printf(out, "%Q", NULL);
+  return json_printf(out, "%u", (unsigned) us);
+}
+
+static int json_rpc_methods(struct json_out *out, va_list *ap) {
+  double elapsed = mgos_uptime() - s_stats_since;
+  const struct rpc_handler *h;
+  int len = 0;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < s_num_handlers; i++) {
+    h = &s_handlers[i];
+    if (i) len += json_printf(out, ", ");
+    len += json_printf(
+        out,
+        "{method: %Q, calls: %u, errors: %u, per_second: %.2f, "
+        "mean_us: %u, max_us: %u, p50_us: ",
+        h->method, (unsigned) h->calls, (unsigned) h->errors,
+        elapsed > 0 ? h->calls / elapsed : 0.,
+        h->calls ? (unsigned) (h->total_us / h->calls) : 0,
+        (unsigned) h->max_us);
+    len += json_rpc_latency_us(out, rpc_latency_quantile(h, 0.50));
+    len += json_printf(out, ", p99_us: ");
+    len += json_rpc_latency_us(out, rpc_latency_quantile(h, 0.99));
+    len += json_printf(out,
+                       ", request_bytes: %u, reply_bytes: %u, "
+                       "reply_max_bytes: %u}",
+                       h->calls ? (unsigned) (h->request_bytes / h->calls) : 0,
+                       h->calls ? (unsigned) (h->reply_bytes / h->calls) : 0,
+                       (unsigned) h->reply_max_bytes);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void rpc_sys_rpc_stats(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  bool reset = false;
+
+  rpc_log(ri, args);
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  rpc_respond(ri, "{retval: %B, seconds: %.1f, methods: %M}", true,
+              mgos_uptime() - s_stats_since, json_rpc_methods);
   ri = NULL;
+
+  // Counters restart after the reply, which still covers the old period;
+  // this call itself is then accounted to the new one.
+  if (!reset) return;
+  for (int i = 0; i < s_num_handlers; i++) {
+    struct rpc_handler *h = &s_handlers[i];
+    memset(&h->calls, 0, sizeof(*h) - offsetof(struct rpc_handler, calls));
+  }
+  s_stats_since = mgos_uptime();
   return;
 }
 
 void rpc_init() {
   struct mg_rpc *c = mgos_rpc_get_global();
 
-  mg_rpc_add_handler(c, "Channel.GetCurrent", "{idx: %d}",
-                     rpc_channel_get_current, NULL);
-  mg_rpc_add_handler(c, "Channel.GetFrequency", "{idx: %d}",
-                     rpc_channel_get_frequency, NULL);
-  mg_rpc_add_handler(c, "Channel.GetRatio", "{idx: %d}", rpc_channel_get_ratio,
-                     NULL);
-  mg_rpc_add_handler(c, "Channel.GetkWh", "{idx: %d}", rpc_channel_get_kwh,
-                     NULL);
-  mg_rpc_add_handler(c, "Channel.Clear", "{idx: %d}", rpc_channel_clear, NULL);
-  mg_rpc_add_handler(c, "State.Read", "{}", rpc_state_read, NULL);
-  mg_rpc_add_handler(c, "State.Write", "{}", rpc_state_write, NULL);
+  rpc_add_handler(c, "Channel.GetCurrent", "{idx: %d}", rpc_channel_get_field,
+                  (void *) (intptr_t) CHANNEL_FIELD_CURRENT);
+  rpc_add_handler(c, "Channel.GetFrequency", "{idx: %d}", rpc_channel_get_field,
+                  (void *) (intptr_t) CHANNEL_FIELD_FREQUENCY);
+  rpc_add_handler(c, "Channel.GetRatio", "{idx: %d}", rpc_channel_get_field,
+                  (void *) (intptr_t) CHANNEL_FIELD_RATIO);
+  rpc_add_handler(c, "Channel.GetkWh", "{idx: %d}", rpc_channel_get_field,
+                  (void *) (intptr_t) CHANNEL_FIELD_KWH);
+  rpc_add_handler(c, "Channel.GetAll", "{idx: [%d], fields: [%Q]}",
+                  rpc_channel_get_all, NULL);
+  rpc_add_handler(c, "Channel.GetHistory",
+                  "{idx: %d, resolution: %d, since: %lf}",
+                  rpc_channel_get_history, NULL);
+  rpc_add_handler(c, "Channel.GetSamples",
+                  "{idx: %d, since: %lf, until: %lf, max: %d}",
+                  rpc_channel_get_samples, NULL);
+  rpc_add_handler(c, "Channel.GetStats", "{idx: %d}", rpc_channel_get_stats,
+                  NULL);
+  rpc_add_handler(c, "Channel.GetRaw", "{since_seq: %u}", rpc_channel_get_raw,
+                  NULL);
+  rpc_add_handler(c, "Channel.Clear", "{idx: %d}", rpc_channel_clear, NULL);
+  rpc_add_handler(c, "Channel.Batch",
+                  "{ops: [{op: %Q, idx: %d, kwh: %lf}], persist: %B}",
+                  rpc_channel_batch, NULL);
+  rpc_add_handler(c, "Alert.Status", "{}", rpc_alert_status, NULL);
+  rpc_add_handler(c, "Modbus.Stats", "{}", rpc_modbus_stats, NULL);
+  rpc_add_handler(c, "State.Read", "{}", rpc_state_read, NULL);
+  rpc_add_handler(c, "State.Write", "{}", rpc_state_write, NULL);
+  rpc_add_handler(c, "Sys.Budget", "{}", rpc_sys_budget, NULL);
+  rpc_add_handler(c, "Sys.RpcStats", "{reset: %B}", rpc_sys_rpc_stats, NULL);
 }
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "stats.h"
+
+#include <math.h>
+
+struct stats_window {
+  double start;
+  uint32_t count;
+  uint16_t min;
+  uint16_t max;
+  float mean;  // Welford's running mean and sum of squared deviations
+  float m2;
+  uint32_t hist[STATS_HIST_BUCKETS];
+};
+
+struct stats_channel {
+  struct stats_window window;
+  struct stats_summary last;
+};
+
+static struct stats_channel *s_stats = NULL;
+static int s_num_channels = 0;
+
+static int stats_bucket(uint16_t x) {
+  int o;
+
+  if (x == 0) return 0;
+  o = 31 - __builtin_clz(x);
+  return 1 + o * STATS_HIST_SUB + ((((uint32_t) x << 2) >> o) & 3);
+}
+
+// Midpoint of the values that fall in bucket b.
+static uint16_t stats_bucket_value(int b) {
+  int o, sub;
+  uint32_t lo, hi;
+
+  if (b == 0) return 0;
+  o = (b - 1) / STATS_HIST_SUB;
+  sub = (b - 1) % STATS_HIST_SUB;
+  lo = ((4 + sub) << o) >> 2;
+  hi = ((5 + sub) << o) >> 2;
+  if (hi > lo) hi--;
+  return (lo + hi) / 2;
+}
+
+static uint16_t stats_percentile(const struct stats_window *w, int pct) {
+  uint32_t rank = (uint32_t) (((uint64_t) w->count * pct + 99) / 100);
+  uint32_t seen = 0;
+
+  for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+    seen += w->hist[b];
+    if (seen >= rank && seen > 0) {
+      uint16_t v = stats_bucket_value(b);
+      // The exact extremes are known, so never report beyond them.
+      if (v < w->min) v = w->min;
+      if (v > w->max) v = w->max;
+      return v;
+    }
+  }
+  return w->max;
+}
+
+static void stats_summarize(const struct stats_window *w,
+                            struct stats_summary *s) {
+  memset(s, 0, sizeof(*s));
+  s->start = w->start;
+  s->count = w->count;
+  if (w->count == 0) return;
+  s->min = w->min;
+  s->max = w->max;
+  s->mean = w->mean;
+  s->stddev = w->count > 1 ? sqrtf(w->m2 / (w->count - 1)) : 0;
+  s->p50 = stats_percentile(w, 50);
+  s->p95 = stats_percentile(w, 95);
+  s->p99 = stats_percentile(w, 99);
+}
+
+bool stats_init(int num_channels) {
+  s_stats = calloc(num_channels, sizeof(struct stats_channel));
+  if (!s_stats) {
+    LOG(LL_ERROR, ("Could not allocate statistics for %d channels",
+                   num_channels));
+    return false;
+  }
+  s_num_channels = num_channels;
+  return true;
+}
+
+void stats_update(uint8_t chan, double now, uint16_t raw_current) {
+  int window = mgos_sys_config_get_pdu_stats_window();
+  struct stats_channel *c;
+  struct stats_window *w;
+  double start;
+  float delta;
+
+  if (!s_stats || chan >= s_num_channels) return;
+  c = &s_stats[chan];
+  w = &c->window;
+
+  if (window <= 0) window = 3600;
+  start = (double) ((int64_t) now / window * window);
+  if (start > w->start) {
+    if (w->count > 0) stats_summarize(w, &c->last);
+    memset(w, 0, sizeof(*w));
+    w->start = start;
+  }
+
+  if (w->count == 0 || raw_current < w->min) w->min = raw_current;
+  if (w->count == 0 || raw_current > w->max) w->max = raw_current;
+  w->count++;
+  delta = raw_current - w->mean;
+  w->mean += delta / w->count;
+  w->m2 += delta * (raw_current - w->mean);
+  w->hist[stats_bucket(raw_current)]++;
+}
+
+void stats_reset(uint8_t chan) {
+  if (!s_stats || chan >= s_num_channels) return;
+  memset(&s_stats[chan], 0, sizeof(struct stats_channel));
+}
+
+bool stats_get(uint8_t chan, bool last, struct stats_summary *summary) {
+  if (!s_stats || chan >= s_num_channels || !summary) return false;
+  if (last) {
+    memcpy(summary, &s_stats[chan].last, sizeof(*summary));
+  } else {
+    stats_summarize(&s_stats[chan].window, summary);
+  }
+  return true;
+}
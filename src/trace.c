@@ -0,0 +1,147 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "trace.h"
+#include "budget.h"
+
+// Largest response recorded; a full read of all register blocks is 117 bytes.
+#define TRACE_FRAME_MAX 256
+
+static bool s_enabled = false;
+static size_t s_file_size = 0;
+static size_t s_buf_len = 0;
+static uint8_t s_buf[TRACE_BUF_SIZE];
+
+static void trace_reboot_handler(int ev, void *ev_data, void *userdata) {
+  trace_flush();
+}
+
+bool trace_init(void) {
+  const char *filename = mgos_sys_config_get_pdu_trace_file();
+  uint32_t magic = TRACE_MAGIC;
+  struct stat st;
+  int fd;
+
+  if (!filename || !*filename) return true;
+  if (0 == stat(filename, &st) && st.st_size > 0) {
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || read(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+        magic != TRACE_MAGIC) {
+      LOG(LL_ERROR, ("%s: Not a trace file, not capturing", filename));
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    close(fd);
+    s_file_size = st.st_size;
+  } else {
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+      return false;
+    }
+    if (write(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+      close(fd);
+      return false;
+    }
+    close(fd);
+    s_file_size = sizeof(magic);
+  }
+  s_enabled = true;
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, trace_reboot_handler, NULL);
+  LOG(LL_INFO, ("Capturing Modbus responses to %s (%d bytes)", filename,
+                (int) s_file_size));
+  return true;
+}
+
+void trace_push(uint8_t addr, uint8_t status, uint8_t first_reg,
+                uint8_t num_regs, int64_t request_us, int64_t response_us,
+                double response_time, const void *buf, size_t len) {
+  struct trace_record rec;
+
+  if (!s_enabled) return;
+  if (len > TRACE_FRAME_MAX) len = TRACE_FRAME_MAX;
+  if (s_file_size + s_buf_len + sizeof(rec) + len >
+      (size_t) mgos_sys_config_get_pdu_trace_max_size()) {
+    LOG(LL_WARN, ("%s: Reached %d bytes, capture stopped",
+                  mgos_sys_config_get_pdu_trace_file(),
+                  mgos_sys_config_get_pdu_trace_max_size()));
+    trace_flush();
+    s_enabled = false;
+    return;
+  }
+  if (s_buf_len + sizeof(rec) + len > sizeof(s_buf) && !trace_flush()) return;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.request_us = request_us;
+  rec.response_us = response_us;
+  rec.response_time = response_time;
+  rec.addr = addr;
+  rec.status = status;
+  rec.first_reg = first_reg;
+  rec.num_regs = num_regs;
+  rec.len = len;
+  memcpy(s_buf + s_buf_len, &rec, sizeof(rec));
+  memcpy(s_buf + s_buf_len + sizeof(rec), buf, len);
+  s_buf_len += sizeof(rec) + len;
+}
+
+bool trace_flush(void) {
+  const char *filename = mgos_sys_config_get_pdu_trace_file();
+  bool ret;
+  int fd;
+
+  if (s_buf_len == 0) return true;
+  fd = open(filename, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  ret = write(fd, s_buf, s_buf_len) == (ssize_t) s_buf_len;
+  close(fd);
+  if (!ret) {
+    LOG(LL_ERROR, ("%s: Could not write %d bytes", filename, (int) s_buf_len));
+    return false;
+  }
+  budget_flash_write(BUDGET_FLASH_TRACE, s_buf_len);
+  s_file_size += s_buf_len;
+  s_buf_len = 0;
+  return true;
+}
+
+bool trace_read(const char *filename, trace_record_cb cb, void *arg) {
+  struct trace_record rec;
+  uint8_t buf[TRACE_FRAME_MAX];
+  uint32_t magic;
+  int fd;
+
+  if (!filename || !cb) return false;
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  if (read(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+      magic != TRACE_MAGIC) {
+    LOG(LL_ERROR, ("%s: Not a trace file", filename));
+    close(fd);
+    return false;
+  }
+  while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+    if (rec.len > sizeof(buf) || read(fd, buf, rec.len) != rec.len) break;
+    if (!cb(&rec, buf, arg)) break;
+  }
+  close(fd);
+  return true;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "tscodec.h"
+
+#include <string.h>
+
+static size_t varint_put(uint8_t *buf, uint64_t v) {
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    buf[n++] = (uint8_t) (v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (uint8_t) v;
+  return n;
+}
+
+// Returns the number of bytes consumed, or 0 if buf ends mid-varint.
+static size_t varint_get(const uint8_t *buf, size_t len, uint64_t *v) {
+  uint64_t r = 0;
+
+  for (size_t n = 0; n < len && n < 10; n++) {
+    r |= (uint64_t) (buf[n] & 0x7f) << (7 * n);
+    if (!(buf[n] & 0x80)) {
+      *v = r;
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t zigzag(int64_t v) {
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+void tscodec_reset(struct tscodec_state *s, int64_t base_ms) {
+  memset(s, 0, sizeof(*s));
+  s->prev_ms = base_ms;
+}
+
+size_t tscodec_encode(struct tscodec_state *s, int64_t t_ms,
+                      const uint16_t *values, uint8_t *buf) {
+  int64_t delta_ms = t_ms - s->prev_ms;
+  uint32_t mask = 0;
+  size_t n;
+
+  n = varint_put(buf, zigzag(delta_ms - s->prev_delta_ms));
+  for (int i = 0; i < TSCODEC_VALUES; i++)
+    if (values[i] != s->prev[i]) mask |= 1u << i;
+  n += varint_put(buf + n, mask);
+  for (int i = 0; i < TSCODEC_VALUES; i++) {
+    if (!(mask & (1u << i))) continue;
+    n += varint_put(buf + n, values[i] ^ s->prev[i]);
+    s->prev[i] = values[i];
+  }
+  s->prev_delta_ms = delta_ms;
+  s->prev_ms = t_ms;
+  return n;
+}
+
+size_t tscodec_decode(struct tscodec_state *s, const uint8_t *buf, size_t len,
+                      int64_t *t_ms, uint16_t *values) {
+  uint16_t next[TSCODEC_VALUES];
+  uint64_t dod, mask, v;
+  size_t n, used;
+
+  if (!(n = varint_get(buf, len, &dod))) return 0;
+  if (!(used = varint_get(buf + n, len - n, &mask))) return 0;
+  n += used;
+  memcpy(next, s->prev, sizeof(next));
+  for (int i = 0; i < TSCODEC_VALUES; i++) {
+    if (!(mask & (1u << i))) continue;
+    if (!(used = varint_get(buf + n, len - n, &v))) return 0;
+    n += used;
+    next[i] ^= (uint16_t) v;
+  }
+
+  s->prev_delta_ms += unzigzag(dod);
+  s->prev_ms += s->prev_delta_ms;
+  memcpy(s->prev, next, sizeof(next));
+  *t_ms = s->prev_ms;
+  memcpy(values, next, sizeof(next));
+  return n;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2021 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "tsdb.h"
+#include "budget.h"
+#include "tscodec.h"
+
+#define TSDB_WINDOW_SIZE (2 * TSCODEC_RECORD_MAX)
+
+struct tsdb_header {
+  uint32_t magic;
+  uint32_t seq;
+  int64_t base_ms;
+};
+
+struct tsdb_index {
+  uint32_t magic;
+  uint32_t first_seq;
+  uint32_t next_seq;
+};
+
+struct tsdb_series {
+  uint8_t addr;
+  uint32_t first_seq;  // Oldest segment on flash
+  uint32_t next_seq;   // Number of the next segment; next_seq - 1 is open
+  bool open;
+  size_t seg_bytes;  // Bytes of the open segment on flash
+  struct tscodec_state enc;
+  size_t buf_len;
+  uint8_t buf[TSDB_BUF_SIZE];
+};
+
+static struct tsdb_series *s_series = NULL;
+static int s_num_series = 0;
+
+static void tsdb_filename(char *buf, size_t len, uint8_t addr, uint32_t seq) {
+  snprintf(buf, len, "ts%d.%u", addr, (unsigned) seq);
+}
+
+static bool tsdb_index_write(const struct tsdb_series *s) {
+  struct tsdb_index idx = {TSDB_INDEX_MAGIC, s->first_seq, s->next_seq};
+  char filename[16];
+  bool ret;
+  int fd;
+
+  snprintf(filename, sizeof(filename), "ts%d.idx", s->addr);
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  ret = write(fd, &idx, sizeof(idx)) == sizeof(idx);
+  close(fd);
+  if (ret) budget_flash_write(BUDGET_FLASH_TSDB, sizeof(idx));
+  return ret;
+}
+
+static void tsdb_index_read(struct tsdb_series *s) {
+  struct tsdb_index idx;
+  char filename[16];
+  int fd;
+
+  s->first_seq = s->next_seq = 1;
+  snprintf(filename, sizeof(filename), "ts%d.idx", s->addr);
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return;
+  if (read(fd, &idx, sizeof(idx)) == sizeof(idx) &&
+      idx.magic == TSDB_INDEX_MAGIC && idx.first_seq <= idx.next_seq) {
+    s->first_seq = idx.first_seq;
+    s->next_seq = idx.next_seq;
+  }
+  close(fd);
+}
+
+static bool tsdb_series_flush(struct tsdb_series *s) {
+  char filename[16];
+  bool ret;
+  int fd;
+
+  if (!s->open || s->buf_len == 0) return true;
+  tsdb_filename(filename, sizeof(filename), s->addr, s->next_seq - 1);
+  fd = open(filename, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  ret = write(fd, s->buf, s->buf_len) == (ssize_t) s->buf_len;
+  close(fd);
+  if (!ret) {
+    LOG(LL_ERROR, ("%s: Could not write %d bytes", filename, (int) s->buf_len));
+    return false;
+  }
+  budget_flash_write(BUDGET_FLASH_TSDB, s->buf_len);
+  s->seg_bytes += s->buf_len;
+  s->buf_len = 0;
+  return true;
+}
+
+/* tsdb_series_rotate(): Close the open segment, start a new one at base_ms and
+ * remove the oldest segments beyond pdu.tsdb_budget.
+ */
+static bool tsdb_series_rotate(struct tsdb_series *s, int64_t base_ms) {
+  uint32_t max_segments = mgos_sys_config_get_pdu_tsdb_budget() /
+                          mgos_sys_config_get_pdu_tsdb_segment_size();
+  struct tsdb_header hdr = {TSDB_MAGIC, s->next_seq, base_ms};
+  char filename[16];
+  bool ret;
+  int fd;
+
+  if (!tsdb_series_flush(s)) {
+    // The samples cannot go into the closed segment, nor into the new one
+    // which starts after them.
+    LOG(LL_ERROR, ("Dropping %d bytes of samples of sensor %d",
+                   (int) s->buf_len, s->addr));
+    s->buf_len = 0;
+  }
+  s->open = false;
+  if (max_segments < 1) max_segments = 1;
+
+  tsdb_filename(filename, sizeof(filename), s->addr, hdr.seq);
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("%s: Could not open(): %s", filename, strerror(errno)));
+    return false;
+  }
+  ret = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+  close(fd);
+  if (!ret) return false;
+  budget_flash_write(BUDGET_FLASH_TSDB, sizeof(hdr));
+
+  s->next_seq++;
+  while (s->next_seq - s->first_seq > max_segments) {
+    tsdb_filename(filename, sizeof(filename), s->addr, s->first_seq++);
+    remove(filename);
+  }
+  tsdb_index_write(s);
+
+  s->open = true;
+  s->seg_bytes = sizeof(hdr);
+  tscodec_reset(&s->enc, base_ms);
+  return true;
+}
+
+static void tsdb_timer(void *arg) {
+  tsdb_flush();
+}
+
+static void tsdb_reboot_handler(int ev, void *ev_data, void *userdata) {
+  tsdb_flush();
+}
+
+bool tsdb_init(int num_devices) {
+  struct pdu pdu;
+
+  if (mgos_sys_config_get_pdu_tsdb_budget() <= 0) return true;
+  s_series = calloc(num_devices, sizeof(struct tsdb_series));
+  if (!s_series) {
+    LOG(LL_ERROR, ("Could not allocate time series buffers"));
+    return false;
+  }
+  s_num_series = num_devices;
+  for (int d = 0; d < num_devices; d++) {
+    if (!modbus_snapshot(d, &pdu)) continue;
+    s_series[d].addr = pdu.modbus_address;
+    tsdb_index_read(&s_series[d]);
+  }
+  mgos_set_timer(1000 * mgos_sys_config_get_pdu_tsdb_flush_interval(),
+                 MGOS_TIMER_REPEAT, tsdb_timer, NULL);
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, tsdb_reboot_handler, NULL);
+  return true;
+}
+
+void tsdb_append(uint8_t device, const struct pdu *pdu) {
+  struct tsdb_series *s;
+  uint16_t currents[TSCODEC_VALUES];
+  int64_t t_ms;
+
+  if (device >= s_num_series || !pdu) return;
+  // Samples are kept on wall clock time, so wait until it is set.
+  if (pdu->last_read_time < 1e9) return;
+  s = &s_series[device];
+  t_ms = (int64_t) (pdu->last_read_time * 1000);
+
+  if (!s->open || s->seg_bytes + s->buf_len + TSCODEC_RECORD_MAX >
+                      (size_t) mgos_sys_config_get_pdu_tsdb_segment_size()) {
+    if (!tsdb_series_rotate(s, t_ms)) return;
+  }
+  if (s->buf_len + TSCODEC_RECORD_MAX > sizeof(s->buf) &&
+      !tsdb_series_flush(s))
+    return;
+
+  for (int i = 0; i < TSCODEC_VALUES; i++)
+    currents[i] = pdu->pdu_channel[i].raw_current;
+  s->buf_len += tscodec_encode(&s->enc, t_ms, currents, s->buf + s->buf_len);
+}
+
+bool tsdb_flush(void) {
+  bool ret = true;
+
+  for (int d = 0; d < s_num_series; d++)
+    if (!tsdb_series_flush(&s_series[d])) ret = false;
+  return ret;
+}
+
+/* A window onto a segment, refilled from its file and then, for the open
+ * segment, from the RAM buffer.
+ */
+struct tsdb_reader {
+  int fd;
+  const uint8_t *tail;  // RAM buffer to continue with after the file
+  size_t tail_len;
+  size_t len;
+  uint8_t window[TSDB_WINDOW_SIZE];
+};
+
+static void tsdb_reader_fill(struct tsdb_reader *r) {
+  size_t n;
+
+  if (r->fd >= 0) {
+    int got = read(r->fd, r->window + r->len, sizeof(r->window) - r->len);
+    if (got > 0) {
+      r->len += got;
+      return;
+    }
+    close(r->fd);
+    r->fd = -1;
+  }
+  n = sizeof(r->window) - r->len;
+  if (n > r->tail_len) n = r->tail_len;
+  memcpy(r->window + r->len, r->tail, n);
+  r->len += n;
+  r->tail += n;
+  r->tail_len -= n;
+}
+
+/* tsdb_segment_read(): Decode one segment, calling cb for each sample in
+ * range.
+ *
+ * Returns: false if cb asked to stop, true otherwise.
+ */
+static bool tsdb_segment_read(const struct tsdb_series *s, uint32_t seq,
+                              int64_t since_ms, int64_t until_ms,
+                              tsdb_sample_cb cb, void *arg) {
+  struct tsdb_reader r = {.fd = -1};
+  struct tscodec_state dec;
+  struct tsdb_header hdr;
+  uint16_t currents[TSCODEC_VALUES];
+  char filename[16];
+  int64_t t_ms;
+  size_t used;
+  bool ret = true;
+
+  tsdb_filename(filename, sizeof(filename), s->addr, seq);
+  r.fd = open(filename, O_RDONLY);
+  if (r.fd < 0) return true;
+  if (read(r.fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != TSDB_MAGIC || hdr.seq != seq) {
+    close(r.fd);
+    return true;
+  }
+  if (s->open && seq == s->next_seq - 1) {
+    r.tail = s->buf;
+    r.tail_len = s->buf_len;
+  }
+
+  tscodec_reset(&dec, hdr.base_ms);
+  for (;;) {
+    used = tscodec_decode(&dec, r.window, r.len, &t_ms, currents);
+    if (used == 0) {
+      size_t len = r.len;
+      if (len == sizeof(r.window)) break;  // Corrupt record
+      tsdb_reader_fill(&r);
+      if (r.len == len) break;  // End of segment
+      continue;
+    }
+    r.len -= used;
+    memmove(r.window, r.window + used, r.len);
+    if (t_ms < since_ms || t_ms >= until_ms) continue;
+    if (!cb(t_ms / 1000., currents, arg)) {
+      ret = false;
+      break;
+    }
+  }
+  if (r.fd >= 0) close(r.fd);
+  return ret;
+}
+
+// Return the base time of a segment, or -1 if it cannot be read.
+static int64_t tsdb_segment_base(const struct tsdb_series *s, uint32_t seq) {
+  struct tsdb_header hdr;
+  char filename[16];
+  int64_t base_ms = -1;
+  int fd;
+
+  tsdb_filename(filename, sizeof(filename), s->addr, seq);
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == TSDB_MAGIC)
+    base_ms = hdr.base_ms;
+  close(fd);
+  return base_ms;
+}
+
+bool tsdb_read(uint8_t device, double since, double until, tsdb_sample_cb cb,
+               void *arg) {
+  const struct tsdb_series *s;
+  int64_t since_ms = (int64_t) (since * 1000);
+  int64_t until_ms = (int64_t) (until * 1000);
+  int64_t base_ms, next_base_ms = -1;
+
+  if (device >= s_num_series || !cb) return false;
+  s = &s_series[device];
+  if (s->first_seq < s->next_seq)
+    next_base_ms = tsdb_segment_base(s, s->first_seq);
+  for (uint32_t seq = s->first_seq; seq < s->next_seq; seq++) {
+    // Each segment header is read once, as the next segment of the previous
+    // iteration.
+    base_ms = next_base_ms;
+    next_base_ms = -1;
+    if (seq + 1 < s->next_seq) next_base_ms = tsdb_segment_base(s, seq + 1);
+    if (base_ms >= until_ms) break;
+    // Skip segments that end before since, as the next one starts before it.
+    if (next_base_ms >= 0 && next_base_ms <= since_ms) continue;
+    if (!tsdb_segment_read(s, seq, since_ms, until_ms, cb, arg)) break;
+  }
+  return true;
+}